@@ -0,0 +1,131 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include "log.h"
+#include "fs_log.h"
+#include "body_range.h"
+
+using namespace std;
+using namespace vmime;
+
+// enough to be sure we see the end of the first base64 line
+static const size_t PROBE_LENGTH = 512;
+
+static shared_ptr<const net::messagePart> filePart(shared_ptr<net::message> msg, size_t index)
+{
+    shared_ptr<const net::messageStructure> structure = msg->getStructure();
+    if (!structure || structure->getPartCount() == 0) {
+        return nullptr;
+    }
+    shared_ptr<const net::messagePart> root = structure->getPartAt(0);
+    if (index >= root->getPartCount()) {
+        return nullptr;
+    }
+    return root->getPartAt(index);
+}
+
+static size_t encodedOffset(const BodyLayoutT& layout, size_t chars)
+{
+    if (!layout._lineLength) {
+        return chars;
+    }
+    return chars + (chars / layout._lineLength) * layout._eolLength;
+}
+
+int learnLayout(shared_ptr<net::message> msg, BodyLayoutT& layout)
+{
+    layout = BodyLayoutT();
+    layout._known = true;
+
+    shared_ptr<const net::messageStructure> structure = msg->getStructure();
+    if (!structure || structure->getPartCount() == 0) {
+        LOGFN(LOG, CRIT) << "message has no structure";
+        return -EIO;
+    }
+    // messageBuilder gives us multipart/mixed with the warning text first
+    // and the file as the last part
+    shared_ptr<const net::messagePart> root = structure->getPartAt(0);
+    if (root->getPartCount() < 2) {
+        LOGFN(LOG, INFO) << "no separate attachment part, not ranged";
+        return 0;
+    }
+    layout._part = root->getPartCount() - 1;
+    shared_ptr<net::messagePart> part =
+        std::const_pointer_cast<net::messagePart>(root->getPartAt(layout._part));
+
+    try {
+        msg->fetchPartHeader(part);
+        shared_ptr<const encoding> enc =
+            part->getHeader()->ContentTransferEncoding()->getValue<const encoding>();
+        if (enc->getName() != "base64") {
+            LOGFN(LOG, INFO) << "attachment is " << enc->getName() << ", not ranged";
+            return 0;
+        }
+    }
+    catch (vmime::exception& e) {
+        LOGFN(LOG, INFO) << "can't tell attachment encoding: " << e.what();
+        return 0;
+    }
+
+    string probe;
+    utility::outputStreamStringAdapter os(probe);
+    msg->extractPart(part, os, NULL, 0, PROBE_LENGTH, true);
+    string::size_type eol = probe.find('\n');
+    if (eol == string::npos) {
+        if (probe.length() >= PROBE_LENGTH) {
+            LOGFN(LOG, INFO) << "couldn't find a line break, not ranged";
+            return 0;
+        }
+        layout._lineLength = 0;
+        layout._eolLength = 0;
+    }
+    else {
+        layout._eolLength = (eol > 0 && probe[eol - 1] == '\r') ? 2 : 1;
+        layout._lineLength = eol - (layout._eolLength - 1);
+        // lines have to hold whole 4 character groups for the offsets to map
+        if (layout._lineLength == 0 || layout._lineLength % 4) {
+            LOGFN(LOG, INFO) << "odd base64 line length " << layout._lineLength << ", not ranged";
+            return 0;
+        }
+    }
+    layout._ranged = true;
+    LOGFN(LOG, INFO) << "attachment is part " << layout._part << ", line length " << layout._lineLength;
+    return 0;
+}
+
+ssize_t readRange(shared_ptr<net::message> msg, const BodyLayoutT& layout, char* buf, size_t size, off_t offset)
+{
+    shared_ptr<const net::messagePart> part = filePart(msg, layout._part);
+    if (!part) {
+        LOGFN(LOG, CRIT) << "attachment part went missing";
+        return -EIO;
+    }
+
+    // every 3 decoded bytes are 4 encoded characters, round out to whole groups
+    size_t firstGroup = offset / 3;
+    size_t lastGroup = (offset + size + 2) / 3;
+    size_t start = encodedOffset(layout, firstGroup * 4);
+    size_t end = encodedOffset(layout, lastGroup * 4);
+
+    string encoded;
+    utility::outputStreamStringAdapter os(encoded);
+    msg->extractPart(part, os, NULL, start, end - start, true);
+    encoded.erase(remove_if(encoded.begin(), encoded.end(),
+                            [](char c) { return c == '\r' || c == '\n'; }), encoded.end());
+
+    byteArray decoded;
+    utility::inputStreamStringAdapter in(encoded);
+    utility::outputStreamByteArrayAdapter out(decoded);
+    shared_ptr<utility::encoder::encoder> dec =
+        utility::encoder::encoderFactory::getInstance()->create("base64");
+    dec->decode(in, out);
+
+    size_t skip = offset - firstGroup * 3;
+    if (decoded.size() <= skip) {
+        return 0;
+    }
+    size_t count = min(size, decoded.size() - skip);
+    memcpy(buf, &decoded[skip], count);
+    return count;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <memory>
+
+#include <vmime/vmime.hpp>
+
+// Where a file's bytes sit inside its message.  Learned once per UID so a
+// read can ask the server for just the encoded bytes it needs, using
+// BODY.PEEK[n]<offset.length>, instead of downloading the whole message.
+struct BodyLayoutT {
+    BodyLayoutT(): _known(false), _ranged(false), _part(0), _lineLength(0), _eolLength(0) { }
+
+    bool _known;
+    // only base64 with fixed length lines can be mapped, otherwise we
+    // fall back to fetching the whole attachment
+    bool _ranged;
+    // index of the attachment below the message's top-level part
+    size_t _part;
+    // base64 characters per line, 0 if the body is one long line
+    size_t _lineLength;
+    size_t _eolLength;
+};
+
+// fills in "layout" from the message structure and the first encoded line
+int learnLayout(std::shared_ptr<vmime::net::message> msg, BodyLayoutT& layout);
+
+// reads [offset, offset + size) of the decoded file, returns the number of
+// bytes read or -errno
+ssize_t readRange(std::shared_ptr<vmime::net::message> msg, const BodyLayoutT& layout,
+                  char* buf, size_t size, off_t offset);
@@ -0,0 +1,126 @@
+#include <cstdlib>
+#include <cstdio>
+
+#include <openssl/sha.h>
+
+#include "chunk_index.h"
+
+using namespace std;
+
+static bool lowerUID(const string& a, const string& b)
+{
+    return strtoul(a.c_str(), NULL, 10) < strtoul(b.c_str(), NULL, 10);
+}
+
+ChunkIndexT::ChunkIndexT():
+    _loaded(false)
+{ }
+
+string ChunkIndexT::hash(const void* data, size_t size)
+{
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256(static_cast<const unsigned char*>(data), size, md);
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        snprintf(hex + i * 2, 3, "%02x", md[i]);
+    }
+    return hex;
+}
+
+string ChunkIndexT::find(const string& hash)
+{
+    lock_guard<mutex> lock(_mutex);
+    map<string, string>::iterator iter = _byHash.find(hash);
+    if (iter == _byHash.end()) {
+        return "";
+    }
+    _fresh.insert(iter->second);
+    ++_pinned[iter->second];
+    return iter->second;
+}
+
+void ChunkIndexT::add(const string& hash, const string& uid)
+{
+    lock_guard<mutex> lock(_mutex);
+    if (!hash.empty()) {
+        _byHash[hash] = uid;
+    }
+    _byUID[uid] = hash;
+    _fresh.insert(uid);
+    ++_pinned[uid];
+}
+
+void ChunkIndexT::unpin(const vector<string>& uids)
+{
+    lock_guard<mutex> lock(_mutex);
+    for (vector<string>::const_iterator iter = uids.begin(); iter != uids.end(); ++iter) {
+        // the manifest referencing it may be in a mailbox the running
+        // sweep has already counted
+        _fresh.insert(*iter);
+        map<string, unsigned long>::iterator p = _pinned.find(*iter);
+        if (p != _pinned.end() && !--p->second) {
+            _pinned.erase(p);
+        }
+    }
+}
+
+void ChunkIndexT::pin(const vector<string>& uids)
+{
+    lock_guard<mutex> lock(_mutex);
+    for (vector<string>::const_iterator iter = uids.begin(); iter != uids.end(); ++iter) {
+        _fresh.insert(*iter);
+        ++_pinned[*iter];
+    }
+}
+
+void ChunkIndexT::load(const string& hash, const string& uid)
+{
+    lock_guard<mutex> lock(_mutex);
+    _byUID[uid] = hash;
+    if (hash.empty()) {
+        return;
+    }
+    map<string, string>::iterator iter = _byHash.find(hash);
+    if (iter == _byHash.end() || lowerUID(uid, iter->second)) {
+        _byHash[hash] = uid;
+    }
+}
+
+void ChunkIndexT::beginSweep()
+{
+    lock_guard<mutex> lock(_mutex);
+    _fresh.clear();
+}
+
+vector<string> ChunkIndexT::endSweep(const map<string, unsigned long>& refs)
+{
+    lock_guard<mutex> lock(_mutex);
+    vector<string> garbage;
+    set<string> unreferenced;
+    for (map<string, string>::iterator iter = _byUID.begin(); iter != _byUID.end(); ) {
+        const string& uid = iter->first;
+        if (refs.count(uid) || _fresh.count(uid) || _pinned.count(uid)) {
+            ++iter;
+            continue;
+        }
+        if (!_unreferenced.count(uid)) {
+            unreferenced.insert(uid);
+            ++iter;
+            continue;
+        }
+        map<string, string>::iterator h = _byHash.find(iter->second);
+        if (h != _byHash.end() && h->second == uid) {
+            _byHash.erase(h);
+        }
+        garbage.push_back(uid);
+        _byUID.erase(iter++);
+    }
+    _unreferenced.swap(unreferenced);
+    return garbage;
+}
+
+size_t ChunkIndexT::size()
+{
+    lock_guard<mutex> lock(_mutex);
+    return _byUID.size();
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// Content-addressed view of the chunk mailbox: every chunk is known by the
+// SHA-256 of its contents, so a chunk that's already on the server gets
+// referenced from the new manifest instead of uploaded again.  Chunks are
+// shared between files, so nothing deletes them directly; the collector
+// counts references from every manifest and sweeps the ones left at zero.
+class ChunkIndexT {
+public:
+    ChunkIndexT();
+
+    // hex SHA-256 of a chunk's contents
+    static std::string hash(const void* data, size_t size);
+
+    // UID of a chunk with this hash, or "" if we don't have one.  A hit
+    // pins the chunk, so no sweep frees it before the manifest that's
+    // about to reference it is on the server, see unpin()
+    std::string find(const std::string& hash);
+    // a chunk we just uploaded, pinned the same way
+    void add(const std::string& hash, const std::string& uid);
+    void unpin(const std::vector<std::string>& uids);
+    // chunks an existing manifest references, about to be referenced from
+    // a new one as well, pinned the same way
+    void pin(const std::vector<std::string>& uids);
+    // a chunk found on the server, the lowest UID wins if there are
+    // several with the same hash
+    void load(const std::string& hash, const std::string& uid);
+    bool loaded() const { return _loaded; }
+    void setLoaded() { _loaded = true; }
+
+    // a sweep covers everything known when it begins, minus whatever gets
+    // added, reused or unpinned while it runs
+    void beginSweep();
+    // chunks with no references that weren't touched since beginSweep()
+    // and had none in the previous sweep either, they're dropped from the
+    // index before being returned.  The second sweep is the grace period
+    // for other hosts on the account, whose pins we can't see
+    std::vector<std::string> endSweep(const std::map<std::string, unsigned long>& refs);
+
+    size_t size();
+
+private:
+    std::mutex _mutex;
+    bool _loaded;
+    std::map<std::string, std::string> _byHash;
+    // uid -> hash ("" for chunks written before hashes were)
+    std::map<std::string, std::string> _byUID;
+    std::set<std::string> _fresh;
+    // unreferenced in the last sweep, freed if the next one agrees
+    std::set<std::string> _unreferenced;
+    std::map<std::string, unsigned long> _pinned;
+};
+
+// unpins everything it was handed when it goes out of scope
+class ChunkPinsT {
+public:
+    ChunkPinsT(ChunkIndexT& index): _index(index) { }
+    ~ChunkPinsT() { _index.unpin(_uids); }
+
+    void push_back(const std::string& uid) { _uids.push_back(uid); }
+
+private:
+    ChunkPinsT(const ChunkPinsT&);
+    ChunkPinsT& operator = (const ChunkPinsT&);
+
+    ChunkIndexT& _index;
+    std::vector<std::string> _uids;
+};
@@ -0,0 +1,279 @@
+#include <algorithm>
+
+#include <vmime/net/imap/IMAPUtils.hpp>
+
+#include "log.h"
+#include "fs_log.h"
+#include "connection_pool.h"
+
+using namespace std;
+using namespace vmime;
+
+// per connection, the cache is simply dropped when it fills up
+static const size_t MAX_CACHED_MESSAGES = 256;
+// mailboxes a connection keeps selected at once, see ConnectionT::folder()
+static const size_t MAX_OPEN_FOLDERS = 8;
+
+class _trace: public vmime::net::tracer
+{
+public:
+    _trace(const vmime::string& proto, const int connectionID): _proto(proto), _connectionID(connectionID) { }
+    
+    void traceSend(const vmime::string& line) {
+        LOG(LOG, INFO) << "[" << _proto << ":" << _connectionID << "] -> " << line << endl;
+    }
+    
+    void traceReceive(const vmime::string& line) {
+        LOG(LOG, INFO) << "[" << _proto << ":" << _connectionID << "] <- " << line << endl;
+    }
+    
+    const vmime::string _proto;
+    const int _connectionID;
+};
+
+class _tracefactory: public net::tracerFactory
+{
+public:
+    shared_ptr<net::tracer> create(shared_ptr<net::service> serv, const int connectionID) {
+        return make_shared<_trace>(serv->getProtocolName(), connectionID);
+    }
+};
+
+class _timeouthandler: public net::timeoutHandler
+{
+public:
+    _timeouthandler() {
+        _startTime = time(NULL);
+    }
+    
+    bool isTimeOut() {
+        return (time(NULL) > _startTime + 4);
+    }
+    
+    void resetTimeOut() {
+        _startTime = time(NULL);
+    }
+    
+    bool handleTimeOut() {
+        cout << "timed out" << endl;
+        return false;
+    }
+    
+    time_t _startTime;
+};
+
+class _timeouthandlerfactory: public net::timeoutHandlerFactory
+{
+public:
+    shared_ptr<net::timeoutHandler> create() {
+        return make_shared<_timeouthandler>();
+    }
+};
+
+class _certverify: public security::cert::certificateVerifier
+{
+public:
+    void verify(shared_ptr<security::cert::certificateChain> chain, const string& hostname) {
+    }
+};
+
+ConnectionPoolT::ConnectionPoolT():
+    _separator('/')
+{ }
+
+ConnectionPoolT::~ConnectionPoolT()
+{
+    for (vector<unique_ptr<StoreT>>::iterator iter = _stores.begin(); iter != _stores.end(); ++iter) {
+        StoreT* s = iter->get();
+        try {
+            s->_folders.clear();
+            if (s->_store->isConnected()) {
+                s->_store->disconnect();
+            }
+        }
+        catch (vmime::exception& e) {
+            LOGFN(LOG, CRIT) << "disconnect failed: " << e.what();
+        }
+    }
+}
+
+void ConnectionPoolT::connect(const string& urlString, size_t size, char separator)
+{
+    _separator = separator;
+    if (!size) {
+        size = 1;
+    }
+    utility::url url(urlString);
+    for (size_t i = 0; i < size; ++i) {
+        unique_ptr<StoreT> s(new StoreT());
+        s->_session = net::session::create();
+        s->_store = std::dynamic_pointer_cast<net::imap::IMAPStore>(s->_session->getStore(url));
+        s->_store->setTimeoutHandlerFactory(make_shared<_timeouthandlerfactory>());
+        s->_store->setTracerFactory(make_shared<_tracefactory>());
+        s->_store->setCertificateVerifier(make_shared<_certverify>());
+        s->_store->connect();
+        LOGFN(LOG, INFO) << "connection " << i << " up";
+        _stores.push_back(move(s));
+    }
+}
+
+static void forgetMessages(StoreT* s, const string& mailbox)
+{
+    map<pair<string, string>, shared_ptr<net::message>>::iterator iter =
+        s->_messages.lower_bound(pair<string, string>(mailbox, ""));
+    while (iter != s->_messages.end() && iter->first.first == mailbox) {
+        s->_messages.erase(iter++);
+    }
+}
+
+static void forgetMailbox(StoreT* s, const string& mailbox)
+{
+    s->_folders.erase(mailbox);
+    s->_open.remove(mailbox);
+    forgetMessages(s, mailbox);
+}
+
+static bool isSelected(const StoreT* s, const string& mailbox)
+{
+    return find(s->_open.begin(), s->_open.end(), mailbox) != s->_open.end();
+}
+
+StoreT* ConnectionPoolT::acquire(const string& mailbox)
+{
+    unique_lock<mutex> lock(_mutex);
+    while (true) {
+        StoreT* any = NULL;
+        for (vector<unique_ptr<StoreT>>::iterator iter = _stores.begin(); iter != _stores.end(); ++iter) {
+            StoreT* s = iter->get();
+            if (s->_busy) {
+                continue;
+            }
+            if (!mailbox.empty() && isSelected(s, mailbox)) {
+                any = s;
+                break;
+            }
+            // otherwise whoever would have to close the fewest mailboxes
+            if (!any || s->_open.size() < any->_open.size()) {
+                any = s;
+            }
+        }
+        if (any) {
+            any->_busy = true;
+            return any;
+        }
+        _available.wait(lock);
+    }
+}
+
+void ConnectionPoolT::release(StoreT* s)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        for (set<string>::iterator iter = s->_stale.begin(); iter != s->_stale.end(); ++iter) {
+            forgetMailbox(s, *iter);
+        }
+        s->_stale.clear();
+        s->_busy = false;
+    }
+    _available.notify_one();
+}
+
+void ConnectionPoolT::forget(const string& mailbox)
+{
+    lock_guard<mutex> lock(_mutex);
+    for (vector<unique_ptr<StoreT>>::iterator iter = _stores.begin(); iter != _stores.end(); ++iter) {
+        StoreT* s = iter->get();
+        if (s->_busy) {
+            s->_stale.insert(mailbox);
+        }
+        else {
+            forgetMailbox(s, mailbox);
+        }
+    }
+}
+
+ConnectionT::ConnectionT(ConnectionPoolT& pool, const string& mailbox):
+    _pool(pool), _store(pool.acquire(mailbox))
+{ }
+
+ConnectionT::~ConnectionT()
+{
+    _pool.release(_store);
+}
+
+shared_ptr<net::folder> ConnectionT::folder(const string& mailbox, bool open)
+{
+    shared_ptr<net::folder> f;
+    map<string, shared_ptr<net::folder>>::iterator iter = _store->_folders.find(mailbox);
+    if (iter != _store->_folders.end()) {
+        f = iter->second;
+    }
+    else {
+        net::folder::path path = net::imap::IMAPUtils::stringToPath(_pool.separator(), mailbox);
+        f = _store->_store->getFolder(path);
+        _store->_folders[mailbox] = f;
+    }
+    if (!open) {
+        return f;
+    }
+    list<string>& lru = _store->_open;
+    if (f->isOpen()) {
+        lru.remove(mailbox);
+        lru.push_front(mailbox);
+        return f;
+    }
+    // done with the coldest one, it's only a SELECT away if it's needed again
+    while (lru.size() >= MAX_OPEN_FOLDERS) {
+        string victim = lru.back();
+        lru.pop_back();
+        forgetMessages(_store, victim);
+        map<string, shared_ptr<net::folder>>::iterator v = _store->_folders.find(victim);
+        if (v == _store->_folders.end()) {
+            continue;
+        }
+        LOGFN(LOG, DEBUG) << "closing " << victim << " to make room for " << mailbox;
+        try {
+            // never expunge, ExpungeQueueT decides what goes
+            v->second->close(false);
+        }
+        catch (vmime::exception& e) {
+            // a broken folder object isn't worth keeping either
+            _store->_folders.erase(v);
+        }
+    }
+    lru.remove(mailbox);
+    f->open(net::folder::MODE_READ_WRITE);
+    lru.push_front(mailbox);
+    return f;
+}
+
+shared_ptr<net::message> ConnectionT::message(const string& mailbox, const string& uid)
+{
+    pair<string, string> key(mailbox, uid);
+    map<pair<string, string>, shared_ptr<net::message>>::iterator iter = _store->_messages.find(key);
+    if (iter != _store->_messages.end()) {
+        return iter->second;
+    }
+    shared_ptr<net::folder> f = folder(mailbox);
+    vector<shared_ptr<net::message>> messages =
+        f->getAndFetchMessages(net::messageSet::byUID(uid),
+                               net::fetchAttributes(net::fetchAttributes::STRUCTURE |
+                                                    net::fetchAttributes::UID));
+    if (messages.empty()) {
+        return nullptr;
+    }
+    if (_store->_messages.size() >= MAX_CACHED_MESSAGES) {
+        _store->_messages.clear();
+    }
+    _store->_messages[key] = messages[0];
+    return messages[0];
+}
+
+uint32_t ConnectionT::uidValidity(const string& mailbox)
+{
+    shared_ptr<net::imap::IMAPFolder> f = dynamic_pointer_cast<net::imap::IMAPFolder>(folder(mailbox));
+    if (!f) {
+        return 0;
+    }
+    return f->getUIDValidity();
+}
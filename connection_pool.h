@@ -0,0 +1,91 @@
+#pragma once
+
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <vmime/vmime.hpp>
+#include <vmime/net/imap/imap.hpp>
+
+// one authenticated IMAP connection, plus the folders opened through it.
+// Only the thread holding it (see ConnectionT) may touch any of this.
+struct StoreT {
+    StoreT(): _busy(false) { }
+
+    std::shared_ptr<vmime::net::session> _session;
+    std::shared_ptr<vmime::net::imap::IMAPStore> _store;
+    std::map<std::string, std::shared_ptr<vmime::net::folder>> _folders;
+    // the ones of _folders that are open (each is a SELECTed connection of
+    // its own in vmime), most recently used first
+    std::list<std::string> _open;
+    // (mailbox, uid) -> message with its structure already fetched
+    std::map<std::pair<std::string, std::string>, std::shared_ptr<vmime::net::message>> _messages;
+    // mailboxes that went away while we were busy, dropped on release
+    std::set<std::string> _stale;
+    bool _busy;
+};
+
+// Fixed set of IMAP connections shared between FUSE worker threads.  vmime
+// objects aren't thread-safe, so a connection (and every folder opened on
+// it) belongs to exactly one thread between acquire() and release().
+class ConnectionPoolT {
+public:
+    ConnectionPoolT();
+    ~ConnectionPoolT();
+
+    void connect(const std::string& url, size_t size, char separator);
+    size_t size() const { return _stores.size(); }
+    char separator() const { return _separator; }
+
+    // blocks until a connection is free, preferring one that already has
+    // "mailbox" selected so we don't bounce mailboxes between connections,
+    // then one with room to select it without closing anything
+    StoreT* acquire(const std::string& mailbox);
+    void release(StoreT* store);
+
+    // drops cached folder objects for a mailbox that was deleted or renamed
+    void forget(const std::string& mailbox);
+
+private:
+    ConnectionPoolT(const ConnectionPoolT&);
+    ConnectionPoolT& operator = (const ConnectionPoolT&);
+
+    std::mutex _mutex;
+    std::condition_variable _available;
+    std::vector<std::unique_ptr<StoreT>> _stores;
+    char _separator;
+};
+
+// scoped hold on one pooled connection
+class ConnectionT {
+public:
+    ConnectionT(ConnectionPoolT& pool, const std::string& mailbox = "");
+    ~ConnectionT();
+
+    std::shared_ptr<vmime::net::imap::IMAPStore> store() { return _store->_store; }
+
+    // folder object for "mailbox" on this connection, opened read-write
+    // unless "open" is false (e.g. when it's about to be created).  Only
+    // the MAX_OPEN_FOLDERS most recently used stay selected, opening
+    // another closes the coldest one
+    std::shared_ptr<vmime::net::folder> folder(const std::string& mailbox, bool open = true);
+
+    // message "uid" in "mailbox" with its structure fetched, kept around so
+    // repeated partial reads of a file don't pay for the lookup again
+    std::shared_ptr<vmime::net::message> message(const std::string& mailbox, const std::string& uid);
+
+    // UIDVALIDITY of "mailbox" as reported when it was selected
+    uint32_t uidValidity(const std::string& mailbox);
+
+private:
+    ConnectionT(const ConnectionT&);
+    ConnectionT& operator = (const ConnectionT&);
+
+    ConnectionPoolT& _pool;
+    StoreT* _store;
+};
@@ -0,0 +1,414 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "log.h"
+#include "fs_log.h"
+#include "content_cache.h"
+
+using namespace std;
+
+static const char* MAP_SUFFIX = ".map";
+static const uint32_t MAP_MAGIC = 0x494D4643; // "IMFC"
+// seconds between flushes of newly filled blocks, see ContentCacheT::flush()
+static const int FLUSH_INTERVAL = 5;
+
+// header at the start of each .map file, followed by one byte per block
+struct MapHeaderT {
+    uint32_t _magic;
+    uint32_t _blockSize;
+    uint64_t _fileSize;
+};
+
+string CacheKeyT::str() const
+{
+    // FNV-1a, the name only has to be unique, not pretty
+    uint64_t h = 14695981039346656037ULL;
+    stringstream ss;
+    ss << _mailbox << '\n' << _uidValidity << '\n' << _uid;
+    string s = ss.str();
+    for (string::iterator iter = s.begin(); iter != s.end(); ++iter) {
+        h ^= static_cast<unsigned char>(*iter);
+        h *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(h));
+    return name;
+}
+
+static int mkdirs(const string& dir)
+{
+    string::size_type pos = 0;
+    while ((pos = dir.find('/', pos + 1)) != string::npos) {
+        ::mkdir(dir.substr(0, pos).c_str(), 0700);
+    }
+    if (::mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+ContentCacheT::ContentCacheT():
+    _capacity(0), _bytes(0), _generation(0), _stopping(false)
+{ }
+
+ContentCacheT::~ContentCacheT()
+{
+    if (!_flusher.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _flushWake.notify_all();
+    _flusher.join();
+    flush();
+}
+
+string ContentCacheT::dataPath(const string& name) const
+{
+    return _dir + "/" + name;
+}
+
+string ContentCacheT::mapPath(const string& name) const
+{
+    return _dir + "/" + name + MAP_SUFFIX;
+}
+
+bool ContentCacheT::open(const string& dir, uint64_t capacity)
+{
+    lock_guard<mutex> lock(_mutex);
+    if (mkdirs(dir)) {
+        LOGFN(LOG, CRIT) << "can't create cache directory " << dir;
+        return false;
+    }
+    _dir = dir;
+    _capacity = capacity;
+    _bytes = 0;
+    _entries.clear();
+    _lru.clear();
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        LOGFN(LOG, CRIT) << "can't read cache directory " << dir;
+        _dir.clear();
+        return false;
+    }
+    // oldest first, so pushing each one to the front leaves the newest there
+    vector<pair<time_t, string>> found;
+    struct dirent* de;
+    while ((de = readdir(d))) {
+        string file(de->d_name);
+        string::size_type pos = file.rfind(MAP_SUFFIX);
+        if (pos == string::npos || pos + strlen(MAP_SUFFIX) != file.length()) {
+            continue;
+        }
+        struct stat st;
+        if (stat((dir + "/" + file).c_str(), &st)) {
+            continue;
+        }
+        found.push_back(pair<time_t, string>(st.st_mtime, file.substr(0, pos)));
+    }
+    closedir(d);
+    sort(found.begin(), found.end());
+
+    for (vector<pair<time_t, string>>::iterator iter = found.begin(); iter != found.end(); ++iter) {
+        EntryT e;
+        if (!loadEntry(iter->second, e)) {
+            ::unlink(dataPath(iter->second).c_str());
+            ::unlink(mapPath(iter->second).c_str());
+            continue;
+        }
+        _lru.push_front(iter->second);
+        e._lru = _lru.begin();
+        e._generation = ++_generation;
+        _bytes += e._bytes;
+        _entries[iter->second] = e;
+    }
+    LOGFN(LOG, INFO) << "cache " << dir << " has " << _entries.size() << " entries, " << _bytes << " bytes";
+    evict();
+    if (!_flusher.joinable()) {
+        _flusher = thread(&ContentCacheT::flushLoop, this);
+    }
+    return true;
+}
+
+bool ContentCacheT::loadEntry(const string& name, EntryT& e)
+{
+    int fd = ::open(mapPath(name).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    MapHeaderT h;
+    bool ok = (::read(fd, &h, sizeof(h)) == sizeof(h)) && h._magic == MAP_MAGIC && h._blockSize == BLOCK_SIZE;
+    if (ok) {
+        size_t count = (h._fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        vector<char> blocks(count);
+        ok = (::read(fd, blocks.data(), count) == static_cast<ssize_t>(count));
+        if (ok) {
+            e._fileSize = h._fileSize;
+            e._blocks.assign(count, false);
+            e._bytes = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (blocks[i]) {
+                    e._blocks[i] = true;
+                    e._bytes += BLOCK_SIZE;
+                }
+            }
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool ContentCacheT::saveEntry(const string& name, const EntryT& e)
+{
+    // a new map, renamed over the old one by flush(), so a crash leaves
+    // either the old or the new map but never half of one
+    string tmp = mapPath(name) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGFN(LOG, CRIT) << "can't write cache map " << tmp;
+        return false;
+    }
+    MapHeaderT h;
+    h._magic = MAP_MAGIC;
+    h._blockSize = BLOCK_SIZE;
+    h._fileSize = e._fileSize;
+    vector<char> blocks(e._blocks.size());
+    for (size_t i = 0; i < e._blocks.size(); ++i) {
+        blocks[i] = e._blocks[i] ? 1 : 0;
+    }
+    bool ok = (::write(fd, &h, sizeof(h)) == sizeof(h)) &&
+              (::write(fd, blocks.data(), blocks.size()) == static_cast<ssize_t>(blocks.size())) &&
+              ::fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok) {
+        ::unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+void ContentCacheT::flush()
+{
+    vector<pair<string, EntryT>> batch;
+    {
+        lock_guard<mutex> lock(_mutex);
+        for (set<string>::iterator iter = _dirty.begin(); iter != _dirty.end(); ++iter) {
+            unordered_map<string, EntryT>::iterator e = _entries.find(*iter);
+            if (e != _entries.end()) {
+                batch.push_back(pair<string, EntryT>(*iter, e->second));
+            }
+        }
+        _dirty.clear();
+    }
+    if (batch.empty()) {
+        return;
+    }
+
+    // the maps can't claim blocks before they're on disk, or a crash turns
+    // them into zeroes read back as file contents; everything the copies
+    // above claim was written before they were taken
+    vector<bool> saved(batch.size(), false);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        int fd = ::open(dataPath(batch[i].first).c_str(), O_WRONLY);
+        if (fd < 0) {
+            // dropped meanwhile
+            continue;
+        }
+        bool synced = ::fdatasync(fd) == 0;
+        ::close(fd);
+        if (!synced) {
+            LOGFN(LOG, CRIT) << "can't sync cache file " << dataPath(batch[i].first);
+            continue;
+        }
+        saved[i] = saveEntry(batch[i].first, batch[i].second);
+    }
+
+    lock_guard<mutex> lock(_mutex);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const string& name = batch[i].first;
+        unordered_map<string, EntryT>::iterator e = _entries.find(name);
+        bool same = e != _entries.end() && e->second._generation == batch[i].second._generation;
+        if (!saved[i]) {
+            ::unlink((mapPath(name) + ".tmp").c_str());
+            if (same) {
+                // whatever it claims may not be on disk, don't keep it
+                drop(name);
+            }
+        }
+        else if (!same || ::rename((mapPath(name) + ".tmp").c_str(), mapPath(name).c_str())) {
+            // dropped, and maybe filled again, while we weren't looking
+            ::unlink((mapPath(name) + ".tmp").c_str());
+        }
+    }
+}
+
+void ContentCacheT::flushLoop()
+{
+    unique_lock<mutex> lock(_mutex);
+    while (!_stopping) {
+        _flushWake.wait_for(lock, chrono::seconds(FLUSH_INTERVAL));
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+void ContentCacheT::touch(const string& name, EntryT& e)
+{
+    _lru.erase(e._lru);
+    _lru.push_front(name);
+    e._lru = _lru.begin();
+}
+
+void ContentCacheT::drop(const string& name)
+{
+    unordered_map<string, EntryT>::iterator iter = _entries.find(name);
+    if (iter == _entries.end()) {
+        return;
+    }
+    _bytes -= iter->second._bytes;
+    _lru.erase(iter->second._lru);
+    _entries.erase(iter);
+    ::unlink(mapPath(name).c_str());
+    ::unlink(dataPath(name).c_str());
+}
+
+void ContentCacheT::evict()
+{
+    while (_bytes > _capacity && !_lru.empty()) {
+        string name = _lru.back();
+        LOGFN(LOG, DEBUG) << "evicting " << name;
+        drop(name);
+    }
+}
+
+ssize_t ContentCacheT::read(const CacheKeyT& key, char* buf, size_t size, off_t offset)
+{
+    if (!isOpen() || !key._uidValidity) {
+        return -1;
+    }
+    lock_guard<mutex> lock(_mutex);
+    string name = key.str();
+    unordered_map<string, EntryT>::iterator iter = _entries.find(name);
+    if (iter == _entries.end()) {
+        return -1;
+    }
+    EntryT& e = iter->second;
+    if (offset >= e._fileSize) {
+        return 0;
+    }
+    if (offset + static_cast<off_t>(size) > e._fileSize) {
+        size = e._fileSize - offset;
+    }
+    if (!size) {
+        return 0;
+    }
+    for (size_t b = offset / BLOCK_SIZE; b <= (offset + size - 1) / BLOCK_SIZE; ++b) {
+        if (!e._blocks[b]) {
+            return -1;
+        }
+    }
+
+    int fd = ::open(dataPath(name).c_str(), O_RDONLY);
+    if (fd < 0) {
+        drop(name);
+        return -1;
+    }
+    ssize_t r = ::pread(fd, buf, size, offset);
+    ::close(fd);
+    if (r != static_cast<ssize_t>(size)) {
+        drop(name);
+        return -1;
+    }
+    touch(name, e);
+    return r;
+}
+
+bool ContentCacheT::readAll(const CacheKeyT& key, string& out)
+{
+    off_t size;
+    {
+        lock_guard<mutex> lock(_mutex);
+        unordered_map<string, EntryT>::iterator iter = _entries.find(key.str());
+        if (iter == _entries.end()) {
+            return false;
+        }
+        size = iter->second._fileSize;
+    }
+    out.resize(size);
+    return size && read(key, &out[0], size, 0) == size;
+}
+
+void ContentCacheT::write(const CacheKeyT& key, off_t fileSize, const char* buf, size_t size, off_t offset)
+{
+    if (!isOpen() || !key._uidValidity || !size) {
+        return;
+    }
+    lock_guard<mutex> lock(_mutex);
+    string name = key.str();
+    EntryT& e = _entries[name];
+    if (e._blocks.empty() && fileSize) {
+        e._fileSize = fileSize;
+        e._blocks.assign((fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE, false);
+        e._generation = ++_generation;
+        _lru.push_front(name);
+        e._lru = _lru.begin();
+    }
+    else {
+        touch(name, e);
+    }
+
+    // only whole blocks go in, or the last one if we have all of it
+    off_t end = offset + size;
+    off_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    off_t last = (end == fileSize) ? e._blocks.size() : end / BLOCK_SIZE;
+    if (first >= last) {
+        return;
+    }
+    int fd = ::open(dataPath(name).c_str(), O_WRONLY | O_CREAT, 0600);
+    if (fd < 0) {
+        LOGFN(LOG, CRIT) << "can't write cache file " << dataPath(name);
+        return;
+    }
+    bool changed = false;
+    for (off_t b = first; b < last; ++b) {
+        if (e._blocks[b]) {
+            continue;
+        }
+        off_t at = b * BLOCK_SIZE;
+        size_t len = min(static_cast<off_t>(BLOCK_SIZE), fileSize - at);
+        if (::pwrite(fd, buf + (at - offset), len, at) != static_cast<ssize_t>(len)) {
+            LOGFN(LOG, CRIT) << "short write to cache file " << dataPath(name);
+            break;
+        }
+        e._blocks[b] = true;
+        e._bytes += BLOCK_SIZE;
+        _bytes += BLOCK_SIZE;
+        changed = true;
+    }
+    ::close(fd);
+    if (changed) {
+        // the map on disk catches up once the flusher has synced the data
+        _dirty.insert(name);
+        evict();
+    }
+}
+
+void ContentCacheT::remove(const CacheKeyT& key)
+{
+    if (!isOpen()) {
+        return;
+    }
+    lock_guard<mutex> lock(_mutex);
+    drop(key.str());
+}
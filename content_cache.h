@@ -0,0 +1,99 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// A message's contents never change once it has a UID (for a given
+// UIDVALIDITY), so anything we cache under that key stays good forever.
+// A UIDVALIDITY of 0 means we don't know it yet, those never hit.
+struct CacheKeyT {
+    CacheKeyT(const std::string& mailbox, uint32_t uidValidity, const std::string& uid):
+        _mailbox(mailbox), _uidValidity(uidValidity), _uid(uid) { }
+
+    std::string str() const;
+
+    std::string _mailbox;
+    uint32_t _uidValidity;
+    std::string _uid;
+};
+
+// Persistent cache of decoded file contents, one sparse data file plus a
+// block map per message in a cache directory.  Blocks are filled in as
+// they're read, whole entries are evicted least recently used first once
+// the cache grows past its size cap.  Survives remounts: a background
+// flusher syncs newly filled blocks and only then saves the maps that
+// claim them, so a crash loses at most the last few fills.
+class ContentCacheT {
+public:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    ContentCacheT();
+    ~ContentCacheT();
+
+    // scans "dir" for entries left from previous mounts and starts the
+    // flusher; a cache that isn't open quietly misses on everything
+    bool open(const std::string& dir, uint64_t capacity);
+    bool isOpen() const { return !_dir.empty(); }
+
+    // copies [offset, offset + size) clipped to the file size, returns the
+    // number of bytes or -1 if any block in the range is missing
+    ssize_t read(const CacheKeyT& key, char* buf, size_t size, off_t offset);
+    // the whole entry, false unless every block of it is here
+    bool readAll(const CacheKeyT& key, std::string& out);
+
+    // stores the whole blocks covered by buf (and a trailing partial block
+    // if it ends at "fileSize"), anything else is ignored
+    void write(const CacheKeyT& key, off_t fileSize, const char* buf, size_t size, off_t offset);
+
+    void remove(const CacheKeyT& key);
+
+private:
+    struct EntryT {
+        EntryT(): _fileSize(0), _bytes(0), _generation(0) { }
+
+        off_t _fileSize;
+        uint64_t _bytes;
+        // tells a flush whether the entry it saved is still the same one
+        uint64_t _generation;
+        std::vector<bool> _blocks;
+        std::list<std::string>::iterator _lru;
+    };
+
+    ContentCacheT(const ContentCacheT&);
+    ContentCacheT& operator = (const ContentCacheT&);
+
+    std::string dataPath(const std::string& name) const;
+    std::string mapPath(const std::string& name) const;
+    bool loadEntry(const std::string& name, EntryT& e);
+    // writes and syncs the map next to the current one, see flush()
+    bool saveEntry(const std::string& name, const EntryT& e);
+    void touch(const std::string& name, EntryT& e);
+    void drop(const std::string& name);
+    void evict();
+    // saves the maps of every entry in _dirty, after syncing their data
+    void flush();
+    void flushLoop();
+
+    std::mutex _mutex;
+    std::string _dir;
+    uint64_t _capacity;
+    uint64_t _bytes;
+    std::unordered_map<std::string, EntryT> _entries;
+    // most recently used at the front
+    std::list<std::string> _lru;
+    // entries with blocks their map on disk doesn't claim yet
+    std::set<std::string> _dirty;
+    uint64_t _generation;
+    bool _stopping;
+    std::condition_variable _flushWake;
+    std::thread _flusher;
+};
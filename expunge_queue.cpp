@@ -0,0 +1,153 @@
+#include "log.h"
+#include "fs_log.h"
+#include "expunge_queue.h"
+
+using namespace std;
+
+// UIDs queued in one mailbox before it's expunged without waiting
+static const size_t BATCH_SIZE = 256;
+// longest a deleted message waits for its expunge, in seconds
+static const int FLUSH_INTERVAL = 5;
+
+ExpungeQueueT::ExpungeQueueT():
+    _full(false), _stopping(false)
+{ }
+
+ExpungeQueueT::~ExpungeQueueT()
+{
+    stop();
+}
+
+void ExpungeQueueT::start(FlushT flush)
+{
+    _flush = flush;
+    _stopping = false;
+    _thread = thread(&ExpungeQueueT::run, this);
+}
+
+void ExpungeQueueT::stop()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _work.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void ExpungeQueueT::add(const string& mailbox, const vector<string>& uids)
+{
+    if (uids.empty()) {
+        return;
+    }
+    if (!running()) {
+        _flush(mailbox, uids);
+        return;
+    }
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (_pending.empty()) {
+            _due = chrono::steady_clock::now() + chrono::seconds(FLUSH_INTERVAL);
+        }
+        vector<string>& batch = _pending[mailbox];
+        batch.insert(batch.end(), uids.begin(), uids.end());
+        if (batch.size() < BATCH_SIZE) {
+            return;
+        }
+        _full = true;
+    }
+    _work.notify_one();
+}
+
+void ExpungeQueueT::add(const string& mailbox, const string& uid)
+{
+    add(mailbox, vector<string>(1, uid));
+}
+
+void ExpungeQueueT::forget(const string& mailbox)
+{
+    lock_guard<mutex> lock(_mutex);
+    _pending.erase(mailbox);
+}
+
+void ExpungeQueueT::rename(const string& from, const string& to)
+{
+    lock_guard<mutex> lock(_mutex);
+    map<string, vector<string>>::iterator iter = _pending.find(from);
+    if (iter == _pending.end()) {
+        return;
+    }
+    vector<string>& uids = _pending[to];
+    uids.insert(uids.end(), iter->second.begin(), iter->second.end());
+    _pending.erase(iter);
+}
+
+void ExpungeQueueT::run()
+{
+    unique_lock<mutex> lock(_mutex);
+    for (;;) {
+        while (!_stopping && !_full &&
+               (_pending.empty() || chrono::steady_clock::now() < _due)) {
+            if (_pending.empty()) {
+                _work.wait(lock);
+            }
+            else {
+                _work.wait_until(lock, _due);
+            }
+        }
+        if (_pending.empty()) {
+            // stopping, and nothing left to do
+            return;
+        }
+
+        // only the full batches if that's what woke us, everything otherwise
+        map<string, vector<string>> batches;
+        bool due = _stopping || chrono::steady_clock::now() >= _due;
+        for (map<string, vector<string>>::iterator iter = _pending.begin(); iter != _pending.end(); ) {
+            if (due || iter->second.size() >= BATCH_SIZE) {
+                batches[iter->first].swap(iter->second);
+                iter = _pending.erase(iter);
+            }
+            else {
+                ++iter;
+            }
+        }
+        _full = false;
+        bool stopping = _stopping;
+        lock.unlock();
+
+        map<string, vector<string>> failed;
+        for (map<string, vector<string>>::iterator iter = batches.begin(); iter != batches.end(); ++iter) {
+            bool ok = false;
+            try {
+                ok = _flush(iter->first, iter->second);
+            }
+            catch (std::exception& e) {
+                LOGFN(LOG, CRIT) << "expunge in " << iter->first << " failed: " << e.what();
+            }
+            if (!ok) {
+                failed[iter->first].swap(iter->second);
+            }
+        }
+
+        lock.lock();
+        if (stopping) {
+            for (map<string, vector<string>>::iterator iter = failed.begin(); iter != failed.end(); ++iter) {
+                // still flagged \Deleted, so they stay hidden until whoever
+                // expunges that mailbox next
+                LOGFN(LOG, CRIT) << "giving up on " << iter->second.size() << " expunges in " << iter->first;
+            }
+            continue;
+        }
+        for (map<string, vector<string>>::iterator iter = failed.begin(); iter != failed.end(); ++iter) {
+            vector<string>& batch = _pending[iter->first];
+            batch.insert(batch.end(), iter->second.begin(), iter->second.end());
+        }
+        if (!failed.empty()) {
+            // don't hammer a server that just said no, wait out the interval
+            _due = chrono::steady_clock::now() + chrono::seconds(FLUSH_INTERVAL);
+        }
+    }
+}
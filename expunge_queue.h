@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Messages already flagged \Deleted, waiting to be expunged a mailbox at a
+// time.  A whole "rm -rf" costs one EXPUNGE per mailbox instead of one per
+// file: a batch goes out when a mailbox has BATCH_SIZE of them, or a few
+// seconds after the first one was queued, whichever comes first.
+class ExpungeQueueT {
+public:
+    // expunges "uids" from "mailbox", false to have them retried later
+    typedef std::function<bool (const std::string&, const std::vector<std::string>&)> FlushT;
+
+    ExpungeQueueT();
+    ~ExpungeQueueT();
+
+    void start(FlushT flush);
+    // expunges whatever is still queued (once) and stops the worker
+    void stop();
+    bool running() const { return _thread.joinable(); }
+
+    // without a running worker this expunges right away
+    void add(const std::string& mailbox, const std::vector<std::string>& uids);
+    void add(const std::string& mailbox, const std::string& uid);
+    // the mailbox is going away, nothing in it needs expunging any more
+    void forget(const std::string& mailbox);
+    // the mailbox was renamed, what's queued goes with it
+    void rename(const std::string& from, const std::string& to);
+
+private:
+    ExpungeQueueT(const ExpungeQueueT&);
+    ExpungeQueueT& operator = (const ExpungeQueueT&);
+
+    void run();
+
+    std::mutex _mutex;
+    std::condition_variable _work;
+    std::map<std::string, std::vector<std::string>> _pending;
+    // when the oldest pending batch has waited long enough
+    std::chrono::steady_clock::time_point _due;
+    bool _full;
+    bool _stopping;
+    std::thread _thread;
+    FlushT _flush;
+};
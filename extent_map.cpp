@@ -0,0 +1,98 @@
+#include <algorithm>
+
+#include "extent_map.h"
+
+using namespace std;
+
+void ExtentMapT::add(off_t start, off_t end)
+{
+    if (start >= end) {
+        return;
+    }
+    // the first extent that could touch us is the one starting at or
+    // before "start"
+    map<off_t, off_t>::iterator iter = _extents.upper_bound(start);
+    if (iter != _extents.begin()) {
+        map<off_t, off_t>::iterator prev = iter;
+        --prev;
+        if (prev->second >= start) {
+            iter = prev;
+        }
+    }
+    // swallow everything we overlap or touch
+    while (iter != _extents.end() && iter->first <= end) {
+        start = min(start, iter->first);
+        end = max(end, iter->second);
+        _extents.erase(iter++);
+    }
+    _extents[start] = end;
+}
+
+void ExtentMapT::truncate(off_t size)
+{
+    map<off_t, off_t>::iterator iter = _extents.lower_bound(size);
+    _extents.erase(iter, _extents.end());
+    if (!_extents.empty()) {
+        map<off_t, off_t>::iterator last = _extents.end();
+        --last;
+        last->second = min(last->second, size);
+    }
+}
+
+bool ExtentMapT::covers(off_t start, off_t end) const
+{
+    if (start >= end) {
+        return true;
+    }
+    map<off_t, off_t>::const_iterator iter = _extents.upper_bound(start);
+    if (iter == _extents.begin()) {
+        return false;
+    }
+    --iter;
+    return iter->second >= end;
+}
+
+bool ExtentMapT::overlaps(off_t start, off_t end) const
+{
+    if (start >= end) {
+        return false;
+    }
+    map<off_t, off_t>::const_iterator iter = _extents.upper_bound(start);
+    if (iter != _extents.begin()) {
+        map<off_t, off_t>::const_iterator prev = iter;
+        --prev;
+        if (prev->second > start) {
+            return true;
+        }
+    }
+    return iter != _extents.end() && iter->first < end;
+}
+
+vector<ExtentMapT::RangeT> ExtentMapT::gaps(off_t start, off_t end) const
+{
+    vector<RangeT> ret;
+    if (start >= end) {
+        return ret;
+    }
+    map<off_t, off_t>::const_iterator iter = _extents.upper_bound(start);
+    if (iter != _extents.begin()) {
+        map<off_t, off_t>::const_iterator prev = iter;
+        --prev;
+        start = max(start, prev->second);
+    }
+    for (; start < end && iter != _extents.end() && iter->first < end; ++iter) {
+        if (iter->first > start) {
+            ret.push_back(RangeT(start, iter->first));
+        }
+        start = max(start, iter->second);
+    }
+    if (start < end) {
+        ret.push_back(RangeT(start, end));
+    }
+    return ret;
+}
+
+vector<ExtentMapT::RangeT> ExtentMapT::ranges() const
+{
+    return vector<RangeT>(_extents.begin(), _extents.end());
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+// Set of byte ranges, kept disjoint and merged with their neighbours, so
+// a file written in any order with any overlap costs one entry per run
+// of contiguous data and each write is a log(n) update.  Tracks which
+// parts of a node's write buffer hold real data.
+class ExtentMapT {
+public:
+    typedef std::pair<off_t, off_t> RangeT;
+
+    // marks [start, end) as present
+    void add(off_t start, off_t end);
+    // forgets everything at or past "size"
+    void truncate(off_t size);
+    void clear() { _extents.clear(); }
+    bool empty() const { return _extents.empty(); }
+    size_t count() const { return _extents.size(); }
+
+    bool covers(off_t start, off_t end) const;
+    // whether any of [start, end) is present
+    bool overlaps(off_t start, off_t end) const;
+    // the parts of [start, end) that aren't present, in order
+    std::vector<RangeT> gaps(off_t start, off_t end) const;
+    // everything that is, in order
+    std::vector<RangeT> ranges() const;
+
+private:
+    // start -> end
+    std::map<off_t, off_t> _extents;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cerrno>
+#include <exception>
+
+#include <fuse_lowlevel.h>
+#include <vmime/vmime.hpp>
+
+#include "log.h"
+#include "fs_log.h"
+
+std::ostream& operator << (std::ostream& os, const vmime::exception& e);
+
+// With -o multithread the callbacks of either frontend run on libfuse's
+// workers, where an exception (a dropped connection, a server NO) would
+// end the process instead of just the request.  GUARDED(f) wraps "f" so
+// that it fails the request with EIO instead.
+template <typename T, T F> struct GuardT;
+
+// high-level callbacks return the error
+template <typename R, typename... A, R (*F)(A...)>
+struct GuardT<R (*)(A...), F> {
+    static R call(A... args)
+    {
+        try {
+            return F(args...);
+        }
+        catch (vmime::exception& e) {
+            LOGFN(LOG, CRIT) << "request failed: " << e;
+        }
+        catch (std::exception& e) {
+            LOGFN(LOG, CRIT) << "request failed: " << e.what();
+        }
+        return -EIO;
+    }
+};
+
+// low-level handlers reply themselves, last, so one that throws hasn't
+// replied yet
+template <typename... A, void (*F)(fuse_req_t, A...)>
+struct GuardT<void (*)(fuse_req_t, A...), F> {
+    static void call(fuse_req_t req, A... args)
+    {
+        try {
+            F(req, args...);
+            return;
+        }
+        catch (vmime::exception& e) {
+            LOGFN(LOG, CRIT) << "request failed: " << e;
+        }
+        catch (std::exception& e) {
+            LOGFN(LOG, CRIT) << "request failed: " << e.what();
+        }
+        fuse_reply_err(req, EIO);
+    }
+};
+
+#define GUARDED(f) GuardT<decltype(&f), &f>::call
@@ -6,6 +6,7 @@
 
 
 #include <cstdio>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
@@ -34,7 +35,9 @@
 #include "stack_trace.h"
 #include "log.h"
 #include "fs_log.h"
+#include "fuse_guard.h"
 #include "imapfs.h"
+#include "imap_ll.h"
 
 
 const char* BUILD_VERSION = "0";
@@ -45,17 +48,93 @@ using namespace std;
 
 IMAPFS* _fs = NULL;
 
+// command line options we handle ourselves, the rest go to FUSE
+struct imap_options {
+    int lowlevel;
+    int multithread;
+    unsigned int connections;
+    char* cachedir;
+    unsigned int cachesize;
+    unsigned int writeback;
+    unsigned int prefetch;
+    unsigned int prefetchrate;
+    int rmtree;
+};
+
+static struct fuse_opt imap_opts[] = {
+    { "lowlevel", offsetof(struct imap_options, lowlevel), 1 },
+    { "multithread", offsetof(struct imap_options, multithread), 1 },
+    { "connections=%u", offsetof(struct imap_options, connections), 0 },
+    { "cachedir=%s", offsetof(struct imap_options, cachedir), 0 },
+    { "cachesize=%u", offsetof(struct imap_options, cachesize), 0 },
+    { "writeback=%u", offsetof(struct imap_options, writeback), 0 },
+    { "prefetch=%u", offsetof(struct imap_options, prefetch), 0 },
+    { "prefetchrate=%u", offsetof(struct imap_options, prefetchrate), 0 },
+    { "rmtree", offsetof(struct imap_options, rmtree), 1 },
+    FUSE_OPT_END
+};
+
+// cachesize is in megabytes, 0 turns the content cache off; writeback is
+// the number of upload threads, 0 makes close() upload synchronously;
+// prefetch is how many megabytes may be fetched ahead of readers (0 for
+// none) and prefetchrate caps that in kilobytes a second (0 for no cap);
+// rmtree lets rmdir remove a directory that isn't empty, all of it at once
+static struct imap_options _options = { 0, 0, 0, NULL, 1024, 2, 64, 0, 0 };
+
+static string cacheDir()
+{
+    if (_options.cachedir) {
+        return _options.cachedir;
+    }
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) {
+        return string(xdg) + "/imapfs";
+    }
+    const char* home = getenv("HOME");
+    return string(home ? home : "/tmp") + "/.cache/imapfs";
+}
+
+IMAPFS* imap_create()
+{
+    // one connection is plenty when FUSE only ever gives us one request
+    // at a time, otherwise let each worker thread have its own
+    size_t connections = _options.connections;
+    if (!connections) {
+        connections = _options.multithread ? 4 : 1;
+    }
+    IMAPFS* fs = new IMAPFS("localhost", 2983, "test", "carsnurfy9", connections);
+    fs->allowTreeRemoval(_options.rmtree != 0);
+    if (_options.cachesize) {
+        fs->openCache(cacheDir() + "/" + fs->host(), static_cast<uint64_t>(_options.cachesize) << 20);
+        fs->startPrefetch(static_cast<uint64_t>(_options.prefetch) << 20,
+                          static_cast<uint64_t>(_options.prefetchrate) << 10);
+    }
+    // the tree as of the last unmount, if there is one, is good enough to
+    // start with; what changed since is picked up in the background
+    bool restored = fs->restoreSnapshot(cacheDir() + "/" + fs->host() + "/snapshot");
+    if (!restored) {
+        int r = fs->parseFilesystem();
+        if (r) {
+            LOG(LOG, CRIT) << "filesystem couldn't be parsed";
+            delete fs;
+            return NULL;
+        }
+    }
+    fs->openJournal(cacheDir() + "/" + fs->host() + "/journal");
+    fs->startWriteback(_options.writeback);
+    fs->replayJournal();
+    if (restored) {
+        fs->startRevalidation();
+    }
+    fs->startCollector();
+    fs->startWatcher();
+    return fs;
+}
+
 static void* imap_init(struct fuse_conn_info* conn)
 {
     (void) conn;
-    IMAPFS* fs = new IMAPFS("localhost", 2983, "test", "carsnurfy9");
-    int r = fs->parseFilesystem();
-    if (r) {
-        LOG(LOG, CRIT) << "filesystem couldn't be parsed";
-        delete fs;
-        return NULL;
-    }
-    _fs = fs;
+    _fs = imap_create();
     return _fs;
 }
 
@@ -97,7 +176,7 @@ static int imap_statfs(const char* path, struct statvfs* stbuf)
 
 static int imap_mknod(const char* path, mode_t mode, dev_t rdev)
 {
-    return _fs->mknod(path, mode);
+    return _fs->mknod(path, mode, fuse_get_context()->uid, fuse_get_context()->gid);
 }
 
 static int imap_fallocate(const char* path, int mode,
@@ -108,7 +187,12 @@ static int imap_fallocate(const char* path, int mode,
 
 static int imap_truncate(const char* path, off_t size)
 {
-    return _fs->truncate(path, size);
+    return _fs->truncate(path, size, NULL);
+}
+
+static int imap_ftruncate(const char* path, off_t size, struct fuse_file_info* fi)
+{
+    return _fs->truncate(path, size, fi);
 }
 
 static int imap_fsync(const char* path, int isdatasync, struct fuse_file_info* fi)
@@ -158,6 +242,20 @@ static int imap_rename(const char* from, const char* to)
     return _fs->rename(from, to);
 }
 
+static int imap_setxattr(const char* path, const char* name, const char* value, size_t size, int flags)
+{
+    return _fs->setxattr(path, name, string(value, size));
+}
+
+#if FUSE_VERSION >= 34
+static ssize_t imap_copy_file_range(const char* path_in, struct fuse_file_info* fi_in, off_t offset_in,
+                                    const char* path_out, struct fuse_file_info* fi_out, off_t offset_out,
+                                    size_t size, int flags)
+{
+    return _fs->copyFileRange(path_in, offset_in, path_out, offset_out, size);
+}
+#endif
+
 
 struct fuse_chan* _fc = NULL;
 void sighandler(int signum, siginfo_t* info, void* context)
@@ -175,24 +273,29 @@ int main(int argc, char* argv[])
     // hook up all the FUSE callbacks
     struct fuse_operations imap_oper = { };
     imap_oper.init = imap_init;
-    imap_oper.getattr = imap_getattr;
-    imap_oper.readdir = imap_readdir;
-    imap_oper.open = imap_open;
-    imap_oper.read = imap_read;
-    imap_oper.write = imap_write;
-    imap_oper.statfs = imap_statfs;
-    imap_oper.mknod = imap_mknod;
-    imap_oper.fallocate = imap_fallocate;
-    imap_oper.truncate = imap_truncate;
-    imap_oper.fsync = imap_fsync;
-    imap_oper.access = imap_access;
-    imap_oper.unlink = imap_unlink;
-    imap_oper.mkdir = imap_mkdir;
-    imap_oper.rmdir = imap_rmdir;
-    imap_oper.release = imap_release;
-    imap_oper.chmod = imap_chmod;
-    imap_oper.chown = imap_chown;
-    imap_oper.rename = imap_rename;
+    imap_oper.getattr = GUARDED(imap_getattr);
+    imap_oper.readdir = GUARDED(imap_readdir);
+    imap_oper.open = GUARDED(imap_open);
+    imap_oper.read = GUARDED(imap_read);
+    imap_oper.write = GUARDED(imap_write);
+    imap_oper.statfs = GUARDED(imap_statfs);
+    imap_oper.mknod = GUARDED(imap_mknod);
+    imap_oper.fallocate = GUARDED(imap_fallocate);
+    imap_oper.truncate = GUARDED(imap_truncate);
+    imap_oper.ftruncate = GUARDED(imap_ftruncate);
+    imap_oper.fsync = GUARDED(imap_fsync);
+    imap_oper.access = GUARDED(imap_access);
+    imap_oper.unlink = GUARDED(imap_unlink);
+    imap_oper.mkdir = GUARDED(imap_mkdir);
+    imap_oper.rmdir = GUARDED(imap_rmdir);
+    imap_oper.release = GUARDED(imap_release);
+    imap_oper.chmod = GUARDED(imap_chmod);
+    imap_oper.chown = GUARDED(imap_chown);
+    imap_oper.rename = GUARDED(imap_rename);
+    imap_oper.setxattr = GUARDED(imap_setxattr);
+#if FUSE_VERSION >= 34
+    imap_oper.copy_file_range = GUARDED(imap_copy_file_range);
+#endif
 
 //    .readlink = imap_readlink,
 //    .symlink = imap_symlink,
@@ -202,7 +305,6 @@ int main(int argc, char* argv[])
 //    .utimens = imap_utimens,
 #endif
 #ifdef HAVE_SETXATTR
-//    .setxattr = imap_setxattr,
 //    .getxattr = imap_getxattr,
 //    .listxattr = imap_listxattr,
 //    .removexattr = imap_removexattr,
@@ -225,13 +327,31 @@ int main(int argc, char* argv[])
     sigaction(SIGINT, &handle, NULL);
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    fuse_opt_parse(&args, NULL, NULL, NULL);
+    fuse_opt_parse(&args, &_options, imap_opts, NULL);
     fuse_opt_add_arg(&args, "-oallow_other");
     _fc = fuse_mount("test", &args);
     if (!_fc) {
         LOG(LOG, CRIT) << "could not mount";
         exit(-1);
     }
+
+    // the low-level frontend talks inodes instead of paths, which lets the
+    // kernel cache lookups instead of resolving every path component
+    if (_options.lowlevel) {
+        int r = -1;
+        try {
+            r = imap_ll_loop(&args, _fc, _options.multithread);
+            LOG(LOG, DEBUG) << "exiting";
+            fuse_unmount("test", _fc);
+        }
+        catch (vmime::exception& e) {
+            STACKFN(LOG, CRIT) << "uncaught vmime exception " << e;
+            LOG(LOG, DEBUG) << "exiting";
+            fuse_unmount("test", _fc);
+        }
+        return r;
+    }
+
     struct fuse* fuse = fuse_new(_fc, &args, &imap_oper, sizeof(struct fuse_operations), NULL);
     if (!fuse) {
         LOG(LOG, CRIT) << "couldn't initialize filesystem";
@@ -240,7 +360,7 @@ int main(int argc, char* argv[])
     }
     int r = -1;
     try {
-        r = fuse_loop(fuse);
+        r = _options.multithread ? fuse_loop_mt(fuse) : fuse_loop(fuse);
         LOG(LOG, DEBUG) << "exiting";
         fuse_unmount("test", _fc);
     }
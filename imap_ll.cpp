@@ -0,0 +1,515 @@
+#define FUSE_USE_VERSION 30
+
+#include <cerrno>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#define _FILE_OFFSET_BITS 64
+#include <fuse_lowlevel.h>
+
+#include "log.h"
+#include "fs_log.h"
+#include "fuse_guard.h"
+#include "imapfs.h"
+#include "imap_ll.h"
+
+using namespace std;
+
+// everything goes through us, so the kernel can hang on to names and
+// attributes for a good while before asking again; a long while for files
+// once the watcher invalidates whatever other clients change in any
+// mailbox.  NOTIFY says nothing about mailboxes themselves being created,
+// deleted or renamed, so directories never get more than the default
+static const double ENTRY_TIMEOUT = 60.0;
+static const double ATTR_TIMEOUT = 60.0;
+static const double WATCHED_TIMEOUT = 3600.0;
+// a miss may just be a file another client is about to create
+static const double NEGATIVE_TIMEOUT = 5.0;
+
+static IMAPFS* _llfs = NULL;
+static struct fuse_chan* _llch = NULL;
+
+// whether ll_init() managed to build the filesystem; a request it didn't
+// gets EIO
+static bool ll_ready(fuse_req_t req)
+{
+    if (!_llfs) {
+        fuse_reply_err(req, EIO);
+        return false;
+    }
+    return true;
+}
+
+static shared_ptr<NodeT> ll_node(fuse_ino_t ino)
+{
+    if (!_llfs) {
+        return nullptr;
+    }
+    return _llfs->findNode(static_cast<ino_t>(ino));
+}
+
+// where a new name under "parent" goes; parent's path can be rewritten by
+// a rename on another thread, so it's only read under the tree lock
+static string ll_childPath(NodeT* parent, const char* name)
+{
+    ReadLockT lock(_llfs->_lock);
+    return childPath(parent, name);
+}
+
+static double ll_timeout(double timeout, const struct stat& stat)
+{
+    return S_ISREG(stat.st_mode) && _llfs->watchingAll() ? WATCHED_TIMEOUT : timeout;
+}
+
+static void ll_reply_entry(fuse_req_t req, NodeT* n)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    {
+        WriteLockT lock(_llfs->_lock);
+        e.ino = n->_ino;
+        e.attr = n->_stat;
+        n->_nlookup++;
+    }
+    e.attr_timeout = ll_timeout(ATTR_TIMEOUT, e.attr);
+    e.entry_timeout = ll_timeout(ENTRY_TIMEOUT, e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+// drops a name (and whatever was cached of the file behind it) that
+// another client changed, see IMAPFS::watchLoop()
+static void ll_invalidate(const InvalidationT& inval)
+{
+    // -ENOENT just means the kernel had nothing cached
+    fuse_lowlevel_notify_inval_entry(_llch, inval._parent, inval._name.c_str(), inval._name.length());
+    if (inval._ino) {
+        fuse_lowlevel_notify_inval_inode(_llch, inval._ino, 0, 0);
+    }
+}
+
+static void ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+    (void) userdata;
+    (void) conn;
+    _llfs = imap_create();
+    if (_llfs) {
+        _llfs->setInvalidator(ll_invalidate);
+    }
+}
+
+static void ll_destroy(void* userdata)
+{
+    (void) userdata;
+    delete _llfs;
+    _llfs = NULL;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    LOGFN(LOG, INFO) << "lookup " << name << " in " << parent;
+    shared_ptr<NodeT> p = ll_node(parent);
+    if (!p) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // a directory we haven't listed yet doesn't know its files
+    if (S_ISDIR(p->_stat.st_mode)) {
+        int r = _llfs->loadDirectory(p.get());
+        if (r) {
+            // not a miss, the kernel mustn't cache it as one
+            fuse_reply_err(req, -r);
+            return;
+        }
+    }
+    shared_ptr<NodeT> n = _llfs->findChild(p.get(), name);
+    if (!n) {
+        // negative entry, lets the kernel cache the miss too
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = NEGATIVE_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    ll_reply_entry(req, n.get());
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    if (_llfs) {
+        _llfs->forget(static_cast<ino_t>(ino), nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct stat stat;
+    {
+        ReadLockT lock(_llfs->_lock);
+        stat = n->_stat;
+    }
+    fuse_reply_attr(req, &stat, ll_timeout(ATTR_TIMEOUT, stat));
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        // fi is set for ftruncate() and O_TRUNC opens, their release() uploads
+        int r = _llfs->truncate(n, attr->st_size, fi);
+        if (r) {
+            fuse_reply_err(req, -r);
+            return;
+        }
+    }
+    struct stat stat;
+    {
+        WriteLockT lock(_llfs->_lock);
+        if (to_set & FUSE_SET_ATTR_ATIME) {
+            n->_stat.st_atim = attr->st_atim;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME) {
+            n->_stat.st_mtim = attr->st_mtim;
+        }
+        stat = n->_stat;
+    }
+    // mode and ownership aren't stored anywhere, same as chmod/chown
+    fuse_reply_attr(req, &stat, ll_timeout(ATTR_TIMEOUT, stat));
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    LOGFN(LOG, INFO) << "readdir " << ino << " offset " << offset;
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int r = _llfs->loadDirectory(n.get(), offset == 0);
+    if (r) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    if (offset == 0) {
+        _llfs->noteListing(n.get());
+    }
+    vector<char> buf(size);
+    size_t pos = 0;
+    ReadLockT lock(_llfs->_lock);
+    for (size_t i = InodeTableT::seek(n.get(), offset); i < n->_children.size(); ++i) {
+        NodeT* c = n->_children[i];
+        size_t len = fuse_add_direntry(req, buf.data() + pos, size - pos, c->_name.c_str(), &(c->_stat), c->_cookie);
+        if (len > size - pos) {
+            break;
+        }
+        pos += len;
+    }
+    fuse_reply_buf(req, buf.data(), pos);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // contents only change through us, so the page cache can survive opens
+    if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+        fi->keep_cache = 1;
+    }
+    fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    vector<char> buf(size);
+    int r = _llfs->read(n, buf.data(), size, offset, fi);
+    if (r < 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    fuse_reply_buf(req, buf.data(), r);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int r = _llfs->write(n, buf, size, offset, fi);
+    if (r < 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    fuse_reply_write(req, r);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_err(req, -(_llfs->release(n, fi)));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_err(req, -(_llfs->fsync(n, datasync, fi)));
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> p = ll_node(parent);
+    if (!p) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    string path = ll_childPath(p.get(), name);
+    const struct fuse_ctx* ctx = fuse_req_ctx(req);
+    int r = _llfs->mknod(path, mode, ctx->uid, ctx->gid);
+    if (r) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    shared_ptr<NodeT> n = _llfs->findNode(path);
+    if (!n) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    ll_reply_entry(req, n.get());
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> p = ll_node(parent);
+    if (!p) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    string path = ll_childPath(p.get(), name);
+    int r = _llfs->mkdir(path, mode);
+    if (r) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    shared_ptr<NodeT> n = _llfs->findNode(path);
+    if (!n) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    ll_reply_entry(req, n.get());
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> p = ll_node(parent);
+    if (!p) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_err(req, -(_llfs->unlink(ll_childPath(p.get(), name))));
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> p = ll_node(parent);
+    if (!p) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_err(req, -(_llfs->rmdir(ll_childPath(p.get(), name))));
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> p = ll_node(parent);
+    shared_ptr<NodeT> np = ll_node(newparent);
+    if (!p || !np) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_err(req, -(_llfs->rename(ll_childPath(p.get(), name), ll_childPath(np.get(), newname))));
+}
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name, const char* value, size_t size, int flags)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_err(req, -(_llfs->setxattr(n, name, string(value, size))));
+}
+
+#if FUSE_VERSION >= 34
+static void ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info* fi_in,
+                               fuse_ino_t ino_out, off_t off_out, struct fuse_file_info* fi_out,
+                               size_t len, int flags)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> in = ll_node(ino_in);
+    shared_ptr<NodeT> out = ll_node(ino_out);
+    if (!in || !out) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    ssize_t r = _llfs->copyFileRange(in, off_in, out, off_out, len);
+    if (r < 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    fuse_reply_write(req, r);
+}
+#endif
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    struct statvfs stat;
+    _llfs->statfs("/", &stat);
+    fuse_reply_statfs(req, &stat);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // the node is there, and permissions aren't stored anywhere
+    fuse_reply_err(req, 0);
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
+{
+    if (!ll_ready(req)) {
+        return;
+    }
+    shared_ptr<NodeT> n = ll_node(ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // nothing to reserve, the buffer grows as it's written
+    fuse_reply_err(req, 0);
+}
+
+int imap_ll_loop(struct fuse_args* args, struct fuse_chan* ch, bool multithreaded)
+{
+    struct fuse_lowlevel_ops ops = { };
+    ops.init = ll_init;
+    ops.destroy = ll_destroy;
+    ops.lookup = GUARDED(ll_lookup);
+    ops.forget = ll_forget;
+    ops.getattr = GUARDED(ll_getattr);
+    ops.setattr = GUARDED(ll_setattr);
+    ops.readdir = GUARDED(ll_readdir);
+    ops.open = GUARDED(ll_open);
+    ops.read = GUARDED(ll_read);
+    ops.write = GUARDED(ll_write);
+    ops.release = GUARDED(ll_release);
+    ops.fsync = GUARDED(ll_fsync);
+    ops.mknod = GUARDED(ll_mknod);
+    ops.mkdir = GUARDED(ll_mkdir);
+    ops.unlink = GUARDED(ll_unlink);
+    ops.rmdir = GUARDED(ll_rmdir);
+    ops.rename = GUARDED(ll_rename);
+    ops.statfs = GUARDED(ll_statfs);
+    ops.access = GUARDED(ll_access);
+    ops.fallocate = GUARDED(ll_fallocate);
+    ops.setxattr = GUARDED(ll_setxattr);
+#if FUSE_VERSION >= 34
+    ops.copy_file_range = GUARDED(ll_copy_file_range);
+#endif
+
+    struct fuse_session* se = fuse_lowlevel_new(args, &ops, sizeof(ops), NULL);
+    if (!se) {
+        LOG(LOG, CRIT) << "couldn't initialize low-level session";
+        return -1;
+    }
+    fuse_session_add_chan(se, ch);
+    _llch = ch;
+    int r = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+    fuse_session_remove_chan(ch);
+    fuse_session_destroy(se);
+    return r;
+}
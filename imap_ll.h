@@ -0,0 +1,12 @@
+#pragma once
+
+#include <fuse_lowlevel.h>
+
+class IMAPFS;
+
+// builds the filesystem and parses what's on the server, shared by both
+// the high-level and the low-level frontends
+IMAPFS* imap_create();
+
+// runs the low-level (inode based) frontend on an already mounted channel
+int imap_ll_loop(struct fuse_args* args, struct fuse_chan* ch, bool multithreaded);
@@ -0,0 +1,402 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
+#include <vmime/net/imap/IMAPUtils.hpp>
+
+#include "log.h"
+#include "fs_log.h"
+#include "imap_raw.h"
+
+using namespace std;
+using namespace vmime;
+using namespace vmime::net::imap;
+
+string uidSet(const vector<string>& uids)
+{
+    vector<unsigned long> sorted;
+    for (vector<string>::const_iterator iter = uids.begin(); iter != uids.end(); ++iter) {
+        sorted.push_back(strtoul(iter->c_str(), NULL, 10));
+    }
+    sort(sorted.begin(), sorted.end());
+    sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+
+    string set;
+    for (size_t i = 0; i < sorted.size(); ) {
+        size_t j = i;
+        while (j + 1 < sorted.size() && sorted[j + 1] == sorted[j] + 1) {
+            ++j;
+        }
+        if (!set.empty()) {
+            set += ",";
+        }
+        set += to_string(sorted[i]);
+        if (j > i) {
+            set += ":" + to_string(sorted[j]);
+        }
+        i = j + 1;
+    }
+    return set;
+}
+
+// true if the server is waiting for the literal we just announced
+static bool continued(shared_ptr<IMAPConnection> conn)
+{
+    unique_ptr<IMAPParser::response> resp = conn->readResponse();
+    for (vector<unique_ptr<IMAPParser::continue_req_or_response_data>>::iterator iter =
+             resp->continue_req_or_response_data.begin();
+         iter != resp->continue_req_or_response_data.end(); ++iter) {
+        if ((*iter)->continue_req) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// every UID in a UIDPLUS set, ascending: the set may come in any order,
+// but the server hands out new UIDs in the order of the messages
+static vector<string> uidList(const IMAPParser::uid_set* set)
+{
+    vector<uint32_t> found;
+    for (size_t i = 0; set && i < set->uniqueid.size(); ++i) {
+        found.push_back(set->uniqueid[i]->value);
+    }
+    for (size_t i = 0; set && i < set->uid_range.size(); ++i) {
+        for (uint32_t uid = set->uid_range[i]->uniqueid1->value; uid <= set->uid_range[i]->uniqueid2->value; ++uid) {
+            found.push_back(uid);
+        }
+    }
+    sort(found.begin(), found.end());
+    vector<string> uids;
+    for (vector<uint32_t>::iterator iter = found.begin(); iter != found.end(); ++iter) {
+        uids.push_back(to_string(*iter));
+    }
+    return uids;
+}
+
+// the UIDPLUS data of a "type" response code, tagged or (like COPYUID
+// after a MOVE) untagged, NULL if there's none
+static const IMAPParser::uidplus_data* responseCode(const IMAPParser::response& resp,
+                                                    IMAPParser::resp_text_code::type_t type)
+{
+    vector<const IMAPParser::resp_cond_state*> states;
+    if (resp.response_done && resp.response_done->response_tagged) {
+        states.push_back(resp.response_done->response_tagged->resp_cond_state.get());
+    }
+    for (vector<unique_ptr<IMAPParser::continue_req_or_response_data>>::const_iterator iter =
+             resp.continue_req_or_response_data.begin();
+         iter != resp.continue_req_or_response_data.end(); ++iter) {
+        if ((*iter)->response_data && (*iter)->response_data->resp_cond_state) {
+            states.push_back((*iter)->response_data->resp_cond_state.get());
+        }
+    }
+    for (vector<const IMAPParser::resp_cond_state*>::iterator iter = states.begin(); iter != states.end(); ++iter) {
+        const IMAPParser::resp_text* text = (*iter)->resp_text.get();
+        if (text && text->resp_text_code && text->resp_text_code->type == type) {
+            return text->resp_text_code->uidplus_data.get();
+        }
+    }
+    return NULL;
+}
+
+// the UIDs an APPENDUID response code assigned, ascending
+static vector<string> appendedUIDs(const IMAPParser::response& resp)
+{
+    const IMAPParser::uidplus_data* data = responseCode(resp, IMAPParser::resp_text_code::APPENDUID);
+    return data ? uidList(data->uid_set.get()) : vector<string>();
+}
+
+static bool taggedOK(const IMAPParser::response& resp)
+{
+    return resp.response_done && resp.response_done->response_tagged &&
+        resp.response_done->response_tagged->resp_cond_state->status == IMAPParser::resp_cond_state::OK;
+}
+
+int rawCommand(shared_ptr<IMAPConnection> conn, const string& command)
+{
+    conn->send(IMAPCommand::createCommand(command));
+    unique_ptr<IMAPParser::response> resp = conn->readResponse();
+    if (!taggedOK(*resp)) {
+        LOGFN(LOG, CRIT) << "'" << command << "' failed";
+        return -EIO;
+    }
+    return 0;
+}
+
+int uidExpunge(shared_ptr<IMAPStore> store, const string& mailbox, const vector<string>& uids)
+{
+    if (uids.empty()) {
+        return 0;
+    }
+    shared_ptr<IMAPConnection> conn = store->getConnection();
+    if (!conn->hasCapability("UIDPLUS")) {
+        return -ENOTSUP;
+    }
+    // the store's connection normally has nothing selected; SELECT (unlike
+    // CLOSE) drops whatever was selected without expunging it
+    int ret = rawCommand(conn, "SELECT " + IMAPUtils::quoteString(mailbox));
+    if (ret) {
+        return ret;
+    }
+    ret = rawCommand(conn, "UID EXPUNGE " + uidSet(uids));
+    if (conn->hasCapability("UNSELECT")) {
+        rawCommand(conn, "UNSELECT");
+    }
+    return ret;
+}
+
+int multiAppend(shared_ptr<IMAPStore> store, const string& mailbox, const vector<AppendT>& messages,
+                vector<string>& uids)
+{
+    uids.clear();
+    if (messages.empty()) {
+        return 0;
+    }
+    shared_ptr<IMAPConnection> conn = store->getConnection();
+    if (!conn->hasCapability("MULTIAPPEND") || !conn->hasCapability("UIDPLUS")) {
+        return -ENOTSUP;
+    }
+    // with LITERAL+ the whole thing goes out without waiting for "+"
+    bool nonSync = conn->hasCapability("LITERAL+");
+    string plus = nonSync ? "+}" : "}";
+
+    vector<byte_t> buf(64 * 1024);
+    bool ended = false;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const AppendT& m = messages[i];
+        string literal = "{" + to_string(m._size) + plus;
+        if (i == 0) {
+            conn->send(IMAPCommand::createCommand("APPEND " + IMAPUtils::quoteString(mailbox) + " " + literal));
+        }
+        else {
+            literal = " " + literal + "\r\n";
+            conn->sendRaw(reinterpret_cast<const byte_t*>(literal.data()), literal.length());
+        }
+        if (!nonSync && !continued(conn)) {
+            // a tagged NO instead of "+", which ends the command
+            LOGFN(LOG, CRIT) << "server refused MULTIAPPEND to " << mailbox;
+            return -EIO;
+        }
+        size_t sent = 0;
+        m._stream->reset();
+        while (sent < m._size) {
+            size_t r = m._stream->read(buf.data(), min(buf.size(), m._size - sent));
+            if (r == 0) {
+                // the literal's length is promised, pad it rather than
+                // leave the server waiting, and fail once it's answered
+                LOGFN(LOG, CRIT) << "message " << i << " for " << mailbox << " ended early";
+                r = min(buf.size(), m._size - sent);
+                memset(buf.data(), ' ', r);
+                ended = true;
+            }
+            conn->sendRaw(buf.data(), r);
+            sent += r;
+        }
+    }
+    conn->sendRaw(reinterpret_cast<const byte_t*>("\r\n"), 2);
+
+    unique_ptr<IMAPParser::response> resp = conn->readResponse();
+    if (!taggedOK(*resp)) {
+        LOGFN(LOG, CRIT) << "MULTIAPPEND of " << messages.size() << " messages to " << mailbox << " failed";
+        return -EIO;
+    }
+    uids = appendedUIDs(*resp);
+    if (uids.size() != messages.size()) {
+        LOGFN(LOG, CRIT) << "MULTIAPPEND to " << mailbox << " stored " << messages.size()
+                         << " messages but reported " << uids.size() << " UIDs";
+        return -EIO;
+    }
+    if (ended) {
+        // stored, but not what was meant to be; "uids" says what to delete
+        return -EIO;
+    }
+    return 0;
+}
+
+// UID COPY or UID MOVE of "uids" on a connection that has "mailbox"
+// selected, the new UIDs from COPYUID paired up with "uids" ascending
+static int copyOrMove(shared_ptr<IMAPConnection> conn, const string& verb, const string& mailbox,
+                      const vector<string>& uids, const string& to, vector<string>& copied)
+{
+    conn->send(IMAPCommand::createCommand("UID " + verb + " " + uidSet(uids) + " " + IMAPUtils::quoteString(to)));
+    unique_ptr<IMAPParser::response> resp = conn->readResponse();
+    if (!taggedOK(*resp)) {
+        LOGFN(LOG, CRIT) << "UID " << verb << " from " << mailbox << " to " << to << " failed";
+        return -EIO;
+    }
+    const IMAPParser::uidplus_data* data = responseCode(*resp, IMAPParser::resp_text_code::COPYUID);
+    copied = data ? uidList(data->uid_set2.get()) : vector<string>();
+    if (copied.size() != uids.size()) {
+        LOGFN(LOG, CRIT) << "UID " << verb << " to " << to << " reported " << copied.size() << " of "
+                         << uids.size() << " UIDs";
+        return -EIO;
+    }
+    return 0;
+}
+
+int uidCopy(shared_ptr<IMAPStore> store, const string& mailbox, const vector<string>& uids, const string& to,
+            vector<string>& copied)
+{
+    copied.clear();
+    if (uids.empty()) {
+        return 0;
+    }
+    shared_ptr<IMAPConnection> conn = store->getConnection();
+    if (!conn->hasCapability("UIDPLUS")) {
+        return -ENOTSUP;
+    }
+    int ret = rawCommand(conn, "EXAMINE " + IMAPUtils::quoteString(mailbox));
+    if (!ret) {
+        ret = copyOrMove(conn, "COPY", mailbox, uids, to, copied);
+    }
+    if (conn->hasCapability("UNSELECT")) {
+        rawCommand(conn, "UNSELECT");
+    }
+    return ret;
+}
+
+int uidMove(shared_ptr<IMAPStore> store, const string& mailbox, const vector<string>& uids, const string& to,
+            vector<string>& copied, bool& moved)
+{
+    copied.clear();
+    moved = false;
+    if (uids.empty()) {
+        return 0;
+    }
+    shared_ptr<IMAPConnection> conn = store->getConnection();
+    if (!conn->hasCapability("UIDPLUS")) {
+        return -ENOTSUP;
+    }
+    int ret = rawCommand(conn, "SELECT " + IMAPUtils::quoteString(mailbox));
+    if (!ret) {
+        if (conn->hasCapability("MOVE")) {
+            ret = copyOrMove(conn, "MOVE", mailbox, uids, to, copied);
+            moved = !ret;
+        }
+        else {
+            // the originals are only flagged, expunging is up to the caller
+            ret = copyOrMove(conn, "COPY", mailbox, uids, to, copied);
+            if (!ret) {
+                ret = rawCommand(conn, "UID STORE " + uidSet(uids) + " +FLAGS.SILENT (\\Deleted)");
+            }
+        }
+    }
+    if (conn->hasCapability("UNSELECT")) {
+        rawCommand(conn, "UNSELECT");
+    }
+    return ret;
+}
+
+int uidSearch(shared_ptr<IMAPStore> store, const string& mailbox, const string& criteria, vector<string>& uids)
+{
+    uids.clear();
+    shared_ptr<IMAPConnection> conn = store->getConnection();
+    int ret = rawCommand(conn, "EXAMINE " + IMAPUtils::quoteString(mailbox));
+    if (!ret) {
+        conn->send(IMAPCommand::createCommand("UID SEARCH " + criteria));
+        unique_ptr<IMAPParser::response> resp = conn->readResponse();
+        if (!taggedOK(*resp)) {
+            LOGFN(LOG, CRIT) << "UID SEARCH " << criteria << " in " << mailbox << " failed";
+            ret = -EIO;
+        }
+        else {
+            vector<uint32_t> found;
+            for (vector<unique_ptr<IMAPParser::continue_req_or_response_data>>::iterator iter =
+                     resp->continue_req_or_response_data.begin();
+                 iter != resp->continue_req_or_response_data.end(); ++iter) {
+                const IMAPParser::response_data* data = (*iter)->response_data.get();
+                if (!data || !data->mailbox_data || data->mailbox_data->type != IMAPParser::mailbox_data::SEARCH) {
+                    continue;
+                }
+                const IMAPParser::mailbox_data* mbox = data->mailbox_data.get();
+                for (size_t i = 0; i < mbox->search_nz_number_list.size(); ++i) {
+                    found.push_back(mbox->search_nz_number_list[i]->value);
+                }
+            }
+            sort(found.begin(), found.end());
+            for (vector<uint32_t>::iterator iter = found.begin(); iter != found.end(); ++iter) {
+                uids.push_back(to_string(*iter));
+            }
+        }
+    }
+    if (conn->hasCapability("UNSELECT")) {
+        rawCommand(conn, "UNSELECT");
+    }
+    return ret;
+}
+
+int notifyAll(shared_ptr<IMAPStore> store)
+{
+    shared_ptr<IMAPConnection> conn = store->getConnection();
+    if (!conn->hasCapability("NOTIFY")) {
+        return -ENOTSUP;
+    }
+    return rawCommand(conn, "NOTIFY SET (selected (MessageNew MessageExpunge FlagChange))"
+                      " (personal (MessageNew MessageExpunge))");
+}
+
+// which mailboxes the untagged part of "resp" says changed; true if the
+// server is waiting for more of the command
+static bool changedMailboxes(const IMAPParser::response& resp, const string& selected, set<string>& changed)
+{
+    bool cont = false;
+    for (vector<unique_ptr<IMAPParser::continue_req_or_response_data>>::const_iterator iter =
+             resp.continue_req_or_response_data.begin();
+         iter != resp.continue_req_or_response_data.end(); ++iter) {
+        if ((*iter)->continue_req) {
+            cont = true;
+            continue;
+        }
+        const IMAPParser::response_data* data = (*iter)->response_data.get();
+        if (!data) {
+            continue;
+        }
+        if (data->message_data) {
+            // EXPUNGE, or FETCH with new flags
+            changed.insert(selected);
+        }
+        else if (data->mailbox_data) {
+            const IMAPParser::mailbox_data* mbox = data->mailbox_data.get();
+            if (mbox->type == IMAPParser::mailbox_data::EXISTS) {
+                changed.insert(selected);
+            }
+            else if (mbox->type == IMAPParser::mailbox_data::STATUS && mbox->mailbox) {
+                changed.insert(mbox->mailbox->name);
+            }
+        }
+    }
+    return cont;
+}
+
+int idle(shared_ptr<IMAPStore> store, const string& selected, function<void ()> wait, set<string>& changed)
+{
+    shared_ptr<IMAPConnection> conn = store->getConnection();
+    if (!conn->hasCapability("IDLE")) {
+        // whatever happened meanwhile comes along with the NOOP
+        wait();
+        conn->send(IMAPCommand::createCommand("NOOP"));
+        unique_ptr<IMAPParser::response> resp = conn->readResponse();
+        changedMailboxes(*resp, selected, changed);
+        return resp->response_done ? 0 : -EIO;
+    }
+
+    conn->send(IMAPCommand::createCommand("IDLE"));
+    unique_ptr<IMAPParser::response> resp = conn->readResponse();
+    if (!changedMailboxes(*resp, selected, changed)) {
+        LOGFN(LOG, CRIT) << "server refused IDLE on " << selected;
+        return -EIO;
+    }
+    // the server keeps pushing untagged responses while we wait, they're
+    // all read in one go after DONE
+    wait();
+    conn->sendRaw(reinterpret_cast<const byte_t*>("DONE\r\n"), 6);
+    resp = conn->readResponse();
+    changedMailboxes(*resp, selected, changed);
+    if (!taggedOK(*resp)) {
+        LOGFN(LOG, CRIT) << "IDLE on " << selected << " failed";
+        return -EIO;
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <vmime/vmime.hpp>
+#include <vmime/net/imap/imap.hpp>
+
+// The few IMAP commands vmime has no API for, sent straight down a store's
+// own connection.  Mailbox names are the raw (modified UTF-7) names we keep
+// in _mailbox, and the caller must hold the connection, see ConnectionT.
+
+// "uids" as an IMAP sequence set, runs of consecutive UIDs collapsed
+std::string uidSet(const std::vector<std::string>& uids);
+
+// sends "command" and waits for its tagged response, 0 if it was OK
+int rawCommand(std::shared_ptr<vmime::net::imap::IMAPConnection> conn, const std::string& command);
+
+// removes exactly "uids" (already flagged \Deleted) from "mailbox", leaving
+// anything else flagged there alone.  -ENOTSUP if the server doesn't do
+// UIDPLUS, in which case only a plain EXPUNGE will do
+int uidExpunge(std::shared_ptr<vmime::net::imap::IMAPStore> store, const std::string& mailbox,
+               const std::vector<std::string>& uids);
+
+// one message for multiAppend(), exactly "size" bytes read from "stream"
+struct AppendT {
+    AppendT(std::shared_ptr<vmime::utility::inputStream> stream, size_t size): _stream(stream), _size(size) { }
+
+    std::shared_ptr<vmime::utility::inputStream> _stream;
+    size_t _size;
+};
+
+// appends all of "messages" to "mailbox" in one MULTIAPPEND (RFC 3502),
+// so it's one round trip (none per literal with LITERAL+) and either all
+// of them get stored or none do.  "uids" comes from APPENDUID, in the
+// order the messages were given.  -ENOTSUP unless the server does both
+// MULTIAPPEND and UIDPLUS.  A stream that ends early is padded out and
+// makes it -EIO, with "uids" still set so the caller can delete them
+int multiAppend(std::shared_ptr<vmime::net::imap::IMAPStore> store, const std::string& mailbox,
+                const std::vector<AppendT>& messages, std::vector<std::string>& uids);
+
+// copies "uids" from "mailbox" to "to" without them ever leaving the
+// server; "copied" gets their new UIDs (from COPYUID) in the same order as
+// "uids" sorted ascending.  -ENOTSUP unless the server does UIDPLUS
+int uidCopy(std::shared_ptr<vmime::net::imap::IMAPStore> store, const std::string& mailbox,
+            const std::vector<std::string>& uids, const std::string& to, std::vector<std::string>& copied);
+
+// the same as a move: UID MOVE (RFC 6851) where the server has it, a copy
+// with the originals flagged \Deleted otherwise, in which case "moved" is
+// false and expunging them is up to the caller
+int uidMove(std::shared_ptr<vmime::net::imap::IMAPStore> store, const std::string& mailbox,
+            const std::vector<std::string>& uids, const std::string& to, std::vector<std::string>& copied,
+            bool& moved);
+
+// UIDs of the messages in "mailbox" matching "criteria" (a UID SEARCH
+// search key, sent as is), ascending
+int uidSearch(std::shared_ptr<vmime::net::imap::IMAPStore> store, const std::string& mailbox,
+              const std::string& criteria, std::vector<std::string>& uids);
+
+// asks the server (RFC 5465) to report new and expunged messages in every
+// other mailbox too, as untagged STATUS responses that idle() picks up.
+// -ENOTSUP if the server doesn't do NOTIFY
+int notifyAll(std::shared_ptr<vmime::net::imap::IMAPStore> store);
+
+// one round of waiting for changes to "selected" (EXAMINEd by the caller):
+// IDLE until "wait" returns, then DONE, or a NOOP after "wait" if the server
+// has no IDLE.  Every mailbox something happened to goes into "changed",
+// with NOTIFY on that includes ones other than "selected"
+int idle(std::shared_ptr<vmime::net::imap::IMAPStore> store, const std::string& selected,
+         std::function<void ()> wait, std::set<std::string>& changed);
@@ -7,6 +7,7 @@
 #include "stack_trace.h"
 #include "time.h"
 #include "fs_log.h"
+#include "imap_raw.h"
 #include "imapfs.h"
 
 using namespace std;
@@ -16,6 +17,28 @@ char PATH_DELIMITER = '/';
 const string FS_PREFIX = ".fs";
 const string FS_WARN = "DO NOT DELETE.  This is a generated message from IMAPFS.";
 const string FS_BINSIZE_HEADER = "X-FS-Octets";
+// chunks of every file live here, it has no path and isn't a directory
+const string FS_CHUNK_MAILBOX = FS_PREFIX + "@chunks";
+const string COPY_XATTR = "user.imapfs.copy-from";
+// how much of a file we move between server, cache and write buffer at once
+static const size_t LOAD_PIECE = 1024 * 1024;
+// a directory scan is one that opens this many files in listing order...
+static const unsigned SCAN_STREAK = 2;
+// ...skipping at most this many in between (directories, say)
+static const size_t SCAN_SLACK = 4;
+// files fetched ahead of a scan, and the largest one worth fetching
+static const size_t PREFETCH_FILES = 8;
+static const off_t PREFETCH_MAX_FILE = 4 * 1024 * 1024;
+static const size_t PREFETCH_THREADS = 2;
+// scans remembered at once, they're simply all dropped past this
+static const size_t MAX_SCANS = 1024;
+// most chunks sent in one MULTIAPPEND
+static const size_t APPEND_BATCH = 16;
+// seconds between passes of the chunk collector
+static const int COLLECT_INTERVAL = 600;
+// seconds one round of IDLE lasts; the server pushes changes as they
+// happen, but vmime can only read them once we end the round
+static const int WATCH_INTERVAL = 5;
 
 set<string> _ignore { 
     PATH_DELIMITER + "/.xdg-volume-info",
@@ -41,142 +64,77 @@ static void dump(stringstream& ss, const NodeT& at, int indent)
         ss << " ";
     }
     ss << at._name << endl;
-    for (set<NodeT>::iterator iter = at._sub.begin(); iter != at._sub.end(); ++iter) {
-        dump(ss, *iter, indent + 4);
+    for (vector<NodeT*>::const_iterator iter = at._children.begin(); iter != at._children.end(); ++iter) {
+        dump(ss, **iter, indent + 4);
     }
 }
 
-string trim(const string& s)
+// mailbox names encode the full path, with ':' for the path separator
+static string mailboxForPath(const string& path)
 {
-    if (s[0] == PATH_DELIMITER) {
-        return s.substr(1);
-    }
-    return s;
+    string name = FS_PREFIX + path;
+    replace(name.begin(), name.end(), '/', ':');
+    return name;
 }
 
-vector<string> split(const string& s, char delim)
+static string pathForMailbox(const string& mailbox)
 {
-    //LOG(LOG, INFO) << "splitting " << s;
-    string tmp(s);
-    if (tmp[0] == delim) {
-        tmp = tmp.substr(1);
-    }
-    vector<string> elems;
-    stringstream ss(tmp);
-    string item;
-    while (getline(ss, item, delim)) {
-        elems.push_back(item);
-    }
-    //ss.clear();
-    //for (vector<string>::iterator iter = elems.begin(); iter != elems.end(); ++iter) {
-    //    ss << "/" << *iter;
-    //}
-    //LOG(LOG, INFO) << "split " << ss.str();
-    return elems;
+    string path = mailbox.substr(FS_PREFIX.length());
+    replace(path.begin(), path.end(), ':', '/');
+    return path;
 }
 
-NodeT* find(vector<string>::iterator at, const vector<string>::const_iterator& end, const NodeT& in)
+string trim(const string& s)
 {
-    if (at == end) {
-        return NULL;
-    }
-    
-    set <NodeT>::iterator n = in._sub.find(*at);
-    if (n != in._sub.end()) {
-        vector<string>::iterator next = ++at;
-        if (next == end) {
-            // no more path elements to look at
-            return const_cast<NodeT*>(&(*n));
-        }
-        return find(next, end, *n);
+    if (s[0] == PATH_DELIMITER) {
+        return s.substr(1);
     }
-    return NULL;
+    return s;
 }
 
-class _trace: public vmime::net::tracer
-{
-public:
-    _trace(const vmime::string& proto, const int connectionID): _proto(proto), _connectionID(connectionID) { }
-    
-    void traceSend(const vmime::string& line) {
-        LOG(LOG, INFO) << "[" << _proto << ":" << _connectionID << "] -> " << line << endl;
-    }
-    
-    void traceReceive(const vmime::string& line) {
-        LOG(LOG, INFO) << "[" << _proto << ":" << _connectionID << "] <- " << line << endl;
-    }
-    
-    const vmime::string _proto;
-    const int _connectionID;
-};
-
-class _tracefactory: public net::tracerFactory
-{
-public:
-    shared_ptr<net::tracer> create(shared_ptr<net::service> serv, const int connectionID) {
-        return make_shared<_trace>(serv->getProtocolName(), connectionID);
-    }
-};
-
-class _timeouthandler: public net::timeoutHandler
-{
-public:
-    _timeouthandler() {
-        _startTime = time(NULL);
-    }
-    
-    bool isTimeOut() {
-        return (time(NULL) > _startTime + 4);
-    }
-    
-    void resetTimeOut() {
-        _startTime = time(NULL);
-    }
-    
-    bool handleTimeOut() {
-        cout << "timed out" << endl;
-        return false;
-    }
-    
-    time_t _startTime;
-};
-
-class _timeouthandlerfactory: public net::timeoutHandlerFactory
-{
-public:
-    shared_ptr<net::timeoutHandler> create() {
-        return make_shared<_timeouthandler>();
-    }
-};
-
-class _certverify: public security::cert::certificateVerifier
-{
-public:
-    void verify(shared_ptr<security::cert::certificateChain> chain, const string& hostname) {
-    }
-};
-
-IMAPFS::IMAPFS(const string& host, unsigned short port, const string& authuser, const string& password):
-    _host(host), _port(port), _authuser(authuser), _password(password), _root(NULL)
+IMAPFS::IMAPFS(const string& host, unsigned short port, const string& authuser, const string& password,
+               size_t connections):
+    _host(host), _port(port), _authuser(authuser), _password(password), _watchingAll(false), _treeRemoval(false), _stopping(false)
 {
-    _session = net::session::create();
-    string urlString = "imaps://";
+    _url = "imaps://";
     if (_authuser != "" && _password != "") {
-        urlString += (_authuser + ":" + _password + "@");
+        _url += (_authuser + ":" + _password + "@");
     }
-    urlString += _host;
+    _url += _host;
     if (_port) {
-        urlString += string(":" + to_string(_port));
+        _url += string(":" + to_string(_port));
     }
-    utility::url url(urlString);
-
-    _store = std::dynamic_pointer_cast<net::imap::IMAPStore>(_session->getStore(url));
-    _store->setTimeoutHandlerFactory(make_shared<_timeouthandlerfactory>());
-    _store->setTracerFactory(make_shared<_tracefactory>());
-    _store->setCertificateVerifier(make_shared<_certverify>());
-    _store->connect();
     // LAM
     _seperator = '/'; 
+    _pool.connect(_url, connections, _seperator);
+    _expunges.start([this](const string& mailbox, const vector<string>& uids) {
+        return expungeBatch(mailbox, uids);
+    });
+}
+
+IMAPFS::~IMAPFS()
+{
+    _prefetcher.stop();
+    // one last go at everything still queued, the journal keeps the rest
+    _writeback.stop();
+    {
+        lock_guard<mutex> lock(_collectorMutex);
+        _stopping = true;
+    }
+    _collectorWake.notify_all();
+    if (_collector.joinable()) {
+        _collector.join();
+    }
+    if (_revalidator.joinable()) {
+        _revalidator.join();
+    }
+    if (_watcher.joinable()) {
+        _watcher.join();
+    }
+    // last, both of the above delete messages
+    _expunges.stop();
+    // nothing changes any more, the next mount starts from here
+    storeSnapshot();
 }
 
 int IMAPFS::getattr(const string& path, struct stat* status)
@@ -187,12 +145,8 @@ int IMAPFS::getattr(const string& path, struct stat* status)
         return -ENOENT;
     }
     
-    if (path == "/") {
-        memcpy(status, &(_root->_stat), sizeof(struct stat));
-        return 0;
-    }
-    
-    NodeT* n = findNode(path);
+    ReadLockT lock(_lock);
+    NodeT* n = _nodes.find(path);
     if (!n) {
         LOGFN(LOG, CRIT) << "path " << path << " not found";
         return -ENOENT;
@@ -223,7 +177,7 @@ int IMAPFS::statfs(const string& path, struct statvfs* stat)
 }
 
 // mknod creates files within directories, in our case, only regular files, ever
-int IMAPFS::mknod(const string& path, mode_t mode)
+int IMAPFS::mknod(const string& path, mode_t mode, uid_t uid, gid_t gid)
 {
     LOGFN(LOG, INFO) << "mknod " << path << " mode " << mode;
     
@@ -232,39 +186,32 @@ int IMAPFS::mknod(const string& path, mode_t mode)
         return -1;
     }
     
-    NodeT* n = findNode(path);
+    WriteLockT lock(_lock);
+    NodeT* n = _nodes.find(path);
     if (n) {
         LOG(LOG, CRIT) << "path already exists";
         return -EEXIST;
     }
     
-    vector<string> elems = split(path, PATH_DELIMITER);
-    string leaf = elems.back(); elems.pop_back();
-    NodeT a(leaf, "0");
-    a._stat.st_nlink = 1;
-    a._stat.st_mode = mode;
-    a._stat.st_uid = fuse_get_context()->uid;
-    a._stat.st_gid = fuse_get_context()->gid;
-    a._stat.st_size = a._stat.st_blksize = a._stat.st_blocks = 0;
+    NodeT* in = findParent(path);
+    if (!in) {
+        LOGFN(LOG, CRIT) << "can't find " << path;
+        return -ENOENT;
+    }
+    string leaf = leafName(path);
+    LOGFN(LOG, INFO) << "adding " << leaf << " to " << in->_name;
+    NodeT* a = _nodes.create(in, leaf);
+    a->_stat.st_nlink = 1;
+    a->_stat.st_mode = mode;
+    a->_stat.st_uid = uid;
+    a->_stat.st_gid = gid;
+    a->_stat.st_size = a->_stat.st_blksize = a->_stat.st_blocks = 0;
 
     time_t t = Time().now().seconds();
     //LOG(LOG, INFO) << "yy/mm/dd " << tm.tm_year << "/" << (tm.tm_mon + 1) << "/" << tm.tm_mday
     //               << " hh:mm:ss " << tm.tm_hour << ":" << tm.tm_min << ":" << tm.tm_sec;
-    a._stat.st_atim.tv_sec = a._stat.st_mtim.tv_sec = a._stat.st_ctim.tv_sec = t;
-
-    NodeT* in = _root;
-    if (elems.size()) {
-        // get correct mailbox, add node
-        in = ::find(elems.begin(), elems.end(), *_root);
-        if (!in) {
-            LOGFN(LOG, CRIT) << "can't find " << path;
-            return -ENOENT;
-        }
-    }
-    LOGFN(LOG, INFO) << "adding " << leaf << " to " << in->_name;
-    a._parent = in;
-    a._folder = in->_folder;
-    in->_sub.insert(a);
+    a->_stat.st_atim.tv_sec = a->_stat.st_mtim.tv_sec = a->_stat.st_ctim.tv_sec = t;
+    a->_mailbox = in->_mailbox;
 
     //stringstream ss;
     //dump(ss, *in, 0);
@@ -272,458 +219,2625 @@ int IMAPFS::mknod(const string& path, mode_t mode)
     return 0;
 }
 
-int IMAPFS::readdir(const string& path, void* buf, fuse_fill_dir_t filler, off_t offset)
+int IMAPFS::loadDirectory(NodeT* n, bool refresh, vector<InvalidationT>* changes)
 {
-    LOGFN(LOG, INFO) << "readdir " << path << " offset " << offset;
-    
-    int count = 0;
-    NodeT* n = findNode(path);
-    if (!n) {
-        return -ENOENT;
+    // serializes concurrent listings of the same directory, the first one
+    // does the work and everybody else finds E_HAVEMESSAGES set
+    lock_guard<mutex> nlock(n->_mutex);
+    bool loaded = (n->_flags & E_HAVEMESSAGES) != 0;
+    if (loaded && !refresh) {
+        return 0;
     }
-    
-    if (!(n->_flags & E_HAVEMESSAGES)) {
-        shared_ptr<net::folder> folder = n->_folder;
+    ConnectionT conn(_pool, n->_mailbox);
+    shared_ptr<net::folder> folder = conn.folder(n->_mailbox, false);
+    if (!loaded) {
         net::folderAttributes attr = folder->getAttributes();
         int flags = attr.getFlags();
         int type = attr.getType();
         if (flags & net::folderAttributes::FLAG_NO_OPEN) {
             LOGFN(LOG, CRIT) << "folder shouldn't have 'no open' attribute";
-            return 0;
+            return -EIO;
         }
         if (!(type & net::folderAttributes::TYPE_CONTAINS_MESSAGES)) {
             LOGFN(LOG, CRIT) << "folder should have 'TYPE_CONTAINS_MESSAGE' flag";
-            return 0;
+            return -EIO;
         }
-        if (!folder->isOpen()) {
-            folder->open(net::folder::Modes::MODE_READ_WRITE);
+    }
+    // selected through the pool, so it counts towards this connection's
+    // open mailboxes
+    folder = conn.folder(n->_mailbox);
+
+    // one STATUS tells us whether there's anything to fetch at all
+    SyncStateT now = folderState(folder);
+    SyncStateT last = syncState(n->_mailbox);
+    bool full = !loaded || !last._uidNext || last._uidValidity != now._uidValidity;
+    if (!full && now == last) {
+        return 0;
+    }
+
+    vector<shared_ptr<net::message>> messages;
+    // every live UID, when we had to look for ones that went away
+    set<string> present;
+    bool sweep = false;
+    if (full) {
+        messages = fetchMessages(folder);
+        // after a UIDVALIDITY change none of the UIDs we have mean anything
+        sweep = loaded;
+        for (vector<shared_ptr<net::message>>::iterator iter = messages.begin(); iter != messages.end(); ++iter) {
+            present.insert((*iter)->getUID());
         }
-        vector<shared_ptr<net::message>> messages = folder->getMessages(net::messageSet::byNumber(1, -1));
-        rebuildMessages(n, folder);
-        n->_flags |= (E_HAVEMESSAGES);
     }
-    for (set<NodeT>::iterator iter = n->_sub.begin(); iter != n->_sub.end(); ++iter, ++count) {
-        if (count < offset) {
-            continue;
+    else {
+        // only what was appended since, messages keep their UIDs so
+        // nothing below UIDNEXT can be new
+        size_t appended = 0;
+        if (now._uidNext > last._uidNext) {
+            vector<shared_ptr<net::message>> fresh = fetchMessages(folder,
+                net::messageSet::byUID(to_string(last._uidNext), "*"));
+            for (vector<shared_ptr<net::message>>::iterator iter = fresh.begin(); iter != fresh.end(); ++iter) {
+                // "n:*" always matches the last message, even below n
+                if (strtoul(string((*iter)->getUID()).c_str(), NULL, 10) < last._uidNext) {
+                    continue;
+                }
+                ++appended;
+                if (!((*iter)->getFlags() & net::message::FLAG_DELETED)) {
+                    messages.push_back(*iter);
+                }
+            }
         }
-        LOGFN(LOG, DEBUG) << "adding " << iter->_name;
-        int ret = filler(buf, iter->_name.c_str(), &(iter->_stat), count + 1);
-        if (ret) {
-            return 0;
+        if (now._count != last._count + appended) {
+            // something was expunged, find out what from the UIDs alone
+            sweep = true;
+            present = liveUIDs(folder);
         }
     }
-    return 0;
-}
-
-int IMAPFS::read(const string& path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
-{
-    LOGFN(LOG, INFO) << "read " << path << " at " << offset << ", " << size << " bytes";
+    LOGFN(LOG, INFO) << n->_mailbox << ": " << messages.size() << " new messages"
+                     << (sweep ? ", looking for removed ones" : "");
 
-    NodeT* n = findNode(path);
-    if (!n) {
-        LOGFN(LOG, CRIT) << "could not find " << path;
-        return -ENOENT;
+    WriteLockT lock(_lock);
+    // name -> inode as the kernel may have seen it
+    map<string, ino_t> before;
+    if (changes) {
+        for (vector<NodeT*>::iterator iter = n->_children.begin(); iter != n->_children.end(); ++iter) {
+            before[(*iter)->_name] = (*iter)->_ino;
+        }
     }
-        
-    shared_ptr<net::folder> folder = n->_folder;
-
-    if (n->_contents.size() != 0) {
-        LOGFN(LOG, INFO) << "have cached message contents";
-    }
-    else if (n->_message) {
-        folder->fetchMessage(n->_message,
-            net::fetchAttributes(net::fetchAttributes::ENVELOPE | 
-                                 net::fetchAttributes::STRUCTURE |
-                                 net::fetchAttributes::CONTENT_INFO) );
-        shared_ptr<message> parsed = n->_message->getParsedMessage();
-        std::vector<shared_ptr<const attachment>> attachments = attachmentHelper::findAttachmentsInMessage(parsed);
-        if (attachments.size() != 1) {
-            LOGFN(LOG, CRIT) << "expected one attachment";
-            return -1;
+    if (sweep) {
+        vector<NodeT*> gone;
+        for (vector<NodeT*>::iterator iter = n->_children.begin(); iter != n->_children.end(); ++iter) {
+            NodeT* c = *iter;
+            // directories are mailboxes of their own, and anything stored
+            // since the STATUS is newer than our list of UIDs
+            if (!S_ISREG(c->_stat.st_mode) || c->_uid == "0" || present.count(c->_uid) ||
+                strtoul(c->_uid.c_str(), NULL, 10) >= now._uidNext) {
+                continue;
+            }
+            // somebody busy with it (or with unsaved data) gets to keep it
+            unique_lock<mutex> clock(c->_mutex, try_to_lock);
+            if (!clock.owns_lock() || (c->_flags & E_NEEDSYNC)) {
+                continue;
+            }
+            gone.push_back(c);
+        }
+        for (vector<NodeT*>::iterator iter = gone.begin(); iter != gone.end(); ++iter) {
+            LOGFN(LOG, INFO) << (*iter)->_path << " was removed elsewhere";
+            _nodes.erase(*iter);
         }
-        shared_ptr<const attachment> fileAtt = attachments[0];
-        shared_ptr<const contentHandler> data = fileAtt->getData();
-        utility::outputStreamByteArrayAdapter badapter(n->_contents);
-        data->extract(badapter);
     }
-    else {
-        LOG(LOG, CRIT) << "message empty";
-        return -1;
+    for (vector<shared_ptr<net::message>>::iterator iter = messages.begin(); iter != messages.end(); ++iter) {
+        rebuildMessage(n, n->_mailbox, *iter);
     }
-    
-    if (n->_contents.size() < (offset + size)) {
-        size = n->_contents.size() - offset;
+    if (changes) {
+        map<string, ino_t> after;
+        for (vector<NodeT*>::iterator iter = n->_children.begin(); iter != n->_children.end(); ++iter) {
+            after[(*iter)->_name] = (*iter)->_ino;
+        }
+        for (map<string, ino_t>::iterator iter = before.begin(); iter != before.end(); ++iter) {
+            map<string, ino_t>::iterator now = after.find(iter->first);
+            if (now == after.end() || now->second != iter->second) {
+                changes->push_back(InvalidationT(n->_ino, iter->first, iter->second));
+            }
+        }
+        for (map<string, ino_t>::iterator iter = after.begin(); iter != after.end(); ++iter) {
+            if (!before.count(iter->first)) {
+                changes->push_back(InvalidationT(n->_ino, iter->first, 0));
+            }
+        }
     }
-    memcpy(buf, &(n->_contents[offset]), size);
-    LOGFN(LOG, INFO) << size << " bytes read";
-    time_t t = Time().now().seconds();
-    n->_stat.st_atim.tv_sec = t;
-    return size;
+    n->_flags |= (E_HAVEMESSAGES);
+    setSyncState(n->_mailbox, now);
+    return 0;
 }
 
-int IMAPFS::write(const string& path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+int IMAPFS::readdir(const string& path, void* buf, fuse_fill_dir_t filler, off_t offset)
 {
-    LOGFN(LOG, INFO) << "write " << path << " at " << offset << ", " << size << " bytes";
-
-    NodeT* n = findNode(path);
+    LOGFN(LOG, INFO) << "readdir " << path << " offset " << offset;
+    
+    shared_ptr<NodeT> n = findNode(path);
     if (!n) {
         return -ENOENT;
     }
     
-    string writebuf(buf, size);
-    byteArray& contents = n->_contents;    
-    if (static_cast<unsigned int>(offset) > contents.size()) {
-        contents.resize(offset + size);
+    if (loadDirectory(n.get(), offset == 0)) {
+        return 0;
     }
-    contents.insert(contents.end(), writebuf.begin(), writebuf.end());
-
-    n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = contents.size();
-    time_t t = Time().now().seconds();
-    n->_stat.st_atim.tv_sec = n->_stat.st_mtim.tv_sec = t;
-    n->_flags |= E_NEEDSYNC;
-    return size;
+    if (offset == 0) {
+        noteListing(n.get());
+    }
+    ReadLockT lock(_lock);
+    for (size_t i = InodeTableT::seek(n.get(), offset); i < n->_children.size(); ++i) {
+        NodeT* c = n->_children[i];
+        LOGFN(LOG, DEBUG) << "adding " << c->_name;
+        int ret = filler(buf, c->_name.c_str(), &(c->_stat), c->_cookie);
+        if (ret) {
+            return 0;
+        }
+    }
+    return 0;
 }
 
-int IMAPFS::fsync(const string& path, int isdatasync, struct fuse_file_info* fi)
+int IMAPFS::read(const string& path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
 {
-    LOGFN(LOG, INFO) << "sync " << path;
-    
-    NodeT* n = findNode(path);
+    shared_ptr<NodeT> n = findNode(path);
     if (!n) {
+        LOGFN(LOG, CRIT) << "could not find " << path;
         return -ENOENT;
     }
+    return read(n, buf, size, offset, fi);
+}
 
-    byteArray& contents = n->_contents;
-   
-    shared_ptr<net::folder> fsMailbox = n->_folder;
-    
-    vector<string> elems = split(path, '/');
-    string filename = elems.back();
-    
-    messageBuilder mb;
-    mb.setExpeditor(mailbox(_authuser + "@" + _host));
-    addressList to;
-    to.appendAddress(make_shared<mailbox>(_authuser + "@" + _host));
-    mb.setRecipients(to);
-
-    // the filename we want will get embedded in the subject here
-    mb.setSubject(text(filename));
-
-    mb.getTextPart()->setText(
-        make_shared<stringContentHandler>(FS_WARN));
-
-    word wname(filename);
-
-    shared_ptr<utility::inputStreamByteBufferAdapter> adapter =
-        make_shared<utility::inputStreamByteBufferAdapter>(&contents[0], contents.size());
-    shared_ptr<contentHandler> ch = make_shared<streamContentHandler>(adapter, contents.size());
-    
-    shared_ptr<fileAttachment> fa = make_shared<fileAttachment>(ch, wname, vmime::mediaType());
-    
-    time_t t = Time().now().seconds();
-    fa->getFileInfo().setCreationDate(datetime(t));
-    
-    mb.attach(fa);
-    shared_ptr<message> msg = mb.construct();
-    shared_ptr<header> header = msg->getHeader();
-    shared_ptr<headerField> binsize = header->getField(FS_BINSIZE_HEADER);
-    string ssize = to_string(contents.size());
-    binsize->setValue(ssize);
-    
-    net::messageSet tmpAdd = fsMailbox->addMessage(msg);
-    const net::UIDMessageRange tmpr = dynamic_cast<const net::UIDMessageRange&>(tmpAdd.getRangeAt(0));
-    string newID = string(tmpr.getFirst());
-    
-    if (n->_uid != "0") {
-        net::messageSet tmpDel = net::messageSet::byUID(net::message::uid(n->_uid));
+int IMAPFS::read(shared_ptr<NodeT> n, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    LOGFN(LOG, INFO) << "read " << pathOf(n.get()) << " at " << offset << ", " << size << " bytes";
 
-        fsMailbox->deleteMessages(tmpDel);
-        fsMailbox->expunge();
+    if (offset == 0) {
+        noteOpen(n.get());
     }
-    
-    n->_uid = newID;
-    n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = contents.size();
-    n->_stat.st_atim.tv_sec = n->_stat.st_mtim.tv_sec = t;
-
-    vector<shared_ptr<net::message>> messages = fsMailbox->getMessages(net::messageSet::byUID(newID));
-    n->_message = messages[0];
-    
-    return 0;
-}
+    lock_guard<mutex> nlock(n->_mutex);
 
-int IMAPFS::fallocate(const string& path, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
-{
-    LOGFN(LOG, INFO) << "allocate for " << path << " " << length << " bytes, at " << offset;
-    return 0;
+    off_t fileSize;
+    {
+        ReadLockT lock(_lock);
+        fileSize = n->_stat.st_size;
+    }
+    if (offset >= fileSize) {
+        return 0;
+    }
+    if (offset + static_cast<off_t>(size) > fileSize) {
+        size = fileSize - offset;
+    }
+    off_t aheadStart, aheadEnd;
+    if (_prefetcher.running() && n->_readAhead.advance(offset, size, n->_baseSize, aheadStart, aheadEnd)) {
+        // queued before our own read, so it's on the wire while we wait
+        readAhead(n.get(), aheadStart, aheadEnd);
+    }
+    ssize_t r = readMerged(n.get(), buf, size, offset);
+    if (r >= 0) {
+        LOGFN(LOG, INFO) << r << " bytes read";
+        time_t t = Time().now().seconds();
+        WriteLockT lock(_lock);
+        n->_stat.st_atim.tv_sec = t;
+    }
+    return r;
 }
 
-int IMAPFS::truncate(const string& path, off_t size)
+ssize_t IMAPFS::readMerged(NodeT* n, char* buf, size_t size, off_t offset)
 {
-    LOGFN(LOG, INFO) << "truncate " << path << " to " << size << " bytes";
-    
-    NodeT* n = findNode(path);
-    if (!n) {
-        return -ENOENT;
+    // whatever was written lives in the buffer (holes read as zeroes), the
+    // rest of what the server has still comes from there
+    if (!n->_buffer.empty()) {
+        ssize_t r = n->_buffer.pread(buf, size, offset);
+        if (r < 0) {
+            return r;
+        }
+        memset(buf + r, 0, size - r);
     }
-    return 0;
+    else {
+        memset(buf, 0, size);
+    }
+    vector<ExtentMapT::RangeT> gaps = n->_extents.gaps(offset, min(offset + static_cast<off_t>(size), n->_baseSize));
+    for (vector<ExtentMapT::RangeT>::iterator iter = gaps.begin(); iter != gaps.end(); ++iter) {
+        size_t length = iter->second - iter->first;
+        ssize_t r = readNode(n, buf + (iter->first - offset), length, iter->first, n->_baseSize);
+        if (r < 0) {
+            return r;
+        }
+        if (static_cast<size_t>(r) != length) {
+            LOGFN(LOG, CRIT) << "server copy of " << n->_uid << " is short at " << iter->first;
+            return -EIO;
+        }
+    }
+    return size;
 }
 
-int IMAPFS::access(const string& path, int mask)
+ssize_t IMAPFS::readNode(NodeT* n, char* buf, size_t size, off_t offset, off_t fileSize)
 {
-    LOGFN(LOG, INFO) "access " << path;
-    NodeT* n = findNode(path);
-    if ((mask & F_OK) && !n) {
-        LOGFN(LOG, INFO) << "file does not exist";
-        return -ENOENT;
+    unique_ptr<ConnectionT> conn;
+    ManifestT& manifest = n->_manifest;
+    if (!manifest.chunked()) {
+        return readStored(conn, n->_mailbox, n->_uid, n->_layout, fileSize, buf, size, offset);
+    }
+    int err = loadManifest(n, conn);
+    if (err) {
+        return err;
+    }
+
+    // a read can straddle chunks, each piece comes from its own message
+    size_t done = 0;
+    while (done < size) {
+        off_t at = offset + done;
+        size_t index = at / manifest._chunkSize;
+        if (index >= manifest._chunks.size()) {
+            break;
+        }
+        off_t within = at % manifest._chunkSize;
+        off_t chunkLength = min(static_cast<off_t>(manifest._chunkSize), fileSize - static_cast<off_t>(index * manifest._chunkSize));
+        size_t length = min(size - done, static_cast<size_t>(chunkLength - within));
+        ssize_t r;
+        if (manifest._chunks[index] == HOLE_UID) {
+            memset(buf + done, 0, length);
+            r = length;
+        }
+        else {
+            r = readStored(conn, FS_CHUNK_MAILBOX, manifest._chunks[index], manifest._layouts[index],
+                           chunkLength, buf + done, length, within);
+        }
+        if (r < 0) {
+            return r;
+        }
+        if (r == 0) {
+            break;
+        }
+        done += r;
     }
-    return 0;
+    return done;
 }
 
-int IMAPFS::unlink(const string& path)
+ssize_t IMAPFS::readStored(unique_ptr<ConnectionT>& conn, const string& mailbox, const string& uid,
+                           BodyLayoutT& layout, off_t storedSize, char* buf, size_t size, off_t offset)
 {
-    LOGFN(LOG, INFO) << "unlink " << path;
-    NodeT* n = findNode(path);
-    if (!n) {
-        LOGFN(LOG, CRIT) << path << " not found";
-        return -ENOENT;
+    CacheKeyT key(mailbox, uidValidity(mailbox), uid);
+    ssize_t cached = _cache.read(key, buf, size, offset);
+    if (cached >= 0) {
+        LOGFN(LOG, DEBUG) << cached << " bytes of " << mailbox << "/" << uid << " from cache";
+        return cached;
     }
-    n->_parent->_sub.erase(*n);
-    shared_ptr<net::folder> fsMailbox = n->_folder;
-    if (n->_uid != "0") {
-        net::messageSet tmpDel = net::messageSet::byUID(net::message::uid(n->_uid));
 
-        fsMailbox->deleteMessages(tmpDel);
-        fsMailbox->expunge();
+    if (!conn) {
+        conn.reset(new ConnectionT(_pool, mailbox));
     }
-   return 0;
-}
-
-int IMAPFS::mkdir(const string& path, mode_t mode)
-{
-    LOGFN(LOG, INFO) << "mkdir path " << path;
-    NodeT* n = findNode(path);
-    if (n) {
-        LOGFN(LOG, CRIT) << "path already exists";
-        return -EEXIST;
+    shared_ptr<net::message> msg = conn->message(mailbox, uid);
+    if (!msg) {
+        LOGFN(LOG, CRIT) << "message " << uid << " is gone";
+        return -EIO;
     }
-    
-    n = findParent(path);
-    if (!n) {
-        LOGFN(LOG, CRIT) << "no parent for " << path;
-        return -ENOENT;
+    if (!key._uidValidity) {
+        key._uidValidity = conn->uidValidity(mailbox);
+        setUIDValidity(mailbox, key._uidValidity);
     }
-    
-    shared_ptr<net::folder> mailbox = createMailboxForPath(path);
-    this->rebuildFolder(n, mailbox);
-  
-    return 0;
-}
-
-int IMAPFS::rmdir(const string& path)
-{
-    LOGFN(LOG, INFO) << "rmdir path " << path;
-    return 0;
+    if (!layout._known) {
+        int err = learnLayout(msg, layout);
+        if (err) {
+            return err;
+        }
+    }
+    if (layout._ranged) {
+        // only pull the encoded bytes covering this read off the server,
+        // widened to whole cache blocks so the next read finds them
+        off_t start = offset;
+        off_t end = offset + size;
+        if (_cache.isOpen()) {
+            start -= start % ContentCacheT::BLOCK_SIZE;
+            end += ContentCacheT::BLOCK_SIZE - 1;
+            end = min(storedSize, end - end % static_cast<off_t>(ContentCacheT::BLOCK_SIZE));
+        }
+        vector<char> block(end - start);
+        ssize_t r = readRange(msg, layout, block.data(), block.size(), start);
+        if (r < 0) {
+            return r;
+        }
+        _cache.write(key, storedSize, block.data(), r, start);
+        ssize_t skip = offset - start;
+        r = (r > skip) ? min(static_cast<ssize_t>(size), r - skip) : 0;
+        memcpy(buf, block.data() + skip, r);
+        return r;
+    }
+
+    shared_ptr<net::folder> folder = conn->folder(mailbox);
+    folder->fetchMessage(msg,
+        net::fetchAttributes(net::fetchAttributes::ENVELOPE | 
+                             net::fetchAttributes::STRUCTURE |
+                             net::fetchAttributes::CONTENT_INFO) );
+    shared_ptr<message> parsed = msg->getParsedMessage();
+    std::vector<shared_ptr<const attachment>> attachments = attachmentHelper::findAttachmentsInMessage(parsed);
+    if (attachments.size() != 1) {
+        LOGFN(LOG, CRIT) << "expected one attachment";
+        return -EIO;
+    }
+    shared_ptr<const attachment> fileAtt = attachments[0];
+    shared_ptr<const contentHandler> data = fileAtt->getData();
+    byteArray whole;
+    utility::outputStreamByteArrayAdapter badapter(whole);
+    data->extract(badapter);
+    if (whole.empty() || static_cast<size_t>(offset) >= whole.size()) {
+        return 0;
+    }
+    _cache.write(key, whole.size(), reinterpret_cast<const char*>(&whole[0]), whole.size(), 0);
+    size = min(size, whole.size() - offset);
+    memcpy(buf, &whole[offset], size);
+    return size;
 }
 
-int IMAPFS::release(const string& path, struct fuse_file_info* fi)
+int IMAPFS::loadManifest(NodeT* n, unique_ptr<ConnectionT>& conn)
 {
-    LOGFN(LOG, INFO) << "release " << path;
-
-    NodeT* n = findNode(path);
-    if (!n) {
-        LOGFN(LOG, CRIT) << path << " not found";
-        return -ENOENT;
+    if (!n->_manifest.chunked() || n->_manifest._loaded) {
+        return 0;
     }
-    if (n->_flags & E_NEEDSYNC) {
-        int err = fsync(path, 1, NULL);
-        if (!err) {
-            n->_flags &= ~E_NEEDSYNC;
+    // the manifest body never changes for a UID either, so it gets cached
+    // just like file contents
+    CacheKeyT key(n->_mailbox, uidValidity(n->_mailbox), n->_uid);
+    string raw;
+    if (!_cache.readAll(key, raw)) {
+        if (!conn) {
+            conn.reset(new ConnectionT(_pool, n->_mailbox));
         }
-        else {
-            return err;
+        shared_ptr<net::message> msg = conn->message(n->_mailbox, n->_uid);
+        if (!msg) {
+            LOGFN(LOG, CRIT) << "manifest " << n->_uid << " is gone";
+            return -EIO;
         }
+        raw.clear();
+        utility::outputStreamStringAdapter os(raw);
+        msg->extract(os, NULL, 0, -1, true);
+        _cache.write(key, raw.size(), raw.data(), raw.size(), 0);
     }
-    n->_contents.resize(0);
-    n->_flags = 0;
+    if (!parseManifest(raw, n->_manifest)) {
+        return -EIO;
+    }
+    LOGFN(LOG, INFO) << "manifest " << n->_uid << " has " << n->_manifest._chunks.size() << " chunks";
     return 0;
 }
 
-int IMAPFS::rename(const std::string& from, const std::string& to)
+int IMAPFS::fillGaps(NodeT* n, off_t start, off_t end)
 {
+    // a piece at a time, the buffer spills big files to disk
+    vector<ExtentMapT::RangeT> gaps = n->_extents.gaps(start, min(end, n->_baseSize));
+    vector<char> piece;
+    for (vector<ExtentMapT::RangeT>::iterator iter = gaps.begin(); iter != gaps.end(); ++iter) {
+        for (off_t at = iter->first; at < iter->second; at += piece.size()) {
+            piece.resize(min(iter->second - at, static_cast<off_t>(LOAD_PIECE)));
+            ssize_t r = readNode(n, piece.data(), piece.size(), at, n->_baseSize);
+            if (r == static_cast<ssize_t>(piece.size())) {
+                r = n->_buffer.pwrite(piece.data(), piece.size(), at);
+            }
+            if (r != static_cast<ssize_t>(piece.size())) {
+                return (r < 0) ? r : -EIO;
+            }
+            n->_extents.add(at, at + piece.size());
+        }
+    }
     return 0;
 }
 
-
-shared_ptr<net::folder> IMAPFS::openMailbox(const string& mailbox)
+void IMAPFS::cacheBuffer(const CacheKeyT& key, const WriteBufferT& buffer, off_t base, off_t size)
 {
-    net::folder::path path = utility::path::fromString(mailbox, "/", vmime::charset::getLocalCharset());
-    
-    string s = trim(mailbox);
-    NodeT* n = _root;
-    if (s != "") {
-        n = findNode(s);
+    if (!_cache.isOpen() || !size) {
+        return;
     }
-    
-    shared_ptr<net::folder> folder = n->_folder;
-    if (!folder) {
-        if (s == "/") {
-            folder = _store->getRootFolder();
+    vector<char> piece(min(size, static_cast<off_t>(LOAD_PIECE)));
+    for (off_t at = 0; at < size; at += piece.size()) {
+        size_t length = min(static_cast<off_t>(piece.size()), size - at);
+        if (buffer.pread(piece.data(), length, base + at) != static_cast<ssize_t>(length)) {
+            return;
         }
-        else {
-            folder = _store->getFolder(path);
-        }
-        if (!folder) {
-            return NULL;
-        }
-        n->_folder = folder;
+        _cache.write(key, size, piece.data(), length, at);
     }
-    
-    return folder;
 }
 
-shared_ptr<net::folder> IMAPFS::createMailboxForPath(const string& path)
+int IMAPFS::write(const string& path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
 {
-    // LAM check to see if "path" exists in _fsMap
-    map<string, shared_ptr<net::folder>>::iterator iter = _fsMap.find(path);
-    if (iter != _fsMap.end()) {
-        LOGFN(LOG, CRIT) << "path " << path << " already exists";
-        return nullptr;
+    shared_ptr<NodeT> n = findNode(path);
+    if (!n) {
+        return -ENOENT;
     }
-    
-    string mboxName = FS_PREFIX + path;
-    replace(mboxName.begin(), mboxName.end(), '/', ':'); 
-    if (mboxName.length() > 250) {
+    return write(n, buf, size, offset, fi);
+}
+
+int IMAPFS::write(shared_ptr<NodeT> n, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    LOGFN(LOG, INFO) << "write " << pathOf(n.get()) << " at " << offset << ", " << size << " bytes";
+
+    lock_guard<mutex> nlock(n->_mutex);
+    
+    // nothing of the old contents is needed here, the extent map remembers
+    // what we do have and the rest gets filled in at sync time
+    off_t oldSize;
+    {
+        ReadLockT lock(_lock);
+        oldSize = n->_stat.st_size;
+    }
+    ssize_t r = n->_buffer.pwrite(buf, size, offset);
+    if (r < 0) {
+        return r;
+    }
+    n->_extents.add(offset, offset + size);
+    off_t newSize = max(oldSize, static_cast<off_t>(offset + size));
+    n->_flags |= E_NEEDSYNC;
+
+    markDirty(n.get(), offset, offset + size, oldSize);
+
+    WriteLockT lock(_lock);
+    n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = newSize;
+    time_t t = Time().now().seconds();
+    n->_stat.st_atim.tv_sec = n->_stat.st_mtim.tv_sec = t;
+    return size;
+}
+
+void IMAPFS::markDirty(NodeT* n, off_t start, off_t end, off_t oldSize)
+{
+    ManifestT& manifest = n->_manifest;
+    if (!manifest.chunked() || start >= end) {
+        return;
+    }
+    // growing the file changes the old last chunk as well
+    off_t newSize = max(oldSize, end);
+    size_t first = start / manifest._chunkSize;
+    if (newSize > oldSize && oldSize) {
+        first = min(first, static_cast<size_t>((oldSize - 1) / manifest._chunkSize));
+    }
+    size_t last = (newSize > oldSize) ? manifest.chunkCount(newSize) - 1 : (end - 1) / manifest._chunkSize;
+    for (size_t i = first; i <= last; ++i) {
+        manifest._dirty.insert(i);
+    }
+}
+
+int IMAPFS::fsync(const string& path, int isdatasync, struct fuse_file_info* fi)
+{
+    shared_ptr<NodeT> n = findNode(path);
+    if (!n) {
+        return -ENOENT;
+    }
+    return fsync(n, isdatasync, fi);
+}
+
+int IMAPFS::fsync(shared_ptr<NodeT> n, int isdatasync, struct fuse_file_info* fi)
+{
+    LOGFN(LOG, INFO) << "sync " << pathOf(n.get());
+    
+    lock_guard<mutex> nlock(n->_mutex);
+    // a barrier: whatever's queued for write-back goes up now, the
+    // worker finds the node clean later
+    int err = syncNode(n.get());
+    if (!err) {
+        _journal.remove(journalName(n.get()));
+    }
+    return err;
+}
+
+shared_ptr<message> IMAPFS::buildMessage(const string& subject)
+{
+    messageBuilder mb;
+    mb.setExpeditor(mailbox(_authuser + "@" + _host));
+    addressList to;
+    to.appendAddress(make_shared<mailbox>(_authuser + "@" + _host));
+    mb.setRecipients(to);
+    mb.setSubject(text(subject));
+    mb.getTextPart()->setText(
+        make_shared<stringContentHandler>(FS_WARN));
+    return mb.construct();
+}
+
+static string appendedUID(const net::messageSet& added)
+{
+    const net::UIDMessageRange tmpr = dynamic_cast<const net::UIDMessageRange&>(added.getRangeAt(0));
+    return string(tmpr.getFirst());
+}
+
+string IMAPFS::fileHeader(const string& subject, uint64_t size, const string& hash)
+{
+    header h;
+    h.getField("From")->setValue(mailbox(_authuser + "@" + _host));
+    addressList to;
+    to.appendAddress(make_shared<mailbox>(_authuser + "@" + _host));
+    h.getField("To")->setValue(to);
+    // the filename we want will get embedded in the subject here
+    h.getField("Subject")->setValue(text(subject));
+    h.getField("Date")->setValue(datetime(Time().now().seconds()));
+    h.getField(FS_BINSIZE_HEADER)->setValue(to_string(size));
+    if (!hash.empty()) {
+        h.getField(FS_CHUNKHASH_HEADER)->setValue(hash);
+    }
+    return h.generate();
+}
+
+string IMAPFS::appendFile(shared_ptr<net::folder> folder, const string& subject, const string& hash,
+                          SourceT source, uint64_t size)
+{
+    MessageStreamT stream(fileHeader(subject, size, hash), FS_WARN, source, size);
+    string uid = appendedUID(folder->addMessage(stream, stream.size()));
+    if (stream.failed()) {
+        LOGFN(LOG, CRIT) << "source failed while appending " << subject << ", dropping " << uid;
+        folder->deleteMessages(net::messageSet::byUID(uid));
+        _expunges.add(net::imap::IMAPUtils::pathToString(_pool.separator(), folder->getFullPath()), uid);
+        return "";
+    }
+    return uid;
+}
+
+vector<string> IMAPFS::appendFiles(ConnectionT& conn, const string& mailbox, const vector<PendingFileT>& files)
+{
+    vector<shared_ptr<MessageStreamT>> streams;
+    vector<AppendT> messages;
+    for (vector<PendingFileT>::const_iterator iter = files.begin(); iter != files.end(); ++iter) {
+        streams.push_back(make_shared<MessageStreamT>(fileHeader(iter->_subject, iter->_size, iter->_hash),
+                                                      FS_WARN, iter->_source, iter->_size));
+        messages.push_back(AppendT(streams.back(), streams.back()->size()));
+    }
+
+    vector<string> uids;
+    int ret = multiAppend(conn.store(), mailbox, messages, uids);
+    if (ret == -ENOTSUP) {
+        // one round trip each then
+        shared_ptr<net::folder> folder = conn.folder(mailbox);
+        for (vector<PendingFileT>::const_iterator iter = files.begin(); iter != files.end(); ++iter) {
+            string uid = appendFile(folder, iter->_subject, iter->_hash, iter->_source, iter->_size);
+            if (uid.empty()) {
+                if (!uids.empty()) {
+                    folder->deleteMessages(net::messageSet::byUID(uids));
+                    _expunges.add(mailbox, uids);
+                }
+                return vector<string>();
+            }
+            uids.push_back(uid);
+        }
+        return uids;
+    }
+    if (ret) {
+        if (!uids.empty()) {
+            // stored with padding in it, and about to be indexed by the
+            // hash of what should have been there
+            conn.folder(mailbox)->deleteMessages(net::messageSet::byUID(uids));
+            _expunges.add(mailbox, uids);
+        }
+        return vector<string>();
+    }
+    for (vector<shared_ptr<MessageStreamT>>::iterator iter = streams.begin(); iter != streams.end(); ++iter) {
+        if ((*iter)->failed()) {
+            LOGFN(LOG, CRIT) << "source failed while appending to " << mailbox << ", dropping the batch";
+            conn.folder(mailbox)->deleteMessages(net::messageSet::byUID(uids));
+            _expunges.add(mailbox, uids);
+            return vector<string>();
+        }
+    }
+    return uids;
+}
+
+shared_ptr<message> IMAPFS::buildManifestMessage(const string& filename, off_t size, const ManifestT& manifest)
+{
+    messageBuilder mb;
+    mb.setExpeditor(mailbox(_authuser + "@" + _host));
+    addressList to;
+    to.appendAddress(make_shared<mailbox>(_authuser + "@" + _host));
+    mb.setRecipients(to);
+    mb.setSubject(text(filename));
+    mb.getTextPart()->setText(
+        make_shared<stringContentHandler>(FS_WARN + "\r\n" + formatManifest(manifest)));
+    shared_ptr<message> msg = mb.construct();
+    shared_ptr<header> header = msg->getHeader();
+    header->getField(FS_BINSIZE_HEADER)->setValue(to_string(size));
+    header->getField(FS_CHUNKSIZE_HEADER)->setValue(to_string(manifest._chunkSize));
+    return msg;
+}
+
+void IMAPFS::dropChunks(ConnectionT& conn, const vector<string>& uids)
+{
+    if (uids.empty()) {
+        return;
+    }
+    shared_ptr<net::folder> chunks = conn.folder(FS_CHUNK_MAILBOX);
+    chunks->deleteMessages(net::messageSet::byUID(uids));
+    _expunges.add(FS_CHUNK_MAILBOX, uids);
+    uint32_t validity = conn.uidValidity(FS_CHUNK_MAILBOX);
+    for (vector<string>::const_iterator iter = uids.begin(); iter != uids.end(); ++iter) {
+        _cache.remove(CacheKeyT(FS_CHUNK_MAILBOX, validity, *iter));
+    }
+}
+
+int IMAPFS::syncNode(NodeT* n)
+{
+    WriteBufferT& buffer = n->_buffer;
+    off_t size;
+    string filename;
+    {
+        ReadLockT lock(_lock);
+        size = n->_stat.st_size;
+        filename = n->_name;
+    }
+    
+    ManifestT& old = n->_manifest;
+    if (old.chunked() && !old._loaded) {
+        unique_ptr<ConnectionT> none;
+        int err = loadManifest(n, none);
+        if (err) {
+            return err;
+        }
+    }
+    bool chunked = size > static_cast<off_t>(CHUNK_SIZE) || (old.chunked() && size > static_cast<off_t>(old._chunkSize));
+
+    // whatever we're about to upload has to be in the buffer first, that
+    // is every dirty chunk, or the whole file if it's one message
+    int err = 0;
+    if (chunked && old.chunked()) {
+        for (set<size_t>::iterator iter = old._dirty.begin(); iter != old._dirty.end() && !err; ++iter) {
+            err = fillGaps(n, *iter * old._chunkSize, (*iter + 1) * old._chunkSize);
+        }
+    }
+    else {
+        err = fillGaps(n, 0, size);
+    }
+    if (!err && buffer.size() < size) {
+        err = buffer.truncate(size);
+    }
+    if (err) {
+        return err;
+    }
+
+    ConnectionT conn(_pool, n->_mailbox);
+    ManifestT next;
+    shared_ptr<message> msg;
+    // keeps the collector off our new chunks until the manifest is stored
+    ChunkPinsT pins(_chunkIndex);
+
+    if (chunked) {
+        // only the chunks written since the last sync go up again, and not
+        // even those if some file already has the same bytes stored
+        next._loaded = true;
+        next._chunkSize = old.chunked() ? old._chunkSize : CHUNK_SIZE;
+        size_t count = next.chunkCount(size);
+        uint32_t validity = conn.uidValidity(FS_CHUNK_MAILBOX);
+        // chunks nobody has stored yet, by hash, and the first one of
+        // each (a file can repeat itself)
+        map<string, string> uploaded;
+        vector<size_t> missing;
+        // one chunk in memory at a time, it has to be hashed before we
+        // know whether to upload it
+        vector<char> piece;
+        for (size_t i = 0; i < count; ++i) {
+            if (old.chunked() && i < old._chunks.size() && !old._dirty.count(i)) {
+                next._chunks.push_back(old._chunks[i]);
+                next._hashes.push_back(i < old._hashes.size() ? old._hashes[i] : "");
+                continue;
+            }
+            off_t at = i * next._chunkSize;
+            size_t length = min(static_cast<off_t>(next._chunkSize), size - at);
+            if (at >= n->_baseSize && !n->_extents.overlaps(at, at + length)) {
+                // never written since the file grew past it, all zeroes
+                next._chunks.push_back(HOLE_UID);
+                next._hashes.push_back("");
+                continue;
+            }
+            piece.resize(length);
+            if (buffer.pread(piece.data(), length, at) != static_cast<ssize_t>(length)) {
+                return -EIO;
+            }
+            string hash = ChunkIndexT::hash(piece.data(), length);
+            string uid = _chunkIndex.find(hash);
+            if (!uid.empty()) {
+                pins.push_back(uid);
+            }
+            else if (uploaded.insert(pair<string, string>(hash, "")).second) {
+                missing.push_back(i);
+            }
+            next._chunks.push_back(uid);
+            next._hashes.push_back(hash);
+        }
+
+        // the new chunks go up a batch per round trip where the server
+        // lets us, they're streamed from the buffer so memory stays flat
+        for (size_t b = 0; b < missing.size(); b += APPEND_BATCH) {
+            vector<PendingFileT> files;
+            for (size_t j = b; j < missing.size() && j < b + APPEND_BATCH; ++j) {
+                off_t at = missing[j] * next._chunkSize;
+                uint64_t length = min(static_cast<off_t>(next._chunkSize), size - at);
+                const string& hash = next._hashes[missing[j]];
+                files.push_back(PendingFileT(hash, hash, buffer.source(at, length), length));
+            }
+            vector<string> uids = appendFiles(conn, FS_CHUNK_MAILBOX, files);
+            if (uids.empty()) {
+                return -EIO;
+            }
+            for (size_t j = 0; j < uids.size(); ++j) {
+                size_t i = missing[b + j];
+                off_t at = i * next._chunkSize;
+                _chunkIndex.add(next._hashes[i], uids[j]);
+                pins.push_back(uids[j]);
+                uploaded[next._hashes[i]] = uids[j];
+                cacheBuffer(CacheKeyT(FS_CHUNK_MAILBOX, validity, uids[j]), buffer, at, files[j]._size);
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (next._chunks[i].empty()) {
+                next._chunks[i] = uploaded[next._hashes[i]];
+            }
+            LOGFN(LOG, DEBUG) << "chunk " << i << " of " << filename << " is " << next._chunks[i];
+            next._layouts.push_back((i < old._chunks.size() && old._chunks[i] == next._chunks[i]) ?
+                                    old._layouts[i] : BodyLayoutT());
+        }
+        LOGFN(LOG, INFO) << filename << ": " << missing.size() << " of " << count << " chunks uploaded";
+        msg = buildManifestMessage(filename, size, next);
+    }
+    
+    shared_ptr<net::folder> fsMailbox = conn.folder(n->_mailbox);
+    string newID;
+    if (msg) {
+        newID = appendedUID(fsMailbox->addMessage(msg));
+    }
+    else {
+        // streamed, so the file is never in memory as base64 or as a literal
+        newID = appendFile(fsMailbox, filename, "", buffer.source(0, size), size);
+        if (newID.empty()) {
+            return -EIO;
+        }
+    }
+    
+    uint32_t validity = conn.uidValidity(n->_mailbox);
+    setUIDValidity(n->_mailbox, validity);
+    if (n->_uid != "0") {
+        net::messageSet tmpDel = net::messageSet::byUID(net::message::uid(n->_uid));
+
+        fsMailbox->deleteMessages(tmpDel);
+        _expunges.add(n->_mailbox, n->_uid);
+        _cache.remove(CacheKeyT(n->_mailbox, validity, n->_uid));
+    }
+    // chunks the old version used may be shared, the collector takes
+    // care of whatever nobody references any more
+    
+    n->_uid = newID;
+    n->_layout = BodyLayoutT();
+    n->_manifest = next;
+    n->_baseSize = size;
+    n->_flags &= ~E_NEEDSYNC;
+    // we just had all of it in hand, the next open shouldn't go back to the server
+    if (next.chunked()) {
+        string raw = msg->generate();
+        _cache.write(CacheKeyT(n->_mailbox, validity, newID), raw.size(), raw.data(), raw.size(), 0);
+    }
+    else {
+        cacheBuffer(CacheKeyT(n->_mailbox, validity, newID), buffer, 0, size);
+    }
+
+    time_t t = Time().now().seconds();
+    WriteLockT lock(_lock);
+    n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = size;
+    n->_stat.st_atim.tv_sec = n->_stat.st_mtim.tv_sec = t;
+    return 0;
+}
+
+int IMAPFS::fallocate(const string& path, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
+{
+    LOGFN(LOG, INFO) << "allocate for " << path << " " << length << " bytes, at " << offset;
+    return 0;
+}
+
+int IMAPFS::truncate(const string& path, off_t size, struct fuse_file_info* fi)
+{
+    shared_ptr<NodeT> n = findNode(path);
+    if (!n) {
+        return -ENOENT;
+    }
+    return truncate(n, size, fi);
+}
+
+int IMAPFS::truncate(shared_ptr<NodeT> n, off_t size, struct fuse_file_info* fi)
+{
+    LOGFN(LOG, INFO) << "truncate " << pathOf(n.get()) << " to " << size << " bytes";
+    
+    lock_guard<mutex> nlock(n->_mutex);
+
+    off_t oldSize;
+    {
+        ReadLockT lock(_lock);
+        if (S_ISDIR(n->_stat.st_mode)) {
+            return -EISDIR;
+        }
+        oldSize = n->_stat.st_size;
+    }
+    if (size == oldSize) {
+        return 0;
+    }
+
+    ManifestT& manifest = n->_manifest;
+    if (size < oldSize) {
+        if (manifest.chunked() && !manifest._loaded) {
+            unique_ptr<ConnectionT> none;
+            int err = loadManifest(n.get(), none);
+            if (err) {
+                return err;
+            }
+        }
+        // what's left of the server copy has to be whole messages, since
+        // reads name the stored size to the content cache; the kept part
+        // of a message we cut into (a chunk at most, unless the file is a
+        // single message) moves to the buffer, the rest is forgotten
+        off_t keep = min(n->_baseSize, size);
+        if (keep < n->_baseSize) {
+            off_t whole = manifest.chunked() ? keep - keep % manifest._chunkSize : 0;
+            int err = fillGaps(n.get(), whole, keep);
+            if (err) {
+                return err;
+            }
+            n->_baseSize = whole;
+        }
+        if (!size) {
+            n->_buffer.clear();
+        }
+        else if (n->_buffer.size() > size) {
+            int err = n->_buffer.truncate(size);
+            if (err) {
+                return err;
+            }
+        }
+        n->_extents.truncate(size);
+
+        if (manifest.chunked()) {
+            // chunks past the end are left out of the next manifest, the
+            // collector frees them once nothing else refers to them
+            size_t count = manifest.chunkCount(size);
+            if (manifest._chunks.size() > count) {
+                manifest._chunks.resize(count);
+            }
+            if (manifest._hashes.size() > count) {
+                manifest._hashes.resize(count);
+            }
+            if (manifest._layouts.size() > count) {
+                manifest._layouts.resize(count);
+            }
+            manifest._dirty.erase(manifest._dirty.lower_bound(count), manifest._dirty.end());
+            if (size % manifest._chunkSize) {
+                manifest._dirty.insert(count - 1);
+            }
+        }
+    }
+    else {
+        // nothing to write, past the old end reads as zeroes and syncNode()
+        // stores whole chunks of it as holes
+        markDirty(n.get(), oldSize, size, oldSize);
+    }
+    n->_flags |= E_NEEDSYNC;
+
+    {
+        WriteLockT lock(_lock);
+        n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = size;
+        time_t t = Time().now().seconds();
+        n->_stat.st_atim.tv_sec = n->_stat.st_mtim.tv_sec = t;
+    }
+    // truncate(2) on a file nobody has open, no release() is coming
+    return fi ? 0 : finishWrites(n);
+}
+
+int IMAPFS::access(const string& path, int mask)
+{
+    LOGFN(LOG, INFO) "access " << path;
+    shared_ptr<NodeT> n = findNode(path);
+    if ((mask & F_OK) && !n) {
+        LOGFN(LOG, INFO) << "file does not exist";
+        return -ENOENT;
+    }
+    return 0;
+}
+
+int IMAPFS::unlink(const string& path)
+{
+    LOGFN(LOG, INFO) << "unlink " << path;
+    shared_ptr<NodeT> n = findNode(path);
+    if (!n) {
+        LOGFN(LOG, CRIT) << path << " not found";
+        return -ENOENT;
+    }
+    lock_guard<mutex> nlock(n->_mutex);
+    discardNode(n.get());
+    WriteLockT lock(_lock);
+    _nodes.erase(n.get());
+    return 0;
+}
+
+void IMAPFS::discardNode(NodeT* n)
+{
+    // nothing left to write back
+    n->_flags &= ~E_NEEDSYNC;
+    n->_buffer.clear();
+    n->_extents.clear();
+    _journal.remove(journalName(n));
+    if (n->_uid != "0") {
+        ConnectionT conn(_pool, n->_mailbox);
+        shared_ptr<net::folder> fsMailbox = conn.folder(n->_mailbox);
+        net::messageSet tmpDel = net::messageSet::byUID(net::message::uid(n->_uid));
+
+        fsMailbox->deleteMessages(tmpDel);
+        _expunges.add(n->_mailbox, n->_uid);
+        _cache.remove(CacheKeyT(n->_mailbox, uidValidity(n->_mailbox), n->_uid));
+        // the chunks may be shared with other files, collectChunks() frees them
+    }
+}
+
+int IMAPFS::mkdir(const string& path, mode_t mode)
+{
+    LOGFN(LOG, INFO) << "mkdir path " << path;
+    {
+        ReadLockT lock(_lock);
+        if (_nodes.find(path)) {
+            LOGFN(LOG, CRIT) << "path already exists";
+            return -EEXIST;
+        }
+        if (!findParent(path)) {
+            LOGFN(LOG, CRIT) << "no parent for " << path;
+            return -ENOENT;
+        }
+    }
+    
+    string mailbox = createMailboxForPath(path);
+    if (mailbox.empty()) {
+        return -EIO;
+    }
+
+    WriteLockT lock(_lock);
+    NodeT* n = findParent(path);
+    if (!n) {
+        return -ENOENT;
+    }
+    this->rebuildFolder(n, mailbox);
+    n = _nodes.find(path);
+    if (n) {
+        n->_mailbox = mailbox;
+    }
+  
+    return 0;
+}
+
+int IMAPFS::rmdir(const string& path)
+{
+    LOGFN(LOG, INFO) << "rmdir path " << path;
+    if (path == "/") {
+        return -EBUSY;
+    }
+    shared_ptr<NodeT> n = findNode(path);
+    if (!n) {
+        return -ENOENT;
+    }
+    {
+        ReadLockT lock(_lock);
+        if (!S_ISDIR(n->_stat.st_mode)) {
+            return -ENOTDIR;
+        }
+    }
+    if (!_treeRemoval) {
+        // only a listing tells us whether there's anything in it
+        int err = loadDirectory(n.get());
+        if (err) {
+            return err;
+        }
+    }
+    {
+        // checked and claimed in one go, so nothing can be created in
+        // there between here and the DELETE that would take it along
+        WriteLockT lock(_lock);
+        if (n->_removing) {
+            return -ENOENT;
+        }
+        if (!_treeRemoval && !n->_children.empty()) {
+            return -ENOTEMPTY;
+        }
+        markRemoving(n.get(), true);
+    }
+    int err = removeTree(n, path);
+    if (err) {
+        WriteLockT lock(_lock);
+        markRemoving(n.get(), false);
+    }
+    return err;
+}
+
+void IMAPFS::markRemoving(NodeT* dir, bool removing)
+{
+    vector<NodeT*> pending(1, dir);
+    while (!pending.empty()) {
+        NodeT* n = pending.back();
+        pending.pop_back();
+        n->_removing = removing;
+        pending.insert(pending.end(), n->_children.begin(), n->_children.end());
+    }
+}
+
+int IMAPFS::removeTree(shared_ptr<NodeT> dir, const string& path)
+{
+    // mailboxes of "path" and everything below it, deepest first, so that
+    // if one can't be deleted the tree still has a place for it
+    vector<pair<string, string>> doomed;
+    vector<shared_ptr<NodeT>> nodes;
+    set<NodeT*> files;
+    {
+        ReadLockT lock(_lock);
+        for (map<string, string>::iterator iter = _fsMap.begin(); iter != _fsMap.end(); ++iter) {
+            if (iter->first == path || iter->first.compare(0, path.length() + 1, path + "/") == 0) {
+                doomed.push_back(*iter);
+            }
+        }
+        vector<NodeT*> pending(1, dir.get());
+        while (!pending.empty()) {
+            NodeT* n = pending.back();
+            pending.pop_back();
+            nodes.push_back(n->shared_from_this());
+            if (S_ISREG(n->_stat.st_mode)) {
+                files.insert(n);
+            }
+            pending.insert(pending.end(), n->_children.begin(), n->_children.end());
+        }
+    }
+    sort(doomed.begin(), doomed.end(), [](const pair<string, string>& a, const pair<string, string>& b) {
+        return a.first.length() > b.first.length();
+    });
+    // whoever is busy with a file in there finishes first; in inode order,
+    // like renameDirectory()
+    sort(nodes.begin(), nodes.end(), [](const shared_ptr<NodeT>& a, const shared_ptr<NodeT>& b) {
+        return a->_ino < b->_ino;
+    });
+    vector<unique_lock<mutex>> locks;
+    for (vector<shared_ptr<NodeT>>::iterator iter = nodes.begin(); iter != nodes.end(); ++iter) {
+        locks.push_back(unique_lock<mutex>((*iter)->_mutex));
+    }
+
+    // DELETE takes every file with it, and the metadata message
+    // createMailboxForPath() planted too, which no amount of unlinking
+    // would; chunks only the deleted manifests used are the collector's
+    size_t deleted = 0;
+    {
+        ConnectionT conn(_pool);
+        shared_ptr<net::imap::IMAPConnection> c = conn.store()->getConnection();
+        for (; deleted < doomed.size(); ++deleted) {
+            if (rawCommand(c, "DELETE " + net::imap::IMAPUtils::quoteString(doomed[deleted].second))) {
+                break;
+            }
+        }
+    }
+    set<string> gone;
+    for (size_t i = 0; i < deleted; ++i) {
+        gone.insert(doomed[i].second);
+        _expunges.forget(doomed[i].second);
+        _pool.forget(doomed[i].second);
+    }
+    for (vector<shared_ptr<NodeT>>::iterator iter = nodes.begin(); iter != nodes.end(); ++iter) {
+        NodeT* n = iter->get();
+        if (files.count(n) && gone.count(n->_mailbox)) {
+            // unsaved writes have nowhere to go any more
+            n->_flags &= ~E_NEEDSYNC;
+            n->_buffer.clear();
+            n->_extents.clear();
+            _journal.remove(journalName(n));
+        }
+    }
+    {
+        WriteLockT lock(_lock);
+        for (size_t i = 0; i < deleted; ++i) {
+            NodeT* n = _nodes.find(doomed[i].first);
+            if (n) {
+                _nodes.erase(n);
+            }
+            _fsMap.erase(doomed[i].first);
+            _syncState.erase(doomed[i].second);
+        }
+    }
+    {
+        lock_guard<mutex> lock(_collectorMutex);
+        if (gone.count(_watched)) {
+            _watched.clear();
+        }
+    }
+    LOGFN(LOG, INFO) << "deleted " << deleted << " of " << doomed.size() << " mailboxes under " << path;
+    return deleted == doomed.size() ? 0 : -EIO;
+}
+
+int IMAPFS::release(const string& path, struct fuse_file_info* fi)
+{
+    shared_ptr<NodeT> n = findNode(path);
+    if (!n) {
+        LOGFN(LOG, CRIT) << path << " not found";
+        return -ENOENT;
+    }
+    return release(n, fi);
+}
+
+int IMAPFS::release(shared_ptr<NodeT> n, struct fuse_file_info* fi)
+{
+    LOGFN(LOG, INFO) << "release " << pathOf(n.get());
+
+    lock_guard<mutex> nlock(n->_mutex);
+    // the next open starts its own run of reads
+    n->_readAhead = ReadAheadT();
+    return finishWrites(n);
+}
+
+int IMAPFS::finishWrites(shared_ptr<NodeT> n)
+{
+    if (n->_flags & E_NEEDSYNC) {
+        if (_writeback.running() && _journal.isOpen()) {
+            // once the writes are safely on local disk, close() is done;
+            // the upload happens in the background
+            string path;
+            off_t size;
+            {
+                ReadLockT lock(_lock);
+                path = n->_path;
+                size = n->_stat.st_size;
+            }
+            if (!_journal.save(journalName(n.get()), path, n->_uid, size, n->_baseSize, n->_extents, n->_buffer)) {
+                _writeback.enqueue(n);
+                return 0;
+            }
+            LOGFN(LOG, CRIT) << "can't journal " << path << ", uploading now";
+        }
+        int err = syncNode(n.get());
+        if (err) {
+            return err;
+        }
+    }
+    n->_buffer.clear();
+    n->_extents.clear();
+    n->_flags = 0;
+    return 0;
+}
+
+bool IMAPFS::writeBack(shared_ptr<NodeT> n)
+{
+    lock_guard<mutex> nlock(n->_mutex);
+    if (n->_flags & E_NEEDSYNC) {
+        LOGFN(LOG, INFO) << "writing back " << n->_path;
+        int err = syncNode(n.get());
+        if (err) {
+            LOGFN(LOG, CRIT) << "write-back of " << n->_path << " failed: " << err;
+            return false;
+        }
+    }
+    _journal.remove(journalName(n.get()));
+    // clean now, reads go to the cache like for any other file
+    n->_buffer.clear();
+    n->_extents.clear();
+    return true;
+}
+
+string IMAPFS::journalName(NodeT* n)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(n->_ino));
+    return name;
+}
+
+bool IMAPFS::openJournal(const string& dir)
+{
+    return _journal.open(dir);
+}
+
+void IMAPFS::startPrefetch(uint64_t budget, uint64_t rate)
+{
+    // there's nowhere to prefetch into without the cache
+    if (!budget || !_cache.isOpen()) {
+        return;
+    }
+    _prefetcher.start(PREFETCH_THREADS, budget, rate);
+}
+
+void IMAPFS::noteListing(NodeT* dir)
+{
+    {
+        lock_guard<mutex> lock(_collectorMutex);
+        _watched = dir->_mailbox;
+    }
+    if (!_prefetcher.running()) {
+        return;
+    }
+    lock_guard<mutex> lock(_scanMutex);
+    if (_scans.size() >= MAX_SCANS) {
+        _scans.clear();
+    }
+    _scans[dir->_ino] = ScanT();
+}
+
+void IMAPFS::noteOpen(NodeT* n)
+{
+    if (!_prefetcher.running()) {
+        return;
+    }
+    string mailbox;
+    vector<pair<string, off_t>> files;
+    uint64_t bytes = 0;
+    {
+        ReadLockT lock(_lock);
+        NodeT* p = n->_parent;
+        if (!p) {
+            return;
+        }
+        lock_guard<mutex> slock(_scanMutex);
+        map<ino_t, ScanT>::iterator iter = _scans.find(p->_ino);
+        if (iter == _scans.end()) {
+            return;
+        }
+        ScanT& scan = iter->second;
+        size_t at = InodeTableT::slot(n);
+        if (scan._last == SIZE_MAX || (at > scan._last && at <= scan._last + SCAN_SLACK)) {
+            ++scan._streak;
+        }
+        else {
+            scan._streak = 0;
+        }
+        scan._last = at;
+        if (scan._streak < SCAN_STREAK) {
+            return;
+        }
+        size_t end = min(p->_children.size(), at + 1 + PREFETCH_FILES);
+        for (size_t i = max(at + 1, scan._ahead); i < end; ++i) {
+            NodeT* c = p->_children[i];
+            // single message files the server has a current copy of
+            if (!S_ISREG(c->_stat.st_mode) || c->_uid == "0" || (c->_flags & E_NEEDSYNC) ||
+                c->_manifest.chunked() || c->_baseSize <= 0 || c->_baseSize > PREFETCH_MAX_FILE) {
+                continue;
+            }
+            files.push_back(pair<string, off_t>(c->_uid, c->_baseSize));
+            bytes += c->_baseSize;
+        }
+        scan._ahead = max(scan._ahead, end);
+        mailbox = p->_mailbox;
+    }
+    if (files.empty()) {
+        return;
+    }
+    if (!_prefetcher.enqueue(bytes, [this, mailbox, files]() { prefetchFiles(mailbox, files); })) {
+        LOGFN(LOG, DEBUG) << "prefetch budget used up, not fetching " << files.size() << " files ahead";
+    }
+}
+
+void IMAPFS::prefetchFiles(const string& mailbox, const vector<pair<string, off_t>>& files)
+{
+    ConnectionT conn(_pool, mailbox);
+    uint32_t validity = conn.uidValidity(mailbox);
+    map<string, off_t> sizes;
+    vector<string> uids;
+    for (vector<pair<string, off_t>>::const_iterator iter = files.begin(); iter != files.end(); ++iter) {
+        // a file somebody already read (or we already fetched) is cached
+        char probe;
+        if (_cache.read(CacheKeyT(mailbox, validity, iter->first), &probe, 1, 0) >= 0) {
+            continue;
+        }
+        sizes[iter->first] = iter->second;
+        uids.push_back(iter->first);
+    }
+    if (uids.empty()) {
+        return;
+    }
+    // one UID FETCH for all their structures, then the bodies one by one
+    vector<shared_ptr<net::message>> messages =
+        conn.folder(mailbox)->getAndFetchMessages(net::messageSet::byUID(uids),
+                                                  net::fetchAttributes(net::fetchAttributes::STRUCTURE |
+                                                                       net::fetchAttributes::UID));
+    vector<char> piece;
+    for (vector<shared_ptr<net::message>>::iterator iter = messages.begin(); iter != messages.end(); ++iter) {
+        string uid = (*iter)->getUID();
+        off_t size = sizes[uid];
+        BodyLayoutT layout;
+        if (!size || learnLayout(*iter, layout) || !layout._ranged) {
+            continue;
+        }
+        CacheKeyT key(mailbox, validity, uid);
+        for (off_t at = 0; at < size; ) {
+            piece.resize(min(size - at, static_cast<off_t>(LOAD_PIECE)));
+            ssize_t r = readRange(*iter, layout, piece.data(), piece.size(), at);
+            if (r <= 0) {
+                break;
+            }
+            _cache.write(key, size, piece.data(), r, at);
+            at += r;
+        }
+        LOGFN(LOG, DEBUG) << "prefetched " << mailbox << "/" << uid;
+    }
+}
+
+void IMAPFS::readAhead(NodeT* n, off_t start, off_t end)
+{
+    // with local changes around, reads mostly come from the buffer anyway
+    if (n->_uid == "0" || !n->_extents.empty()) {
+        return;
+    }
+    vector<StoredRangeT> ranges;
+    const ManifestT& manifest = n->_manifest;
+    if (!manifest.chunked()) {
+        StoredRangeT r = { n->_mailbox, n->_uid, n->_layout, n->_baseSize, start, end - start };
+        ranges.push_back(r);
+    }
+    else if (manifest._loaded) {
+        for (off_t at = start; at < end; ) {
+            size_t index = at / manifest._chunkSize;
+            if (index >= manifest._chunks.size()) {
+                break;
+            }
+            off_t chunkStart = index * manifest._chunkSize;
+            off_t chunkLength = min(static_cast<off_t>(manifest._chunkSize), n->_baseSize - chunkStart);
+            off_t length = min(end, chunkStart + chunkLength) - at;
+            if (manifest._chunks[index] != HOLE_UID) {
+                StoredRangeT r = { FS_CHUNK_MAILBOX, manifest._chunks[index], manifest._layouts[index],
+                                   chunkLength, at - chunkStart, length };
+                ranges.push_back(r);
+            }
+            at += length;
+        }
+    }
+    if (ranges.empty()) {
+        return;
+    }
+    if (!_prefetcher.enqueue(end - start, [this, ranges]() { prefetchRanges(ranges); })) {
+        LOGFN(LOG, DEBUG) << "prefetch budget used up, not reading ahead of " << n->_uid;
+    }
+}
+
+void IMAPFS::prefetchRanges(const vector<StoredRangeT>& ranges)
+{
+    unique_ptr<ConnectionT> conn;
+    vector<char> piece;
+    for (vector<StoredRangeT>::const_iterator iter = ranges.begin(); iter != ranges.end(); ++iter) {
+        // a copy, readStored() fills it in and we have nowhere to keep it
+        BodyLayoutT layout = iter->_layout;
+        for (off_t at = iter->_offset; at < iter->_offset + iter->_length; ) {
+            piece.resize(min(iter->_offset + iter->_length - at, static_cast<off_t>(LOAD_PIECE)));
+            // the data isn't wanted here, readStored() leaves it in the cache
+            ssize_t r = readStored(conn, iter->_mailbox, iter->_uid, layout, iter->_storedSize,
+                                   piece.data(), piece.size(), at);
+            if (r <= 0) {
+                break;
+            }
+            at += r;
+        }
+    }
+}
+
+void IMAPFS::startWriteback(size_t threads)
+{
+    if (!threads) {
+        return;
+    }
+    _writeback.start(threads, [this](shared_ptr<NodeT> n) { return writeBack(n); });
+}
+
+int IMAPFS::replayJournal()
+{
+    vector<JournalEntryT> entries = _journal.entries();
+    for (vector<JournalEntryT>::iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+        JournalEntryT& e = *iter;
+        LOGFN(LOG, INFO) << "replaying journal entry for " << e._path;
+        shared_ptr<NodeT> p = findNode(parentPath(e._path));
+        if (!p) {
+            // leave the entry where it is, somebody may want the data
+            LOGFN(LOG, CRIT) << "no directory for " << e._path << " any more, not replaying";
+            continue;
+        }
+        int err = loadDirectory(p.get());
+        if (err) {
+            return err;
+        }
+        shared_ptr<NodeT> n = findNode(e._path);
+        if (!n) {
+            mknod(e._path, S_IFREG | 0644, getuid(), getgid());
+            n = findNode(e._path);
+            if (!n) {
+                continue;
+            }
+        }
+
+        lock_guard<mutex> nlock(n->_mutex);
+        off_t oldSize;
+        {
+            ReadLockT lock(_lock);
+            oldSize = n->_stat.st_size;
+        }
+        if (n->_uid != e._uid) {
+            LOGFN(LOG, CRIT) << e._path << " changed on the server since, our writes go on top";
+        }
+        else {
+            n->_baseSize = e._baseSize;
+        }
+        n->_baseSize = min(n->_baseSize, e._size);
+        err = _journal.load(e, n->_buffer, n->_extents);
+        if (err) {
+            LOGFN(LOG, CRIT) << "can't read journal entry for " << e._path;
+            n->_buffer.clear();
+            n->_extents.clear();
+            continue;
+        }
+        for (vector<ExtentMapT::RangeT>::iterator r = e._ranges.begin(); r != e._ranges.end(); ++r) {
+            markDirty(n.get(), r->first, r->second, oldSize);
+        }
+        markDirty(n.get(), min(oldSize, e._size), max(oldSize, e._size), oldSize);
+        n->_flags |= E_NEEDSYNC;
+        {
+            WriteLockT lock(_lock);
+            n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = e._size;
+        }
+
+        // the entry's name came from an inode number of the last mount
+        string name = journalName(n.get());
+        if (name != e._name && !_journal.save(name, e._path, n->_uid, e._size, n->_baseSize, n->_extents, n->_buffer)) {
+            _journal.remove(e._name);
+        }
+        if (_writeback.running()) {
+            _writeback.enqueue(n);
+        }
+        else if (!syncNode(n.get())) {
+            _journal.remove(name);
+        }
+    }
+    return 0;
+}
+
+int IMAPFS::rename(const string& from, const string& to)
+{
+    LOGFN(LOG, INFO) << "rename " << from << " to " << to;
+    if (from == to) {
+        return 0;
+    }
+    shared_ptr<NodeT> n = findNode(from);
+    if (!n) {
+        return -ENOENT;
+    }
+    shared_ptr<NodeT> target = findNode(to);
+    bool dir;
+    bool targetDir;
+    {
+        // _stat is only ever written under the write lock
+        ReadLockT lock(_lock);
+        dir = S_ISDIR(n->_stat.st_mode);
+        targetDir = target && S_ISDIR(target->_stat.st_mode);
+    }
+    if (dir) {
+        return renameDirectory(n, from, to);
+    }
+    if (targetDir) {
+        return -EISDIR;
+    }
+    return renameFile(n, target, to);
+}
+
+int IMAPFS::renameFile(shared_ptr<NodeT> node, shared_ptr<NodeT> target, const string& to)
+{
+    NodeT* n = node.get();
+    string name = leafName(to);
+    // both held throughout, so nobody sees the file at both names or the
+    // target half replaced; in whichever order a rename the other way
+    // takes them
+    unique_lock<mutex> nlock(n->_mutex, defer_lock);
+    unique_lock<mutex> tlock;
+    if (target && target != node) {
+        tlock = unique_lock<mutex>(target->_mutex, defer_lock);
+        std::lock(nlock, tlock);
+    }
+    else {
+        target.reset();
+        nlock.lock();
+    }
+    string mailbox;
+    {
+        ReadLockT lock(_lock);
+        NodeT* p = findParent(to);
+        if (!p) {
+            return -ENOENT;
+        }
+        mailbox = p->_mailbox;
+    }
+
+    if ((n->_flags & E_NEEDSYNC) && n->_uid != "0" && mailbox != n->_mailbox) {
+        // unsaved writes go on top of the stored copy, which has to be
+        // in the mailbox the new one goes to; write them back first
+        int err = syncNode(n);
+        if (err) {
+            return err;
+        }
+        _journal.remove(journalName(n));
+    }
+    if (n->_uid == "0" || (n->_flags & E_NEEDSYNC)) {
+        // the next upload stores it under the new name, and drops the
+        // old copy from what is still the same mailbox
+        n->_mailbox = mailbox;
+    }
+    else {
+        int err = copyStored(n, n, mailbox, name, true);
+        if (err) {
+            return err;
+        }
+    }
+
+    // whatever was at "to" is replaced, now that the new copy is stored
+    if (target) {
+        discardNode(target.get());
+    }
+    shared_ptr<NodeT> raced;
+    {
+        WriteLockT lock(_lock);
+        NodeT* p = findParent(to);
+        if (!p) {
+            // the stored copy has the new name already, whatever lists
+            // the directory next picks it up
+            LOGFN(LOG, CRIT) << "lost the directory of " << to;
+            return -ENOENT;
+        }
+        NodeT* existing = _nodes.child(p, name);
+        if (existing && existing != n) {
+            if (existing != target.get()) {
+                // created while we were busy, it's replaced all the same
+                raced = existing->shared_from_this();
+            }
+            _nodes.erase(existing);
+        }
+        _nodes.move(n, p, name);
+        n->_stat.st_ctim.tv_sec = Time().now().seconds();
+    }
+    rejournal(n);
+    nlock.unlock();
+    if (tlock) {
+        tlock.unlock();
+    }
+    if (raced) {
+        lock_guard<mutex> rlock(raced->_mutex);
+        discardNode(raced.get());
+    }
+    return 0;
+}
+
+int IMAPFS::copyStored(NodeT* from, NodeT* to, const string& mailbox, const string& name, bool move)
+{
+    off_t size = from->_baseSize;
+    unique_ptr<ConnectionT> conn;
+    int err = loadManifest(from, conn);
+    if (err) {
+        return err;
+    }
+    if (!conn) {
+        conn.reset(new ConnectionT(_pool, from->_mailbox));
+    }
+    uint32_t validity = conn->uidValidity(from->_mailbox);
+    vector<string> uids(1, from->_uid);
+    vector<string> copied;
+    string newID;
+    ManifestT next = from->_manifest;
+    BodyLayoutT layout;
+    // the chunks are referenced from two manifests, or from one that's on
+    // its way between mailboxes, until we're done
+    ChunkPinsT pins(_chunkIndex);
+    if (next.chunked()) {
+        _chunkIndex.pin(next._chunks);
+        for (vector<string>::iterator iter = next._chunks.begin(); iter != next._chunks.end(); ++iter) {
+            pins.push_back(*iter);
+        }
+    }
+
+    if (name == from->_name) {
+        // only the directory differs, the message itself can go there
+        bool moved = false;
+        err = move ? uidMove(conn->store(), from->_mailbox, uids, mailbox, copied, moved) :
+            uidCopy(conn->store(), from->_mailbox, uids, mailbox, copied);
+        if (err) {
+            return err == -ENOTSUP ? -EXDEV : err;
+        }
+        if (move && !moved) {
+            _expunges.add(from->_mailbox, from->_uid);
+        }
+        newID = copied[0];
+        layout = from->_layout;
+    }
+    else {
+        // the name is in the headers, so a new name is a new message; but
+        // a manifest will do, the data stays in the chunks it's in or, for
+        // a file stored as one message, in a copy of that as its only chunk
+        if (!next.chunked()) {
+            next = ManifestT();
+            next._loaded = true;
+            next._chunkSize = max(CHUNK_SIZE, static_cast<size_t>(size));
+            if (size > 0) {
+                err = uidCopy(conn->store(), from->_mailbox, uids, FS_CHUNK_MAILBOX, copied);
+                if (err) {
+                    return err == -ENOTSUP ? -EXDEV : err;
+                }
+                _chunkIndex.add("", copied[0]);
+                pins.push_back(copied[0]);
+                next._chunks.push_back(copied[0]);
+                next._hashes.push_back("");
+                // same bytes, same layout
+                next._layouts.push_back(from->_layout);
+            }
+        }
+        shared_ptr<message> msg = buildManifestMessage(name, size, next);
+        newID = appendedUID(conn->folder(mailbox)->addMessage(msg));
+        string raw = msg->generate();
+        _cache.write(CacheKeyT(mailbox, conn->uidValidity(mailbox), newID), raw.size(), raw.data(), raw.size(), 0);
+        if (move) {
+            // only now that the new one is stored
+            conn->folder(from->_mailbox)->deleteMessages(net::messageSet::byUID(net::message::uid(from->_uid)));
+            _expunges.add(from->_mailbox, from->_uid);
+        }
+    }
+    setUIDValidity(mailbox, conn->uidValidity(mailbox));
+    if (move) {
+        _cache.remove(CacheKeyT(from->_mailbox, validity, from->_uid));
+    }
+    LOGFN(LOG, INFO) << from->_path << (move ? " is now " : " copied to ") << newID << " in " << mailbox;
+    to->_uid = newID;
+    to->_mailbox = mailbox;
+    to->_manifest = next;
+    to->_layout = layout;
+    to->_baseSize = size;
+    return 0;
+}
+
+int IMAPFS::renameDirectory(shared_ptr<NodeT> dir, const string& from, const string& to)
+{
+    if (from == "/") {
+        return -EBUSY;
+    }
+    if (to.compare(0, from.length() + 1, from + "/") == 0) {
+        return -EINVAL;
+    }
+    // "from" and every directory below it: paths and mailboxes, old and new
+    vector<string> oldPaths, newPaths, oldNames, newNames;
+    vector<shared_ptr<NodeT>> nodes;
+    {
+        ReadLockT lock(_lock);
+        NodeT* existing = _nodes.find(to);
+        if (existing) {
+            // not even an empty directory gets replaced
+            return S_ISDIR(existing->_stat.st_mode) ? -ENOTEMPTY : -ENOTDIR;
+        }
+        if (!findParent(to)) {
+            return -ENOENT;
+        }
+        for (map<string, string>::iterator iter = _fsMap.begin(); iter != _fsMap.end(); ++iter) {
+            if (iter->first != from && iter->first.compare(0, from.length() + 1, from + "/") != 0) {
+                continue;
+            }
+            string path = to + iter->first.substr(from.length());
+            string name = mailboxForPath(path);
+            if (name.length() > 250) {
+                LOGFN(LOG, CRIT) << "mailbox name length too long: " << path;
+                return -ENAMETOOLONG;
+            }
+            oldPaths.push_back(iter->first);
+            newPaths.push_back(path);
+            oldNames.push_back(iter->second);
+            newNames.push_back(name);
+        }
+        vector<NodeT*> pending(1, dir.get());
+        while (!pending.empty()) {
+            NodeT* n = pending.back();
+            pending.pop_back();
+            nodes.push_back(n->shared_from_this());
+            pending.insert(pending.end(), n->_children.begin(), n->_children.end());
+        }
+    }
+
+    // nobody gets to use a mailbox while it's being renamed, in inode
+    // order so two renames can't deadlock
+    sort(nodes.begin(), nodes.end(), [](const shared_ptr<NodeT>& a, const shared_ptr<NodeT>& b) {
+        return a->_ino < b->_ino;
+    });
+    vector<unique_lock<mutex>> locks;
+    for (vector<shared_ptr<NodeT>>::iterator iter = nodes.begin(); iter != nodes.end(); ++iter) {
+        locks.push_back(unique_lock<mutex>((*iter)->_mutex));
+    }
+
+    // names are flat, every level has a mailbox of its own to rename; the
+    // messages stay put, UIDs and all
+    {
+        ConnectionT conn(_pool);
+        shared_ptr<net::imap::IMAPConnection> c = conn.store()->getConnection();
+        size_t done = 0;
+        for (; done < oldNames.size(); ++done) {
+            if (rawCommand(c, "RENAME " + net::imap::IMAPUtils::quoteString(oldNames[done]) + " " +
+                           net::imap::IMAPUtils::quoteString(newNames[done]))) {
+                break;
+            }
+        }
+        if (done < oldNames.size()) {
+            // put back the ones that did move, so the tree still matches
+            while (done-- > 0) {
+                rawCommand(c, "RENAME " + net::imap::IMAPUtils::quoteString(newNames[done]) + " " +
+                           net::imap::IMAPUtils::quoteString(oldNames[done]));
+            }
+            return -EIO;
+        }
+    }
+
+    map<string, string> renamed;
+    for (size_t i = 0; i < oldNames.size(); ++i) {
+        renamed[oldNames[i]] = newNames[i];
+        _pool.forget(oldNames[i]);
+        _expunges.rename(oldNames[i], newNames[i]);
+    }
+    {
+        WriteLockT lock(_lock);
+        for (size_t i = 0; i < oldNames.size(); ++i) {
+            _fsMap.erase(oldPaths[i]);
+            _fsMap[newPaths[i]] = newNames[i];
+            // servers keep UIDVALIDITY across a RENAME; one that doesn't
+            // gets the directory reloaded by the next listing
+            map<string, SyncStateT>::iterator state = _syncState.find(oldNames[i]);
+            if (state != _syncState.end()) {
+                _syncState[newNames[i]] = state->second;
+                _syncState.erase(state);
+            }
+        }
+        NodeT* p = findParent(to);
+        if (!p) {
+            LOGFN(LOG, CRIT) << "parent of " << to << " went away, the tree is out of date";
+            return -ENOENT;
+        }
+        _nodes.move(dir.get(), p, leafName(to));
+        for (vector<shared_ptr<NodeT>>::iterator iter = nodes.begin(); iter != nodes.end(); ++iter) {
+            map<string, string>::iterator name = renamed.find((*iter)->_mailbox);
+            if (name != renamed.end()) {
+                (*iter)->_mailbox = name->second;
+            }
+        }
+    }
+    {
+        lock_guard<mutex> lock(_collectorMutex);
+        map<string, string>::iterator name = renamed.find(_watched);
+        if (name != renamed.end()) {
+            _watched = name->second;
+        }
+    }
+    for (vector<shared_ptr<NodeT>>::iterator iter = nodes.begin(); iter != nodes.end(); ++iter) {
+        rejournal(iter->get());
+    }
+    LOGFN(LOG, INFO) << "renamed " << oldNames.size() << " mailboxes for " << to;
+    return 0;
+}
+
+void IMAPFS::rejournal(NodeT* n)
+{
+    if (!(n->_flags & E_NEEDSYNC) || !_writeback.running() || !_journal.isOpen()) {
+        return;
+    }
+    string path;
+    off_t size;
+    {
+        ReadLockT lock(_lock);
+        path = n->_path;
+        size = n->_stat.st_size;
+    }
+    _journal.save(journalName(n), path, n->_uid, size, n->_baseSize, n->_extents, n->_buffer);
+}
+
+int IMAPFS::setxattr(const string& path, const string& name, const string& value)
+{
+    shared_ptr<NodeT> n = findNode(path);
+    if (!n) {
+        return -ENOENT;
+    }
+    return setxattr(n, name, value);
+}
+
+int IMAPFS::setxattr(shared_ptr<NodeT> n, const string& name, const string& value)
+{
+    if (name != COPY_XATTR) {
+        // nothing else is stored anywhere
+        return -ENOTSUP;
+    }
+    shared_ptr<NodeT> src = findNode(value);
+    if (!src) {
+        return -ENOENT;
+    }
+    ssize_t r = copyFile(src, n, SIZE_MAX);
+    if (r == -EOPNOTSUPP) {
+        // "n" isn't empty
+        return -EINVAL;
+    }
+    return r < 0 ? r : 0;
+}
+
+ssize_t IMAPFS::copyFileRange(const string& from, off_t offsetIn, const string& to, off_t offsetOut, size_t size)
+{
+    shared_ptr<NodeT> src = findNode(from);
+    shared_ptr<NodeT> dst = findNode(to);
+    if (!src || !dst) {
+        return -ENOENT;
+    }
+    return copyFileRange(src, offsetIn, dst, offsetOut, size);
+}
+
+ssize_t IMAPFS::copyFileRange(shared_ptr<NodeT> src, off_t offsetIn, shared_ptr<NodeT> dst, off_t offsetOut,
+                              size_t size)
+{
+    LOGFN(LOG, INFO) << "copy " << size << " bytes from " << pathOf(src.get()) << " at " << offsetIn
+                     << " to " << pathOf(dst.get()) << " at " << offsetOut;
+    off_t length;
+    {
+        ReadLockT lock(_lock);
+        length = src->_stat.st_size;
+    }
+    if (offsetIn >= length) {
+        // cp asks once more past the end, after the whole file went over
+        return 0;
+    }
+    // cp hands us the whole file at once, into a file it just created
+    if (offsetIn != 0 || offsetOut != 0) {
+        return -EOPNOTSUPP;
+    }
+    return copyFile(src, dst, size);
+}
+
+ssize_t IMAPFS::copyFile(shared_ptr<NodeT> src, shared_ptr<NodeT> dst, size_t size)
+{
+    LOGFN(LOG, INFO) << "copy " << pathOf(src.get()) << " to " << pathOf(dst.get());
+    if (src == dst) {
+        return -EINVAL;
+    }
+    // both at once, whichever order somebody copying the other way takes them
+    std::lock(src->_mutex, dst->_mutex);
+    lock_guard<mutex> slock(src->_mutex, adopt_lock);
+    lock_guard<mutex> dlock(dst->_mutex, adopt_lock);
+    off_t length;
+    off_t existing;
+    string name;
+    string mailbox;
+    {
+        ReadLockT lock(_lock);
+        if (!S_ISREG(src->_stat.st_mode) || !S_ISREG(dst->_stat.st_mode)) {
+            return -EINVAL;
+        }
+        length = src->_stat.st_size;
+        existing = dst->_stat.st_size;
+        name = dst->_name;
+        mailbox = dst->_mailbox;
+    }
+    // only into a file just created for it, nothing gets merged
+    if (existing != 0 || static_cast<size_t>(length) > size) {
+        return -EOPNOTSUPP;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    if (src->_flags & E_NEEDSYNC) {
+        // what gets copied is what's stored, so store it first
+        int err = syncNode(src.get());
+        if (err) {
+            return err;
+        }
+        _journal.remove(journalName(src.get()));
+    }
+
+    // an empty file already stored under the name gets replaced
+    string old = dst->_uid;
+    string oldMailbox = dst->_mailbox;
+    int err = copyStored(src.get(), dst.get(), mailbox, name, false);
+    if (err) {
+        return err;
+    }
+    if (old != "0") {
+        ConnectionT conn(_pool, oldMailbox);
+        conn.folder(oldMailbox)->deleteMessages(net::messageSet::byUID(net::message::uid(old)));
+        _expunges.add(oldMailbox, old);
+    }
+    dst->_flags &= ~E_NEEDSYNC;
+    dst->_buffer.clear();
+    dst->_extents.clear();
+    _journal.remove(journalName(dst.get()));
+
+    time_t t = Time().now().seconds();
+    WriteLockT lock(_lock);
+    dst->_stat.st_size = dst->_stat.st_blksize = dst->_stat.st_blocks = length;
+    dst->_stat.st_mtim.tv_sec = dst->_stat.st_ctim.tv_sec = t;
+    return length;
+}
+
+string IMAPFS::createMailboxForPath(const string& path)
+{
+    // LAM check to see if "path" exists in _fsMap
+    {
+        ReadLockT lock(_lock);
+        map<string, string>::iterator iter = _fsMap.find(path);
+        if (iter != _fsMap.end()) {
+            LOGFN(LOG, CRIT) << "path " << path << " already exists";
+            return "";
+        }
+    }
+    
+    string mboxName = mailboxForPath(path);
+    if (mboxName.length() > 250) {
         LOGFN(LOG, CRIT) << "mailbox name length too long: " << path;
-        return nullptr;
+        return "";
     }
     
     // mboxName will be a top-level mailbox, with a name that encodes the
-    // path seperator as ':' instead of '/', mpath here is just a different
-    // type to satisfy the nutty VMIME API that overly complicates things
-    // by using it's own types everywhere
-    net::folder::path mpath = net::imap::IMAPUtils::stringToPath(_seperator, mboxName);
-    shared_ptr<net::folder> fsMailbox = _store->getFolder(mpath);
+    // path seperator as ':' instead of '/'
+    ConnectionT conn(_pool, mboxName);
+    shared_ptr<net::folder> fsMailbox = conn.folder(mboxName, false);
     net::folderAttributes attr;
     attr.setType(net::folderAttributes::TYPE_CONTAINS_MESSAGES);
     fsMailbox->create(attr);
-    fsMailbox->open(net::folder::MODE_READ_WRITE);
-    messageBuilder mb;
-    mb.setExpeditor(mailbox(_authuser + "@" + _host));
-    addressList to;
-    to.appendAddress(make_shared<mailbox>(_authuser + "@" + _host));
-    mb.setRecipients(to);
-    mb.setSubject(text(path));
-    mb.getTextPart()->setText(
-        make_shared<stringContentHandler>(FS_WARN));
-    shared_ptr<message> msg = mb.construct();
-    fsMailbox->addMessage(msg);
-    _fsMap.insert(pair<string, shared_ptr<net::folder>>(mboxName, fsMailbox));
-    return fsMailbox;
+    conn.folder(mboxName)->addMessage(buildMessage(path));
+
+    WriteLockT lock(_lock);
+    _fsMap.insert(pair<string, string>(path, mboxName));
+    return mboxName;
 }
 
-int IMAPFS::parseFilesystem()
+bool IMAPFS::openCache(const string& dir, uint64_t capacity)
+{
+    LOGFN(LOG, INFO) << "content cache in " << dir << ", " << capacity << " bytes";
+    // keep spilled writes next to the cache rather than in a small /tmp
+    WriteBufferT::setSpillDirectory(dir);
+    return _cache.open(dir, capacity);
+}
+
+void IMAPFS::resetRoot()
 {
+    WriteLockT lock(_lock);
     _fsMap.clear();
-    
-    if (_root) {
-        delete _root;
-    }
-    _root = new NodeT("/");
-    _root->_stat.st_nlink = 2;
-    _root->_stat.st_mode = S_IFDIR | 0755;
-    _root->_stat.st_uid = getuid();
-    _root->_stat.st_gid = getgid();
-    _root->_stat.st_size = _root->_stat.st_blksize = _root->_stat.st_blocks = 4096;
-    _root->_parent = NULL;
-
-    shared_ptr<net::folder> root = _store->getRootFolder();
+
+    NodeT* r = _nodes.setRoot("/");
+    r->_stat.st_nlink = 2;
+    r->_stat.st_mode = S_IFDIR | 0755;
+    r->_stat.st_uid = getuid();
+    r->_stat.st_gid = getgid();
+    r->_stat.st_size = r->_stat.st_blksize = r->_stat.st_blocks = 4096;
+}
+
+string IMAPFS::probeMailbox(ConnectionT& conn, const string& mailbox)
+{
+    // a folder object of our own, opened read-only (EXAMINE) and closed
+    // again, so the pooled one still opens read-write when it's used
+    shared_ptr<net::folder> folder =
+        conn.store()->getFolder(net::imap::IMAPUtils::stringToPath(_pool.separator(), mailbox));
+    folder->open(net::folder::MODE_READ_ONLY);
+    shared_ptr<net::message> message = folder->getMessage(1);
+    net::fetchAttributes attrs(net::fetchAttributes::UID);
+    attrs.add("Subject");
+    folder->fetchMessage(message, attrs);
+    shared_ptr<const headerField> sfield = message->getHeader()->Subject();
+    shared_ptr<const text> svalue = sfield->getValue<const text>();
+    string path = svalue->getWholeBuffer();
+    folder->close(false);
+    if (mailboxForPath(path) != mailbox) {
+        // renamed since it was created, see renameDirectory(); the first
+        // message can't be rewritten in place, so the name is what counts
+        path = pathForMailbox(mailbox);
+    }
+    return path;
+}
+
+vector<string> IMAPFS::listMailboxes(ConnectionT& conn)
+{
+    vector<string> names;
+    shared_ptr<net::folder> root = conn.store()->getRootFolder();
     vector<shared_ptr<net::folder>> folders = root->getFolders();
-    
+
     for (vector<shared_ptr<net::folder>>::iterator iter = folders.begin(); iter != folders.end(); ++iter) {
-        shared_ptr<net::folder> folder = *iter;
-        string folderName = folder->getName().getBuffer();
+        string folderName = (*iter)->getName().getBuffer();
         // skip everything that doesn't start with ".fs"
-        if (folderName.substr(0, FS_PREFIX.length()) != FS_PREFIX) {
+        if (folderName.substr(0, FS_PREFIX.length()) != FS_PREFIX || folderName == FS_CHUNK_MAILBOX) {
             continue;
         }
-        
-        folder->open(net::folder::MODE_READ_WRITE);
-        shared_ptr<net::message> message = folder->getMessage(1);
-        folder->fetchMessage(message, net::fetchAttributes::ENVELOPE);
-        shared_ptr<const headerField> sfield = message->getHeader()->Subject();
-        shared_ptr<const text> svalue = sfield->getValue<const text>();
-        const string f = svalue->getWholeBuffer();
-        string path(f);
-        LOGFN(LOG, INFO) << "filesystem has path " << path;
-        _fsMap.insert(pair<string, shared_ptr<net::folder>>(path, folder));
+        names.push_back(folderName);
     }
+    return names;
+}
 
-    if (_fsMap.size() == 0) {
-        LOGFN(LOG, INFO) << "no root filesystem, creating";
-        _root->_folder = createMailboxForPath("/");
-    }
-    else {
-        _root->_folder = findFolder("/");
+int IMAPFS::discoverMailboxes(map<string, string>& found, const map<string, string>& known, bool background)
+{
+    map<string, string> paths;
+    for (map<string, string>::const_iterator iter = known.begin(); iter != known.end(); ++iter) {
+        paths[iter->second] = iter->first;
+    }
+    vector<string> names;
+    {
+        ConnectionT conn(_pool);
+        vector<string> listed = listMailboxes(conn);
+        for (vector<string>::iterator iter = listed.begin(); iter != listed.end(); ++iter) {
+            map<string, string>::iterator p = paths.find(*iter);
+            if (p != paths.end()) {
+                found.insert(pair<string, string>(p->second, *iter));
+            }
+            else {
+                names.push_back(*iter);
+            }
+        }
+
+        shared_ptr<net::folder> chunks = conn.folder(FS_CHUNK_MAILBOX, false);
+        if (!chunks->exists()) {
+            LOGFN(LOG, INFO) << "creating chunk mailbox " << FS_CHUNK_MAILBOX;
+            net::folderAttributes attr;
+            attr.setType(net::folderAttributes::TYPE_CONTAINS_MESSAGES);
+            chunks->create(attr);
+        }
     }
+
+    // every new mailbox needs its first message looked at, that's a few
+    // round trips each, so spread them over every connection we have; in
+    // the background, over all but one, and each goes back to the pool
+    // between mailboxes so foreground requests get a turn
+    mutex m;
+    size_t next = 0;
+    int err = 0;
+    auto probe = [&]() {
+        unique_ptr<ConnectionT> conn;
+        for (;;) {
+            string name;
+            {
+                lock_guard<mutex> lock(m);
+                if (next == names.size() || err) {
+                    return;
+                }
+                name = names[next++];
+            }
+            if (!conn) {
+                conn.reset(new ConnectionT(_pool));
+            }
+            try {
+                string path = probeMailbox(*conn, name);
+                LOGFN(LOG, INFO) << "filesystem has path " << path;
+                lock_guard<mutex> lock(m);
+                found.insert(pair<string, string>(path, name));
+            }
+            catch (vmime::exception& e) {
+                LOGFN(LOG, CRIT) << "can't tell what " << name << " is: " << e;
+                lock_guard<mutex> lock(m);
+                err = -EIO;
+            }
+            if (background) {
+                conn.reset();
+            }
+        }
+    };
+    vector<thread> workers;
+    size_t threads = background ? _pool.size() - 1 : _pool.size();
+    for (size_t i = 1; i < min(threads, names.size()); ++i) {
+        workers.push_back(thread(probe));
+    }
+    probe();
+    for (vector<thread>::iterator iter = workers.begin(); iter != workers.end(); ++iter) {
+        iter->join();
+    }
+    LOGFN(LOG, INFO) << "found " << found.size() << " mailboxes, " << names.size() << " of them new";
+    return err;
+}
+
+void IMAPFS::addMailboxes(const map<string, string>& found)
+{
+    _fsMap.insert(found.begin(), found.end());
+    _nodes.root()->_mailbox = findMailbox("/");
     
-    for (map<string, shared_ptr<net::folder>>::iterator iter = _fsMap.begin(); iter != _fsMap.end(); ++iter) {
+    for (map<string, string>::iterator iter = _fsMap.begin(); iter != _fsMap.end(); ++iter) {
         string path = iter->first;
         LOGFN(LOG, INFO) << "find parent for " << path;
         NodeT* n = findParent(path);
         if (n) {
             this->rebuildFolder(n, iter->second);
         }
-        n = findNode(path);
+        n = _nodes.find(path);
         if (!n) {
             LOGFN(LOG, CRIT) << "failed to add node " << path;
             continue;
         }
-        n->_folder = iter->second;
+        n->_mailbox = iter->second;
     }
-    
+}
+
+int IMAPFS::parseFilesystem()
+{
+    resetRoot();
+
+    map<string, string> found;
+    if (discoverMailboxes(found)) {
+        // not knowing about a mailbox is worse than not mounting
+        return -1;
+    }
+
+    if (found.size() == 0) {
+        LOGFN(LOG, INFO) << "no root filesystem, creating";
+        if (createMailboxForPath("/").empty()) {
+            return -1;
+        }
+    }
+
+    WriteLockT lock(_lock);
+    addMailboxes(found);
     return 0;
 }
 
-NodeT* IMAPFS::findParent(const string& path)
+bool IMAPFS::restoreSnapshot(const string& file)
 {
-    if (!_root) {
-        return NULL;
+    _snapshotFile = file;
+    vector<SnapshotDirT> dirs;
+    if (loadSnapshot(file, dirs) || dirs.empty()) {
+        return false;
     }
-    if (path == "/") {
-        return NULL;
+    resetRoot();
+
+    map<string, string> found;
+    for (vector<SnapshotDirT>::iterator d = dirs.begin(); d != dirs.end(); ++d) {
+        found[d->_path] = d->_mailbox;
     }
-  
-    NodeT* n = _root;
-    vector<string> elems = split(path, '/');
-    elems.pop_back();
-    if (elems.size()) {
-        n = ::find(elems.begin(), elems.end(), *_root);
+    size_t files = 0;
+    WriteLockT lock(_lock);
+    addMailboxes(found);
+    for (vector<SnapshotDirT>::iterator d = dirs.begin(); d != dirs.end(); ++d) {
+        NodeT* n = _nodes.find(d->_path);
+        if (!n) {
+            continue;
+        }
+        SyncStateT& state = _syncState[d->_mailbox];
+        state._uidValidity = d->_uidValidity;
+        state._uidNext = d->_uidNext;
+        state._highestModSeq = d->_highestModSeq;
+        state._count = d->_count;
+        if (!d->_listed) {
+            continue;
+        }
+        for (vector<SnapshotFileT>::iterator f = d->_files.begin(); f != d->_files.end(); ++f) {
+            fileNode(n, d->_mailbox, f->_name, f->_uid, f->_size, f->_mtime, f->_chunkSize);
+        }
+        files += d->_files.size();
+        // as good as listed, the next readdir only asks what changed
+        n->_flags |= E_HAVEMESSAGES;
     }
-    return n;    
+    LOGFN(LOG, INFO) << "restored " << dirs.size() << " directories and " << files << " files from " << file;
+    return true;
 }
 
-NodeT* IMAPFS::findNode(const string& path)
+int IMAPFS::storeSnapshot()
 {
-    if (!_root) {
-        return NULL;
+    if (_snapshotFile.empty()) {
+        return -ENOSYS;
+    }
+    vector<SnapshotDirT> dirs;
+    {
+        ReadLockT lock(_lock);
+        for (map<string, string>::iterator iter = _fsMap.begin(); iter != _fsMap.end(); ++iter) {
+            NodeT* n = _nodes.find(iter->first);
+            if (!n) {
+                continue;
+            }
+            SnapshotDirT d;
+            d._path = iter->first;
+            d._mailbox = iter->second;
+            map<string, SyncStateT>::iterator state = _syncState.find(iter->second);
+            if (state != _syncState.end()) {
+                d._uidValidity = state->second._uidValidity;
+                d._uidNext = state->second._uidNext;
+                d._highestModSeq = state->second._highestModSeq;
+                d._count = state->second._count;
+            }
+            // a listing we can't revalidate incrementally isn't worth keeping
+            d._listed = (n->_flags & E_HAVEMESSAGES) && d._uidNext;
+            for (vector<NodeT*>::iterator c = n->_children.begin(); d._listed && c != n->_children.end(); ++c) {
+                // files that never made it to the server come back from the journal
+                if (!S_ISREG((*c)->_stat.st_mode) || (*c)->_uid == "0") {
+                    continue;
+                }
+                SnapshotFileT f;
+                f._name = (*c)->_name;
+                f._uid = (*c)->_uid;
+                f._size = (*c)->_baseSize;
+                f._mtime = (*c)->_stat.st_mtim.tv_sec;
+                f._chunkSize = (*c)->_manifest._chunkSize;
+                d._files.push_back(f);
+            }
+            dirs.push_back(d);
+        }
     }
-    if (path == "/") {
-        return _root;
+    return saveSnapshot(_snapshotFile, dirs);
+}
+
+void IMAPFS::startRevalidation()
+{
+    _revalidator = thread(&IMAPFS::revalidate, this);
+}
+
+void IMAPFS::revalidate()
+{
+    try {
+        // only what we knew before asking can have gone away, a mkdir
+        // that races with us isn't on the list
+        map<string, string> known;
+        {
+            ReadLockT lock(_lock);
+            known = _fsMap;
+        }
+        map<string, string> found;
+        // a mailbox we couldn't probe would look deleted; the ones we
+        // know already only need to be in the LIST, STATUS below tells
+        // whether anything in them changed
+        bool complete = discoverMailboxes(found, known, true) == 0;
+
+        vector<shared_ptr<NodeT>> listed;
+        {
+            WriteLockT lock(_lock);
+            for (map<string, string>::iterator iter = known.begin(); iter != known.end(); ++iter) {
+                if (!complete || found.count(iter->first) || iter->first == "/") {
+                    continue;
+                }
+                LOGFN(LOG, INFO) << iter->first << " was removed while we weren't mounted";
+                NodeT* n = _nodes.find(iter->first);
+                if (n) {
+                    _nodes.erase(n);
+                }
+                _fsMap.erase(iter->first);
+                _syncState.erase(iter->second);
+                _pool.forget(iter->second);
+            }
+            addMailboxes(found);
+            for (map<string, string>::iterator iter = _fsMap.begin(); iter != _fsMap.end(); ++iter) {
+                NodeT* n = _nodes.find(iter->first);
+                if (n && (n->_flags & E_HAVEMESSAGES)) {
+                    listed.push_back(n->shared_from_this());
+                }
+            }
+        }
+
+        // whatever the snapshot listed, brought up to date one STATUS at a time
+        for (vector<shared_ptr<NodeT>>::iterator iter = listed.begin(); iter != listed.end(); ++iter) {
+            {
+                lock_guard<mutex> lock(_collectorMutex);
+                if (_stopping) {
+                    return;
+                }
+            }
+            loadDirectory(iter->get(), true);
+        }
+        LOGFN(LOG, INFO) << "revalidated " << listed.size() << " directories";
+    }
+    catch (vmime::exception& e) {
+        LOGFN(LOG, CRIT) << "revalidating the snapshot: " << e;
+    }
+    catch (std::exception& e) {
+        LOGFN(LOG, CRIT) << "revalidating the snapshot: " << e.what();
+    }
+}
+
+int IMAPFS::loadChunkIndex()
+{
+    vector<shared_ptr<net::message>> messages;
+    {
+        ConnectionT conn(_pool, FS_CHUNK_MAILBOX);
+        shared_ptr<net::folder> chunks = conn.folder(FS_CHUNK_MAILBOX);
+        if (chunks->getMessageCount() > 0) {
+            net::fetchAttributes attrs(net::fetchAttributes::UID | net::fetchAttributes::FLAGS);
+            attrs.add(FS_CHUNKHASH_HEADER);
+            messages = chunks->getAndFetchMessages(net::messageSet::byNumber(1, -1), attrs);
+        }
+        setUIDValidity(FS_CHUNK_MAILBOX, conn.uidValidity(FS_CHUNK_MAILBOX));
+    }
+    for (vector<shared_ptr<net::message>>::iterator iter = messages.begin(); iter != messages.end(); ++iter) {
+        if ((*iter)->getFlags() & net::message::FLAG_DELETED) {
+            // already dropped, just not expunged yet
+            continue;
+        }
+        string hash;
+        shared_ptr<const header> h = (*iter)->getHeader();
+        if (h->hasField(FS_CHUNKHASH_HEADER)) {
+            hash = h->findField(FS_CHUNKHASH_HEADER)->getValue<const text>()->getWholeBuffer();
+        }
+        _chunkIndex.load(hash, (*iter)->getUID());
+    }
+    _chunkIndex.setLoaded();
+    LOGFN(LOG, INFO) << "chunk index has " << _chunkIndex.size() << " chunks";
+    return 0;
+}
+
+int IMAPFS::collectChunks()
+{
+    if (!_chunkIndex.loaded() || _chunkIndex.size() == 0) {
+        // nothing a sweep could free
+        return 0;
+    }
+    _chunkIndex.beginSweep();
+
+    // count references from every manifest on the server, not just the
+    // directories somebody happened to look at, or that our tree knows
+    // about (a restored one may be missing what others created since)
+    vector<string> mailboxes;
+    {
+        ConnectionT conn(_pool);
+        mailboxes = listMailboxes(conn);
+    }
+    map<string, unsigned long> refs;
+    map<string, ChunkRefsT> counted;
+    for (vector<string>::iterator iter = mailboxes.begin(); iter != mailboxes.end(); ++iter) {
+        const string& mbox = *iter;
+        ChunkRefsT& found = counted[mbox];
+        vector<pair<string, string>> manifests;
+        {
+            ConnectionT conn(_pool, mbox);
+            found._state = folderState(conn.folder(mbox, false));
+            map<string, ChunkRefsT>::iterator last = _chunkRefs.find(mbox);
+            if (found._state._uidNext && last != _chunkRefs.end() && last->second._state == found._state) {
+                // manifests are never modified, only appended and
+                // expunged, and neither happened since
+                found._refs = last->second._refs;
+            }
+            else {
+                // only manifests carry the chunk size header, there's no
+                // need to look at anything else
+                vector<string> uids;
+                if (uidSearch(conn.store(), mbox, "HEADER " + FS_CHUNKSIZE_HEADER + " \"\"", uids)) {
+                    return -EIO;
+                }
+                uint32_t validity = found._state._uidValidity;
+                vector<string> missing;
+                for (vector<string>::iterator u = uids.begin(); u != uids.end(); ++u) {
+                    string raw;
+                    if (validity && _cache.readAll(CacheKeyT(mbox, validity, *u), raw)) {
+                        manifests.push_back(pair<string, string>(*u, raw));
+                    }
+                    else {
+                        missing.push_back(*u);
+                    }
+                }
+                if (!missing.empty()) {
+                    shared_ptr<net::folder> folder = conn.folder(mbox);
+                    validity = conn.uidValidity(mbox);
+                    vector<shared_ptr<net::message>> messages =
+                        folder->getAndFetchMessages(net::messageSet::byUID(missing),
+                                                    net::fetchAttributes(net::fetchAttributes::UID));
+                    for (vector<shared_ptr<net::message>>::iterator m = messages.begin(); m != messages.end(); ++m) {
+                        string raw;
+                        utility::outputStreamStringAdapter os(raw);
+                        (*m)->extract(os, NULL, 0, -1, true);
+                        _cache.write(CacheKeyT(mbox, validity, (*m)->getUID()), raw.size(), raw.data(), raw.size(), 0);
+                        manifests.push_back(pair<string, string>((*m)->getUID(), raw));
+                    }
+                }
+            }
+        }
+        for (vector<pair<string, string>>::iterator m = manifests.begin(); m != manifests.end(); ++m) {
+            ManifestT manifest;
+            if (!parseManifest(m->second, manifest)) {
+                // can't tell what it points at, so don't free anything
+                LOGFN(LOG, CRIT) << "unreadable manifest " << m->first << " in " << mbox << ", not collecting";
+                return -EIO;
+            }
+            for (vector<string>::iterator c = manifest._chunks.begin(); c != manifest._chunks.end(); ++c) {
+                ++found._refs[*c];
+            }
+        }
+        for (map<string, unsigned long>::iterator r = found._refs.begin(); r != found._refs.end(); ++r) {
+            refs[r->first] += r->second;
+        }
+    }
+    // mailboxes that are gone drop out along with their counts
+    _chunkRefs.swap(counted);
+
+    vector<string> garbage = _chunkIndex.endSweep(refs);
+    LOGFN(LOG, INFO) << refs.size() << " chunks referenced, " << garbage.size() << " freed";
+    if (!garbage.empty()) {
+        ConnectionT conn(_pool, FS_CHUNK_MAILBOX);
+        dropChunks(conn, garbage);
+    }
+    return 0;
+}
+
+void IMAPFS::startCollector()
+{
+    _collector = thread(&IMAPFS::collectorLoop, this);
+}
+
+void IMAPFS::collectorLoop()
+{
+    unique_lock<mutex> lock(_collectorMutex);
+    while (!_stopping) {
+        lock.unlock();
+        try {
+            if (!_chunkIndex.loaded()) {
+                loadChunkIndex();
+            }
+            collectChunks();
+        }
+        catch (vmime::exception& e) {
+            LOGFN(LOG, CRIT) << "chunk collector: " << e;
+        }
+        catch (std::exception& e) {
+            LOGFN(LOG, CRIT) << "chunk collector: " << e.what();
+        }
+        lock.lock();
+        _collectorWake.wait_for(lock, chrono::seconds(COLLECT_INTERVAL));
+    }
+}
+
+void IMAPFS::startWatcher()
+{
+    _watcher = thread(&IMAPFS::watchLoop, this);
+}
+
+void IMAPFS::setInvalidator(InvalidateT invalidate)
+{
+    lock_guard<mutex> lock(_collectorMutex);
+    _invalidate = invalidate;
+}
+
+void IMAPFS::watchLoop()
+{
+    try {
+        _watchPool.connect(_url, 1, _seperator);
+    }
+    catch (vmime::exception& e) {
+        LOGFN(LOG, CRIT) << "watcher couldn't connect, changes made elsewhere show up on listing only: " << e;
+        return;
+    }
+    ConnectionT conn(_watchPool);
+    shared_ptr<net::imap::IMAPStore> store = conn.store();
+    // EXAMINEd on the watcher's connection, and whether NOTIFY is set up
+    // there; both start over when the connection does
+    string selected;
+    bool fresh = true;
+
+    unique_lock<mutex> lock(_collectorMutex);
+    while (!_stopping) {
+        string wanted = _watched;
+        lock.unlock();
+        if (wanted.empty()) {
+            ReadLockT tlock(_lock);
+            wanted = findMailbox("/");
+        }
+
+        set<string> changed;
+        try {
+            if (!store->isConnected()) {
+                store->connect();
+            }
+            if (fresh) {
+                bool notify = notifyAll(store) == 0;
+                _watchingAll = notify;
+                LOGFN(LOG, INFO) << "watching " << (notify ? "every mailbox" : "the directory listed last");
+                selected.clear();
+                fresh = false;
+            }
+            if (wanted != selected) {
+                // read-only, so nothing we do here can expunge anything
+                if (rawCommand(store->getConnection(), "EXAMINE " + net::imap::IMAPUtils::quoteString(wanted))) {
+                    wanted.clear();
+                }
+                selected = wanted;
+            }
+            idle(store, selected, [this]() {
+                unique_lock<mutex> wlock(_collectorMutex);
+                if (!_stopping) {
+                    _collectorWake.wait_for(wlock, chrono::seconds(WATCH_INTERVAL));
+                }
+            }, changed);
+        }
+        catch (vmime::exception& e) {
+            LOGFN(LOG, CRIT) << "watcher: " << e;
+            fresh = true;
+            _watchingAll = false;
+            try {
+                store->disconnect();
+            }
+            catch (vmime::exception&) { }
+            lock.lock();
+            _collectorWake.wait_for(lock, chrono::seconds(WATCH_INTERVAL));
+            continue;
+        }
+
+        // refreshMailbox() skips anything without a listed directory, the
+        // chunk mailbox and the rest of the account included
+        for (set<string>::iterator iter = changed.begin(); iter != changed.end(); ++iter) {
+            try {
+                refreshMailbox(*iter);
+            }
+            catch (vmime::exception& e) {
+                LOGFN(LOG, CRIT) << "refreshing " << *iter << ": " << e;
+            }
+        }
+        lock.lock();
+    }
+}
+
+void IMAPFS::refreshMailbox(const string& mailbox)
+{
+    shared_ptr<NodeT> n;
+    {
+        ReadLockT lock(_lock);
+        for (map<string, string>::iterator iter = _fsMap.begin(); iter != _fsMap.end(); ++iter) {
+            if (iter->second != mailbox) {
+                continue;
+            }
+            // nobody looked at it yet, the first listing fetches it all anyway
+            NodeT* d = _nodes.find(iter->first);
+            if (d && (d->_flags & E_HAVEMESSAGES)) {
+                n = d->shared_from_this();
+            }
+            break;
+        }
     }
-    vector<string> elems = split(path, PATH_DELIMITER);
-    NodeT* n = ::find(elems.begin(), elems.end(), *_root);
     if (!n) {
-        //LOGFN(LOG, CRIT) << "path not found: " << spath;
+        return;
+    }
+    vector<InvalidationT> changes;
+    int r = loadDirectory(n.get(), true, &changes);
+    if (r || changes.empty()) {
+        return;
+    }
+    LOGFN(LOG, INFO) << n->_path << ": " << changes.size() << " names changed elsewhere";
+    InvalidateT invalidate;
+    {
+        lock_guard<mutex> lock(_collectorMutex);
+        invalidate = _invalidate;
+    }
+    // outside of every lock of ours, the kernel may have to wait for a
+    // request of its own that needs them
+    if (invalidate) {
+        for (vector<InvalidationT>::iterator iter = changes.begin(); iter != changes.end(); ++iter) {
+            invalidate(*iter);
+        }
+    }
+}
+
+void IMAPFS::forget(ino_t ino, unsigned long count)
+{
+    WriteLockT lock(_lock);
+    NodeT* n = _nodes.find(ino);
+    if (n) {
+        _nodes.forget(n, count);
+    }
+}
+
+NodeT* IMAPFS::findParent(const string& path)
+{
+    if (path == "/") {
+        return NULL;
+    }
+    // whatever goes in a directory rmdir() is deleting would go with it
+    NodeT* n = _nodes.find(parentPath(path));
+    if (n && n->_removing) {
         return NULL;
     }
     return n;
 }
 
-shared_ptr<net::folder> IMAPFS::findFolder(const string& path)
+shared_ptr<NodeT> IMAPFS::findNode(const string& path)
+{
+    ReadLockT lock(_lock);
+    NodeT* n = _nodes.find(path);
+    if (!n) {
+        return nullptr;
+    }
+    return n->shared_from_this();
+}
+
+shared_ptr<NodeT> IMAPFS::findNode(ino_t ino)
+{
+    ReadLockT lock(_lock);
+    NodeT* n = _nodes.find(ino);
+    if (!n) {
+        return nullptr;
+    }
+    return n->shared_from_this();
+}
+
+string IMAPFS::pathOf(NodeT* n)
+{
+    ReadLockT lock(_lock);
+    return n->_path;
+}
+
+shared_ptr<NodeT> IMAPFS::findChild(NodeT* parent, const string& name)
 {
-    LOGFN(LOG, INFO) << "findFolder " << path;
-    shared_ptr<net::folder> ret;
-    map<string, shared_ptr<net::folder>>::iterator iter = _fsMap.find(path);
+    ReadLockT lock(_lock);
+    NodeT* n = _nodes.child(parent, name);
+    if (!n) {
+        return nullptr;
+    }
+    return n->shared_from_this();
+}
+
+string IMAPFS::findMailbox(const string& path)
+{
+    LOGFN(LOG, INFO) << "findMailbox " << path;
+    string ret;
+    map<string, string>::iterator iter = _fsMap.find(path);
     if (iter != _fsMap.end()) {
         ret = iter->second;
     }
@@ -733,6 +2847,58 @@ shared_ptr<net::folder> IMAPFS::findFolder(const string& path)
     return ret;
 }
 
+uint32_t IMAPFS::uidValidity(const string& mailbox)
+{
+    ReadLockT lock(_lock);
+    map<string, SyncStateT>::iterator iter = _syncState.find(mailbox);
+    if (iter == _syncState.end()) {
+        return 0;
+    }
+    return iter->second._uidValidity;
+}
+
+void IMAPFS::setUIDValidity(const string& mailbox, uint32_t validity)
+{
+    WriteLockT lock(_lock);
+    SyncStateT& state = _syncState[mailbox];
+    if (state._uidValidity != validity) {
+        // whatever else we knew about it is meaningless now
+        state = SyncStateT();
+        state._uidValidity = validity;
+    }
+}
+
+SyncStateT IMAPFS::syncState(const string& mailbox)
+{
+    ReadLockT lock(_lock);
+    map<string, SyncStateT>::iterator iter = _syncState.find(mailbox);
+    if (iter == _syncState.end()) {
+        return SyncStateT();
+    }
+    return iter->second;
+}
+
+void IMAPFS::setSyncState(const string& mailbox, const SyncStateT& state)
+{
+    WriteLockT lock(_lock);
+    _syncState[mailbox] = state;
+}
+
+SyncStateT IMAPFS::folderState(shared_ptr<net::folder> folder)
+{
+    SyncStateT state;
+    shared_ptr<net::imap::IMAPFolderStatus> status =
+        dynamic_pointer_cast<net::imap::IMAPFolderStatus>(folder->getStatus());
+    if (status) {
+        state._uidValidity = status->getUIDValidity();
+        state._uidNext = status->getUIDNext();
+        // 0 unless the server does CONDSTORE
+        state._highestModSeq = status->getHighestModSeq();
+        state._count = status->getMessageCount();
+    }
+    return state;
+}
+
 string IMAPFS::canonicalHost()
 {
     stringstream ss;
@@ -743,27 +2909,18 @@ string IMAPFS::canonicalHost()
     return ss.str();
 }
 
-void IMAPFS::rebuildMessage(NodeT* in, shared_ptr<net::folder> folder, shared_ptr<net::message> message)
+void IMAPFS::rebuildMessage(NodeT* in, const string& mailbox, shared_ptr<net::message> message)
 {
     shared_ptr<const header> header = message->getHeader();
     shared_ptr<const datetime> dateTime = header->Date()->getValue<const datetime>();
     shared_ptr<const text> filename = header->Subject()->getValue<const text>();
     shared_ptr<const text> tbinsize = header->findField(FS_BINSIZE_HEADER)->getValue<const text>();
     
-    NodeT n;
-
-    n._message = message;
-    
-    const net::message::uid uid = message->getUID();
-    n._uid = string(uid);
-    n._name = filename->getWholeBuffer();
-    n._name = trim(n._name);
-    n._stat.st_nlink = 1;
-    n._stat.st_mode = S_IFREG | 0644;
-    n._stat.st_uid = fuse_get_context()->uid;
-    n._stat.st_gid = fuse_get_context()->gid;
-    string ssize = tbinsize->getWholeBuffer();
-    n._stat.st_size = n._stat.st_blksize = n._stat.st_blocks = atol(ssize.c_str());;
+    off_t chunkSize = 0;
+    if (header->hasField(FS_CHUNKSIZE_HEADER)) {
+        string schunk = header->findField(FS_CHUNKSIZE_HEADER)->getValue<const text>()->getWholeBuffer();
+        chunkSize = atol(schunk.c_str());
+    }
     struct tm tm;
     tm.tm_sec = dateTime->getSecond();
     tm.tm_min = dateTime->getMinute();
@@ -774,64 +2931,145 @@ void IMAPFS::rebuildMessage(NodeT* in, shared_ptr<net::folder> folder, shared_pt
     time_t t = mktime(&tm);
     //LOG(LOG, INFO) << "yy/mm/dd " << tm.tm_year << "/" << (tm.tm_mon + 1) << "/" << tm.tm_mday
     //               << " hh:mm:ss " << tm.tm_hour << ":" << tm.tm_min << ":" << tm.tm_sec;
-    n._stat.st_atim.tv_sec = n._stat.st_mtim.tv_sec = n._stat.st_ctim.tv_sec = t;
 
-    n._parent = in;
-    n._folder = folder;
-    in->_sub.insert(n);
+    string ssize = tbinsize->getWholeBuffer();
+    fileNode(in, mailbox, trim(filename->getWholeBuffer()), message->getUID(), atol(ssize.c_str()), t, chunkSize);
+}
+
+void IMAPFS::fileNode(NodeT* in, const string& mailbox, const string& name, const string& uid,
+                      off_t size, time_t mtime, off_t chunkSize)
+{
+    ino_t ino = InodeTableT::makeIno(mailbox, uid);
+    bool created;
+    NodeT* n = _nodes.create(in, name, &created, ino);
+    if (!created) {
+        // the same file, a directory, or ours and not stored yet
+        if (!S_ISREG(n->_stat.st_mode) || n->_uid.empty() || n->_uid == "0" ||
+            strtoul(n->_uid.c_str(), NULL, 10) >= strtoul(uid.c_str(), NULL, 10)) {
+            return;
+        }
+        {
+            unique_lock<mutex> nlock(n->_mutex, try_to_lock);
+            if (!nlock.owns_lock() || (n->_flags & E_NEEDSYNC)) {
+                return;
+            }
+        }
+        LOGFN(LOG, INFO) << n->_path << " was rewritten elsewhere";
+        _nodes.erase(n);
+        n = _nodes.create(in, name, &created, ino);
+    }
+
+    n->_uid = uid;
+    n->_stat.st_nlink = 1;
+    n->_stat.st_mode = S_IFREG | 0644;
+    n->_stat.st_uid = getuid();
+    n->_stat.st_gid = getgid();
+    n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = size;
+    n->_baseSize = size;
+    n->_manifest._chunkSize = chunkSize;
+    n->_stat.st_atim.tv_sec = n->_stat.st_mtim.tv_sec = n->_stat.st_ctim.tv_sec = mtime;
+
+    n->_mailbox = mailbox;
 }
 
-void IMAPFS::rebuildMessages(NodeT* in, shared_ptr<net::folder> folder)
+vector<shared_ptr<net::message>> IMAPFS::fetchMessages(shared_ptr<net::folder> folder)
 {
-    LOGFN(LOG, INFO) << "rebuildMessages for " << in->_name;
-    //in->_sub.clear();
+    LOGFN(LOG, INFO) << "fetchMessages for " << folder->getName().getBuffer();
 
     if (folder->getMessageCount() <= 1) {
-        return;
+        return vector<shared_ptr<net::message>>();
     }
     
     // msg '1' is meta data regarding which folder this is... not an actual
     // filesystem node
-    vector<shared_ptr<net::message>> messages =
-        folder->getAndFetchMessages(net::messageSet::byNumber(2, -1),
-                    net::fetchAttributes(net::fetchAttributes::FULL_HEADER |
-                                         net::fetchAttributes::SIZE |
-                                         net::fetchAttributes::UID) );
+    vector<shared_ptr<net::message>> messages = fetchMessages(folder, net::messageSet::byNumber(2, -1));
+    // replaced or unlinked files linger flagged \Deleted until their batch
+    // is expunged, see ExpungeQueueT
+    messages.erase(remove_if(messages.begin(), messages.end(), [](const shared_ptr<net::message>& m) {
+                       return (m->getFlags() & net::message::FLAG_DELETED) != 0;
+                   }), messages.end());
+    return messages;
+}
+
+vector<shared_ptr<net::message>> IMAPFS::fetchMessages(shared_ptr<net::folder> folder, const net::messageSet& set)
+{
+    // just the fields rebuildMessage() and the collector look at, that's
+    // BODY.PEEK[HEADER.FIELDS (...)] instead of every Received: line
+    net::fetchAttributes attrs(net::fetchAttributes::SIZE |
+                               net::fetchAttributes::FLAGS |
+                               net::fetchAttributes::UID);
+    attrs.add("Subject");
+    attrs.add("Date");
+    attrs.add(FS_BINSIZE_HEADER);
+    attrs.add(FS_CHUNKSIZE_HEADER);
+    return folder->getAndFetchMessages(set, attrs);
+}
+
+set<string> IMAPFS::liveUIDs(shared_ptr<net::folder> folder)
+{
+    set<string> uids;
+    if (folder->getMessageCount() <= 1) {
+        return uids;
+    }
+    vector<shared_ptr<net::message>> messages = folder->getAndFetchMessages(net::messageSet::byNumber(2, -1),
+        net::fetchAttributes(net::fetchAttributes::UID | net::fetchAttributes::FLAGS));
     for (vector<shared_ptr<net::message>>::iterator iter = messages.begin(); iter != messages.end(); ++iter) {
-        rebuildMessage(in, folder, *iter);
+        if (!((*iter)->getFlags() & net::message::FLAG_DELETED)) {
+            uids.insert((*iter)->getUID());
+        }
+    }
+    return uids;
+}
+
+bool IMAPFS::expungeBatch(const string& mailbox, const vector<string>& uids)
+{
+    LOGFN(LOG, INFO) << "expunging " << uids.size() << " messages from " << mailbox;
+    ConnectionT conn(_pool, mailbox);
+    int ret = uidExpunge(conn.store(), mailbox, uids);
+    if (ret == -ENOTSUP) {
+        // everything flagged \Deleted in there is ours and meant to go anyway
+        conn.folder(mailbox)->expunge();
+    }
+    else if (ret) {
+        return false;
+    }
+    // the next listing shouldn't mistake our own expunges for somebody
+    // else's, those cost a pass over every UID
+    WriteLockT lock(_lock);
+    map<string, SyncStateT>::iterator iter = _syncState.find(mailbox);
+    if (iter != _syncState.end() && iter->second._uidNext) {
+        if (ret == -ENOTSUP || iter->second._count < uids.size()) {
+            // no telling how many went
+            iter->second._uidNext = 0;
+        }
+        else {
+            iter->second._count -= uids.size();
+        }
     }
+    return true;
 }
 
-void IMAPFS::rebuildFolder(NodeT* in, shared_ptr<net::folder> folder)
+void IMAPFS::rebuildFolder(NodeT* in, const string& mboxName)
 {
     if (!in) {
         LOGFN(LOG, CRIT) << "parent node can't be null";
         return;
     }
     
-    NodeT n;
-    string mboxName(folder->getName().getBuffer());
-    n._name = mboxName.substr(FS_PREFIX.length() + 1);
-    n._stat.st_nlink = 2;
-    n._stat.st_mode = S_IFDIR | 0755;
-    n._stat.st_uid = getuid();
-    n._stat.st_gid = getgid();
-    n._stat.st_size = n._stat.st_blksize = n._stat.st_blocks = 4096;
-    n._parent = in;
+    // mailbox names encode the full path with ':', we only want the leaf
+    bool created;
+    NodeT* n = _nodes.create(in, mboxName.substr(mboxName.rfind(':') + 1), &created,
+                             InodeTableT::makeIno(mboxName, "0"));
+    if (!created) {
+        return;
+    }
+    n->_stat.st_nlink = 2;
+    n->_stat.st_mode = S_IFDIR | 0755;
+    n->_stat.st_uid = getuid();
+    n->_stat.st_gid = getgid();
+    n->_stat.st_size = n->_stat.st_blksize = n->_stat.st_blocks = 4096;
 
     // LAM not sure what timestamps to put on a newly mounted FS... go with "now"
     time_t t = Time().now().seconds();
-    n._stat.st_atim.tv_sec = n._stat.st_mtim.tv_sec = n._stat.st_ctim.tv_sec = t;
-
-    in->_sub.insert(n);
-}
-
-void IMAPFS::rebuildFolders(NodeT* in, shared_ptr<net::folder> folder)
-{
-    LOGFN(LOG, INFO) << "rebuildFolders for " << in->_name;
-
-    vector<shared_ptr<net::folder>> folders = folder->getFolders();
-    for (vector<shared_ptr<net::folder>>::iterator iter = folders.begin(); iter != folders.end(); ++iter) {
-        rebuildFolder(in, *iter);
-    }
+    n->_stat.st_atim.tv_sec = n->_stat.st_mtim.tv_sec = n->_stat.st_ctim.tv_sec = t;
 }
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <atomic>
 #include <climits>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <string>
 #include <vector>
+#include <map>
 #include <set>
 
 #define _FILE_OFFSET_BITS 64
@@ -12,6 +18,19 @@
 #include <vmime/vmime.hpp>
 #include <vmime/net/imap/imap.hpp>
 
+#include "chunk_index.h"
+#include "connection_pool.h"
+#include "content_cache.h"
+#include "expunge_queue.h"
+#include "inode_table.h"
+#include "journal.h"
+#include "manifest.h"
+#include "message_stream.h"
+#include "prefetcher.h"
+#include "rwlock.h"
+#include "snapshot.h"
+#include "writeback.h"
+
 std::ostream& operator << (std::ostream& os, const vmime::exception& e);
 
 enum {
@@ -19,88 +38,353 @@ enum {
     E_NEEDSYNC = 1L << 1,
 };
 
-class NodeT;
-
 extern char PATH_DELIMITER;
 extern const std::string FS_PREFIX;
+extern const std::string FS_CHUNK_MAILBOX;
+// setxattr() name that copies another file in, see IMAPFS::setxattr()
+extern const std::string COPY_XATTR;
 
-std::vector<std::string> split(const std::string& s, char delim);
-NodeT* find(std::vector<std::string>::iterator at, const std::vector<std::string>::const_iterator& end, const NodeT& in);
+// what a listing last saw of a mailbox, so the next one only has to fetch
+// what changed since; a _uidNext of 0 means start over
+struct SyncStateT {
+    SyncStateT(): _uidValidity(0), _uidNext(0), _highestModSeq(0), _count(0) { }
 
-struct NodeT {
-    NodeT(const std::string& name, const std::string& uid):
-        _name(name), _uid(uid), _flags(0L), _parent(NULL) {
-        memset(&_stat, 0, sizeof(struct stat));
+    bool operator == (const SyncStateT& other) const {
+        return _uidValidity == other._uidValidity && _uidNext == other._uidNext &&
+            _highestModSeq == other._highestModSeq && _count == other._count;
     }
-    NodeT(const std::string& name): NodeT(name, "0") { }
-    NodeT(): NodeT("") { }
-    
-    // operator overload so we can put them in a set
-    bool operator < (const NodeT& rhs) const { return (_name < rhs._name); }
-    
-    const std::string& name() { return _name; }
-    const std::string& uid() { return _uid; }
-    
-    std::string _name;
-    // contents of below don't affect sort order, so they can be mutable
+
+    uint32_t _uidValidity;
+    uint32_t _uidNext;
+    uint64_t _highestModSeq;
+    // messages in the mailbox, the metadata one included
+    size_t _count;
+};
+
+// chunk references one sweep counted in a mailbox, the next one reuses
+// them as long as the mailbox is still in the same state
+struct ChunkRefsT {
+    SyncStateT _state;
+    std::map<std::string, unsigned long> _refs;
+};
+
+// how far along its listing a directory is being read, see noteOpen()
+struct ScanT {
+    ScanT(): _last(SIZE_MAX), _ahead(0), _streak(0) { }
+
+    // position of the last file opened, SIZE_MAX if none yet
+    size_t _last;
+    // files before this position have already been prefetched
+    size_t _ahead;
+    // files opened in listing order in a row
+    unsigned _streak;
+};
+
+// part of one stored message (a small file or a chunk) to read ahead
+struct StoredRangeT {
+    std::string _mailbox;
     std::string _uid;
-    unsigned long _flags;
-    struct stat _stat;
-    mutable std::set<NodeT> _sub;
-
-    NodeT* _parent;
-    std::shared_ptr<vmime::net::folder> _folder;
-    std::shared_ptr<vmime::net::message> _message;
-    std::string _text;
-    vmime::byteArray _contents;
+    BodyLayoutT _layout;
+    off_t _storedSize;
+    off_t _offset;
+    off_t _length;
+};
+
+// a name in a directory the kernel may have cached that changed behind its
+// back; _ino is the inode that was there before, 0 for a name that's new
+struct InvalidationT {
+    InvalidationT(ino_t parent, const std::string& name, ino_t ino): _parent(parent), _name(name), _ino(ino) { }
+
+    ino_t _parent;
+    std::string _name;
+    ino_t _ino;
+};
+
+typedef std::function<void (const InvalidationT&)> InvalidateT;
+
+// a file (or chunk) message waiting for IMAPFS::appendFiles()
+struct PendingFileT {
+    PendingFileT(const std::string& subject, const std::string& hash, SourceT source, uint64_t size):
+        _subject(subject), _hash(hash), _source(source), _size(size) { }
+
+    std::string _subject;
+    std::string _hash;
+    SourceT _source;
+    uint64_t _size;
 };
 
 class IMAPFS {
 public:
-    IMAPFS(const std::string& host, unsigned short port, const std::string& authuser, const std::string& password);
+    IMAPFS(const std::string& host, unsigned short port, const std::string& authuser, const std::string& password,
+           size_t connections = 1);
+    ~IMAPFS();
 
     int getattr(const std::string& path, struct stat* stat);
     int statfs(const std::string& path, struct statvfs* stat);
-    int mknod(const std::string& path, mode_t mode);
+    int mknod(const std::string& path, mode_t mode, uid_t uid, gid_t gid);
     int readdir(const std::string& path, void* buf, fuse_fill_dir_t filler, off_t offset);
     int read(const std::string& path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi);
     int write(const std::string& path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi);
     int fsync(const std::string& path, int isdatasync, struct fuse_file_info* fi);
     int fallocate(const std::string& path, int mode, off_t offset, off_t length, struct fuse_file_info* fi);
-    int truncate(const std::string& path, off_t size);
+    // "fi" is the handle for ftruncate() and O_TRUNC opens, NULL when
+    // nothing has the file open
+    int truncate(const std::string& path, off_t size, struct fuse_file_info* fi);
     int access(const std::string& path, int mask);
     int unlink(const std::string& path);
     int mkdir(const std::string& path, mode_t mode);
     int rmdir(const std::string& path);
     int release(const std::string& path, struct fuse_file_info* fi);
     int rename(const std::string& from, const std::string& to);
+    // setting COPY_XATTR to the path of another file copies that file in
+    // without the data leaving the server, nothing else can be set
+    int setxattr(const std::string& path, const std::string& name, const std::string& value);
+    // copy_file_range(): the whole of a file into an empty one is a
+    // server-side copy, anything else is -EOPNOTSUPP and left to the caller
+    ssize_t copyFileRange(const std::string& from, off_t offsetIn, const std::string& to, off_t offsetOut,
+                          size_t size);
+
+    // the same for a node already looked up, by inode number say; an open
+    // file stays the file it was opened as whatever its path becomes
+    int read(std::shared_ptr<NodeT> node, char* buf, size_t size, off_t offset, struct fuse_file_info* fi);
+    int write(std::shared_ptr<NodeT> node, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi);
+    int fsync(std::shared_ptr<NodeT> node, int isdatasync, struct fuse_file_info* fi);
+    int truncate(std::shared_ptr<NodeT> node, off_t size, struct fuse_file_info* fi);
+    int release(std::shared_ptr<NodeT> node, struct fuse_file_info* fi);
+    int setxattr(std::shared_ptr<NodeT> node, const std::string& name, const std::string& value);
+    ssize_t copyFileRange(std::shared_ptr<NodeT> from, off_t offsetIn, std::shared_ptr<NodeT> to, off_t offsetOut,
+                          size_t size);
+
+    std::string createMailboxForPath(const std::string& path);
 
-    std::shared_ptr<vmime::net::folder> openMailbox(const std::string& mailbox);
-    std::shared_ptr<vmime::net::folder> createMailboxForPath(const std::string& path);
+    // the halves of rename(): a file keeps its data where it is on the
+    // server, only a new manifest (or the message itself) goes anywhere;
+    // a directory gets its mailbox, and every one below it, RENAMEd
+    int renameFile(std::shared_ptr<NodeT> node, std::shared_ptr<NodeT> target, const std::string& to);
+    int renameDirectory(std::shared_ptr<NodeT> dir, const std::string& from, const std::string& to);
+    // stores what clean file "from" has stored as "name" in "mailbox",
+    // without the data leaving the server, and makes "to" (which may be
+    // "from") that copy; with "move" the old message goes.  Both must be
+    // locked by the caller; -EXDEV if the server can't do it that way
+    int copyStored(NodeT* from, NodeT* to, const std::string& mailbox, const std::string& name, bool move);
+    // a server-side copy of the whole of "from" into "to", which has to be
+    // empty, and "from" no longer than "size" (-EOPNOTSUPP otherwise);
+    // returns the length copied
+    ssize_t copyFile(std::shared_ptr<NodeT> from, std::shared_ptr<NodeT> to, size_t size);
+    // DELETEs the mailbox of "dir" and of every directory below it and drops
+    // the lot from the tree, whatever is in there
+    int removeTree(std::shared_ptr<NodeT> dir, const std::string& path);
+    // sets _removing on "dir" and everything below it; tree lock held
+    void markRemoving(NodeT* dir, bool removing);
+    // forgets unsaved writes and deletes the stored copy, what unlink()
+    // does short of taking the node out of the tree; node must be locked
+    // by the caller
+    void discardNode(NodeT* node);
+    // rmdir() of a directory that isn't empty removes it all instead of
+    // failing with ENOTEMPTY
+    void allowTreeRemoval(bool allow) { _treeRemoval = allow; }
+    // the journal finds files by path, so a renamed file with unsaved
+    // writes needs its entry saved again; node must be locked by the caller
+    void rejournal(NodeT* node);
+
+    // keep file contents under "dir", using at most "capacity" bytes
+    bool openCache(const std::string& dir, uint64_t capacity);
+    // closed files are journaled here and uploaded by "threads" workers;
+    // without a journal, or with no threads, close() uploads itself
+    bool openJournal(const std::string& dir);
+    void startWriteback(size_t threads);
+    // queues whatever a previous mount didn't get to upload
+    int replayJournal();
+    // fetches files a directory scan is about to open into the content
+    // cache, "budget" bytes at a time and "rate" bytes a second at most
+    void startPrefetch(uint64_t budget, uint64_t rate);
 
     int parseFilesystem();
+    // starts from the tree "file" saved at the last unmount instead of
+    // asking the server, false if there's no usable snapshot; the file is
+    // remembered for storeSnapshot() either way
+    bool restoreSnapshot(const std::string& file);
+    int storeSnapshot();
+    // brings a restored tree up to date in the background: mailboxes
+    // added or removed elsewhere, then every listed directory
+    void startRevalidation();
+    void revalidate();
+    // follows changes other clients make on a connection of its own, IDLE
+    // (NOTIFY for all of them if the server has it) on the directory listed
+    // last, and passes what they invalidate on to "invalidate" if set
+    void startWatcher();
+    void setInvalidator(InvalidateT invalidate);
+    // NOTIFY is set up, so changes to files anywhere get invalidated and
+    // not just in the directory listed last (mailboxes coming and going
+    // don't, NOTIFY only covers messages)
+    bool watchingAll() const { return _watchingAll; }
+    void watchLoop();
+    // refreshes the directory "mailbox" backs if it's been listed
+    void refreshMailbox(const std::string& mailbox);
+    // parseFilesystem() in pieces: an empty tree, the filesystem's
+    // mailboxes by path, and their directories (tree lock held for writing)
+    void resetRoot();
+    // "known" (path -> mailbox, say from a snapshot) is trusted rather than
+    // probed again; "background" leaves connections for FUSE requests
+    int discoverMailboxes(std::map<std::string, std::string>& found,
+                          const std::map<std::string, std::string>& known = std::map<std::string, std::string>(),
+                          bool background = false);
+    // every mailbox of the filesystem on the server, by LIST
+    std::vector<std::string> listMailboxes(ConnectionT& conn);
+    // path of the directory "mailbox" backs, from its first message
+    std::string probeMailbox(ConnectionT& conn, const std::string& mailbox);
+    void addMailboxes(const std::map<std::string, std::string>& found);
+
+    // fills in a directory's files the first time; with "refresh" it also
+    // picks up what other clients changed since, at the cost of a STATUS.
+    // What a kernel may have cached of the old listing goes into "changes"
+    int loadDirectory(NodeT* node, bool refresh = false, std::vector<InvalidationT>* changes = NULL);
+    void forget(ino_t ino, unsigned long count);
 
-    NodeT* findNode(const std::string& path);
+    // these take the tree lock themselves, the returned node stays valid
+    // even if it's unlinked while the caller is still using it
+    std::shared_ptr<NodeT> findNode(const std::string& path);
+    std::shared_ptr<NodeT> findNode(ino_t ino);
+    std::shared_ptr<NodeT> findChild(NodeT* parent, const std::string& name);
+    // a copy of node->_path, which a rename may be rewriting
+    std::string pathOf(NodeT* node);
     NodeT* findParent(const std::string& path);
-    std::shared_ptr<vmime::net::folder> findFolder(const std::string& path);
+    std::string findMailbox(const std::string& path);
     
     const std::string& host() { return _host; }
     
     std::string canonicalHost();
 
-    void rebuildFolder(NodeT* in, std::shared_ptr<vmime::net::folder> folder);
-    void rebuildFolders(NodeT* node, std::shared_ptr<vmime::net::folder> folder);
-    void rebuildMessage(NodeT* in, std::shared_ptr<vmime::net::folder> folder, std::shared_ptr<vmime::net::message> message);
-    void rebuildMessages(NodeT* node, std::shared_ptr<vmime::net::folder> folder);
+    // a listing from the start, and a file being read from the start; a
+    // few files opened in listing order get the next ones prefetched
+    void noteListing(NodeT* dir);
+    void noteOpen(NodeT* node);
+    // pulls whole (uid, size) files of "mailbox" into the content cache
+    void prefetchFiles(const std::string& mailbox, const std::vector<std::pair<std::string, off_t>>& files);
+    // queues [start, end) of the server copy to be fetched into the cache
+    // ahead of a sequential reader; node must be locked by the caller
+    void readAhead(NodeT* node, off_t start, off_t end);
+    void prefetchRanges(const std::vector<StoredRangeT>& ranges);
+
+    // the rebuild* functions expect the tree lock to be held for writing
+    void rebuildFolder(NodeT* in, const std::string& mailbox);
+    void rebuildMessage(NodeT* in, const std::string& mailbox, std::shared_ptr<vmime::net::message> message);
+    // a file already there under "name" is replaced if "uid" is newer and
+    // nobody is using it, that's another client having rewritten it
+    void fileNode(NodeT* in, const std::string& mailbox, const std::string& name, const std::string& uid,
+                  off_t size, time_t mtime, off_t chunkSize);
+    std::vector<std::shared_ptr<vmime::net::message>> fetchMessages(std::shared_ptr<vmime::net::folder> folder);
+    // the few header fields a listing needs for "set", \Deleted ones included
+    std::vector<std::shared_ptr<vmime::net::message>> fetchMessages(std::shared_ptr<vmime::net::folder> folder,
+                                                                    const vmime::net::messageSet& set);
+    // UIDs of every file in the folder, without their headers
+    std::set<std::string> liveUIDs(std::shared_ptr<vmime::net::folder> folder);
     
+    // node must be locked by the caller
+    int syncNode(NodeT* node);
+    // what release() does once a file's writes are over: journal it for
+    // write-back, or upload it now; node must be locked by the caller
+    int finishWrites(std::shared_ptr<NodeT> node);
+    // the write-back worker's half of release()
+    bool writeBack(std::shared_ptr<NodeT> node);
+    std::string journalName(NodeT* node);
+    // notes which chunks [start, end) touches, "oldSize" being the size
+    // before the write; node must be locked by the caller
+    void markDirty(NodeT* node, off_t start, off_t end, off_t oldSize);
+    // reads from the server (or the content cache), whole file or chunks
+    ssize_t readNode(NodeT* node, char* buf, size_t size, off_t offset, off_t fileSize);
+    // node contents, the write buffer where it has data and the server
+    // copy everywhere else
+    ssize_t readMerged(NodeT* node, char* buf, size_t size, off_t offset);
+    // copies whatever the buffer is missing in [start, end) from the
+    // server copy, so it can be uploaded
+    int fillGaps(NodeT* node, off_t start, off_t end);
+    // fills in the chunk list of a chunked file, "conn" is only
+    // acquired if the manifest isn't cached
+    int loadManifest(NodeT* node, std::unique_ptr<ConnectionT>& conn);
+
+    // one stored message (a small file or one chunk), "size" bytes long
+    ssize_t readStored(std::unique_ptr<ConnectionT>& conn, const std::string& mailbox, const std::string& uid,
+                       BodyLayoutT& layout, off_t storedSize, char* buf, size_t size, off_t offset);
+    void dropChunks(ConnectionT& conn, const std::vector<std::string>& uids);
+    // ExpungeQueueT's flush: UID EXPUNGE where the server has it, a plain
+    // EXPUNGE of the whole mailbox where it doesn't
+    bool expungeBatch(const std::string& mailbox, const std::vector<std::string>& uids);
+    // copies [base, base + size) of "buffer" into the cache under "key"
+    void cacheBuffer(const CacheKeyT& key, const WriteBufferT& buffer, off_t base, off_t size);
+
+    // hash -> UID for everything in the chunk mailbox
+    int loadChunkIndex();
+    // one mark and sweep over every manifest, expunging unreferenced chunks;
+    // mailboxes unchanged since the last sweep aren't searched again
+    int collectChunks();
+    // runs loadChunkIndex() and then collectChunks() periodically until
+    // we're destroyed
+    void startCollector();
+    void collectorLoop();
+
+    std::shared_ptr<vmime::message> buildMessage(const std::string& subject);
+    // header fields of a file (or chunk) message
+    std::string fileHeader(const std::string& subject, uint64_t size, const std::string& hash);
+    // streams a file message into "folder", returns its UID or "" if the
+    // source failed part way
+    std::string appendFile(std::shared_ptr<vmime::net::folder> folder, const std::string& subject,
+                           const std::string& hash, SourceT source, uint64_t size);
+    // appends all of "files" to "mailbox", in one MULTIAPPEND if the server
+    // has it and one APPEND each otherwise; their UIDs in the same order,
+    // or none at all if any of them failed
+    std::vector<std::string> appendFiles(ConnectionT& conn, const std::string& mailbox,
+                                         const std::vector<PendingFileT>& files);
+    std::shared_ptr<vmime::message> buildManifestMessage(const std::string& filename, off_t size,
+                                                         const ManifestT& manifest);
+
+    // UIDVALIDITY last seen for "mailbox", 0 if we haven't selected it yet
+    uint32_t uidValidity(const std::string& mailbox);
+    void setUIDValidity(const std::string& mailbox, uint32_t validity);
+    SyncStateT syncState(const std::string& mailbox);
+    void setSyncState(const std::string& mailbox, const SyncStateT& state);
+    // the server's idea of "folder" right now, one STATUS
+    SyncStateT folderState(std::shared_ptr<vmime::net::folder> folder);
     
     std::string _host;
     unsigned short _port;
     std::string _authuser;
     std::string _password;
-    NodeT* _root;
-    std::map<std::string, std::shared_ptr<vmime::net::folder>> _fsMap;
-    std::shared_ptr<vmime::net::session> _session;
-    std::shared_ptr<vmime::net::imap::IMAPStore> _store;
+    std::string _url;
+    // guards _nodes (structure, names, stats) and _fsMap
+    RWLockT _lock;
+    InodeTableT _nodes;
+    // filesystem path -> mailbox name
+    std::map<std::string, std::string> _fsMap;
+    // mailbox name -> what we last saw of it, guarded by _lock
+    std::map<std::string, SyncStateT> _syncState;
+    ConnectionPoolT _pool;
+    ContentCacheT _cache;
+    ChunkIndexT _chunkIndex;
+    // mailbox -> what the last sweep found in it, only the collector uses it
+    std::map<std::string, ChunkRefsT> _chunkRefs;
+    JournalT _journal;
+    WritebackT _writeback;
+    // deleteMessages() goes through here instead of expunging every time
+    ExpungeQueueT _expunges;
+    PrefetcherT _prefetcher;
+    // directory inode -> scan in progress, guarded by _scanMutex
+    std::map<ino_t, ScanT> _scans;
+    std::mutex _scanMutex;
+    std::thread _collector;
+    std::thread _revalidator;
+    // the watcher's own connection, IDLE ties it up
+    ConnectionPoolT _watchPool;
+    std::thread _watcher;
+    // mailbox of the directory listed last, what the watcher IDLEs on
+    // without NOTIFY; guarded by _collectorMutex like _stopping
+    std::string _watched;
+    InvalidateT _invalidate;
+    std::atomic<bool> _watchingAll;
+    bool _treeRemoval;
+    std::string _snapshotFile;
+    std::mutex _collectorMutex;
+    std::condition_variable _collectorWake;
+    bool _stopping;
     char _seperator;
 };
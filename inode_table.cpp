@@ -0,0 +1,213 @@
+#include <cstdlib>
+#include <cstdint>
+
+#include <algorithm>
+
+#include "inode_table.h"
+
+using namespace std;
+
+// FUSE always hands us the root as inode 1
+static const ino_t ROOT_INO = 1;
+// inodes below this are handed out locally (for nodes we don't have a UID
+// for yet), everything above is derived from mailbox and UID
+static const ino_t DERIVED_INO = 1ULL << 32;
+
+InodeTableT::InodeTableT():
+    _root(NULL), _nextIno(ROOT_INO + 1), _nextCookie(1)
+{ }
+
+InodeTableT::~InodeTableT()
+{
+    clear();
+}
+
+NodeT* InodeTableT::setRoot(const string& name)
+{
+    clear();
+    NodeT* n = new NodeT(name);
+    n->_path = "/";
+    n->_ino = n->_stat.st_ino = ROOT_INO;
+    _byIno[n->_ino] = shared_ptr<NodeT>(n);
+    _byPath[n->_path] = n;
+    _root = n;
+    return n;
+}
+
+NodeT* InodeTableT::find(const string& path) const
+{
+    unordered_map<string, NodeT*>::const_iterator iter = _byPath.find(path);
+    if (iter == _byPath.end()) {
+        return NULL;
+    }
+    return iter->second;
+}
+
+NodeT* InodeTableT::find(ino_t ino) const
+{
+    unordered_map<ino_t, shared_ptr<NodeT>>::const_iterator iter = _byIno.find(ino);
+    if (iter == _byIno.end()) {
+        return NULL;
+    }
+    return iter->second.get();
+}
+
+NodeT* InodeTableT::child(const NodeT* parent, const string& name) const
+{
+    unordered_map<string, NodeT*>::const_iterator iter = parent->_index.find(name);
+    if (iter == parent->_index.end()) {
+        return NULL;
+    }
+    return iter->second;
+}
+
+NodeT* InodeTableT::create(NodeT* parent, const string& name, bool* created, ino_t ino)
+{
+    NodeT* n = child(parent, name);
+    if (created) {
+        *created = (n == NULL);
+    }
+    if (n) {
+        return n;
+    }
+
+    while (!ino || _byIno.find(ino) != _byIno.end()) {
+        if (_nextIno >= DERIVED_INO) {
+            _nextIno = ROOT_INO + 1;
+        }
+        ino = _nextIno++;
+    }
+    n = new NodeT(name);
+    n->_path = childPath(parent, name);
+    n->_ino = n->_stat.st_ino = ino;
+    n->_parent = parent;
+    n->_cookie = _nextCookie++;
+    parent->_children.push_back(n);
+    parent->_index[name] = n;
+
+    _byIno[n->_ino] = shared_ptr<NodeT>(n);
+    _byPath[n->_path] = n;
+    return n;
+}
+
+void InodeTableT::unlink(NodeT* n)
+{
+    NodeT* parent = n->_parent;
+    if (!parent) {
+        return;
+    }
+    // the rest keep their order, a listing in progress relies on it
+    parent->_children.erase(parent->_children.begin() + slot(n));
+    parent->_index.erase(n->_name);
+    n->_parent = NULL;
+}
+
+void InodeTableT::erase(NodeT* n)
+{
+    while (!n->_children.empty()) {
+        erase(n->_children.back());
+    }
+    unlink(n);
+    if (n == _root) {
+        _root = NULL;
+    }
+    _byPath.erase(n->_path);
+    if (n->_nlookup) {
+        // kernel still has a reference, forget() will finish the job
+        return;
+    }
+    // this deletes the node, so it has to come last
+    _byIno.erase(n->_ino);
+}
+
+void InodeTableT::move(NodeT* n, NodeT* parent, const string& name)
+{
+    unlink(n);
+    n->_name = name;
+    n->_parent = parent;
+    n->_cookie = _nextCookie++;
+    parent->_children.push_back(n);
+    parent->_index[name] = n;
+    repath(n);
+}
+
+void InodeTableT::repath(NodeT* n)
+{
+    unordered_map<string, NodeT*>::iterator iter = _byPath.find(n->_path);
+    if (iter != _byPath.end() && iter->second == n) {
+        _byPath.erase(iter);
+    }
+    n->_path = childPath(n->_parent, n->_name);
+    _byPath[n->_path] = n;
+    for (vector<NodeT*>::iterator c = n->_children.begin(); c != n->_children.end(); ++c) {
+        repath(*c);
+    }
+}
+
+size_t InodeTableT::seek(const NodeT* dir, uint64_t cookie)
+{
+    vector<NodeT*>::const_iterator iter =
+        upper_bound(dir->_children.begin(), dir->_children.end(), cookie,
+                    [](uint64_t c, const NodeT* n) { return c < n->_cookie; });
+    return iter - dir->_children.begin();
+}
+
+void InodeTableT::forget(NodeT* n, unsigned long count)
+{
+    n->_nlookup = (count > n->_nlookup) ? 0 : n->_nlookup - count;
+    if (n->_nlookup || n == _root) {
+        return;
+    }
+    // only nodes that have already been erased from the tree are freed here
+    if (!n->_parent && find(n->_path) != n) {
+        _byIno.erase(n->_ino);
+    }
+}
+
+ino_t InodeTableT::makeIno(const string& mailbox, const string& uid)
+{
+    // FNV-1a over the mailbox name picks the upper 32 bits, UID is the rest
+    uint32_t h = 2166136261U;
+    for (string::const_iterator iter = mailbox.begin(); iter != mailbox.end(); ++iter) {
+        h ^= static_cast<unsigned char>(*iter);
+        h *= 16777619U;
+    }
+    if (!h) {
+        h = 1;
+    }
+    return (static_cast<ino_t>(h) << 32) | strtoul(uid.c_str(), NULL, 10);
+}
+
+void InodeTableT::clear()
+{
+    _byPath.clear();
+    _byIno.clear();
+    _root = NULL;
+    _nextIno = ROOT_INO + 1;
+}
+
+string childPath(const NodeT* parent, const string& name)
+{
+    if (parent->_path == "/") {
+        return "/" + name;
+    }
+    return parent->_path + "/" + name;
+}
+
+string leafName(const string& path)
+{
+    string::size_type pos = path.rfind('/');
+    if (pos == string::npos) {
+        return path;
+    }
+    return path.substr(pos + 1);
+}
+
+string parentPath(const string& path)
+{
+    string::size_type pos = path.rfind('/');
+    if (pos == string::npos || pos == 0) {
+        return "/";
+    }
+    return path.substr(0, pos);
+}
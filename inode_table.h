@@ -0,0 +1,141 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <cstring>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <vmime/vmime.hpp>
+
+#include "body_range.h"
+#include "extent_map.h"
+#include "manifest.h"
+#include "prefetcher.h"
+#include "write_buffer.h"
+
+// The tree structure, names and _stat are guarded by the owner's tree lock;
+// _mutex serializes I/O on a single node (contents, _uid, _flags), and may
+// be held across network round trips.  Take _mutex before the tree lock.
+struct NodeT: public std::enable_shared_from_this<NodeT> {
+    NodeT(const std::string& name, const std::string& uid):
+        _name(name), _uid(uid), _ino(0), _nlookup(0), _flags(0L), _removing(false), _parent(NULL), _cookie(0), _baseSize(0) {
+        memset(&_stat, 0, sizeof(struct stat));
+    }
+    NodeT(const std::string& name): NodeT(name, "0") { }
+    NodeT(): NodeT("") { }
+
+    const std::string& name() { return _name; }
+    const std::string& path() { return _path; }
+    const std::string& uid() { return _uid; }
+
+    std::string _name;
+    // full path from the root, this is what the inode table hashes on
+    std::string _path;
+    std::string _uid;
+    ino_t _ino;
+    // how many references the kernel holds through lookup(), see forget()
+    unsigned long _nlookup;
+    unsigned long _flags;
+    // directory being deleted by rmdir(), nothing may be created in it;
+    // guarded by the tree lock, unlike _flags
+    bool _removing;
+    struct stat _stat;
+
+    NodeT* _parent;
+    // readdir offset of the entry after us, increasing along
+    // _parent->_children and never reused, so a listing picks up where it
+    // left off whatever was removed from the directory in between
+    uint64_t _cookie;
+    std::vector<NodeT*> _children;
+    std::unordered_map<std::string, NodeT*> _index;
+
+    // IMAP mailbox holding this node (or, for directories, backing it)
+    std::string _mailbox;
+    std::mutex _mutex;
+    // where the file lives inside message _uid, reset whenever _uid changes
+    BodyLayoutT _layout;
+    // chunk list for files stored as a manifest, see manifest.h
+    ManifestT _manifest;
+    std::string _text;
+    // what's been written, at the offsets it was written to; _extents says
+    // which parts of it hold data, everything else below _baseSize (the
+    // size of what message _uid stores) is still only on the server
+    WriteBufferT _buffer;
+    ExtentMapT _extents;
+    off_t _baseSize;
+    ReadAheadT _readAhead;
+
+private:
+    // nodes live in exactly one place, the inode table, and are only ever
+    // handed around by pointer
+    NodeT(const NodeT&);
+    NodeT& operator = (const NodeT&);
+};
+
+// Flat table of every node in the filesystem.  Nodes are allocated once
+// and stay at the same address, so lookups by full path or by inode number
+// are a single hash probe and don't allocate.  Nodes are reference counted
+// so a worker thread can keep using one after it's been erased from the
+// table.  Children are kept in a vector in creation order, see _cookie,
+// plus a name index for lookups by name.
+class InodeTableT {
+public:
+    InodeTableT();
+    ~InodeTableT();
+
+    NodeT* root() const { return _root; }
+    NodeT* setRoot(const std::string& name);
+
+    NodeT* find(const std::string& path) const;
+    NodeT* find(ino_t ino) const;
+    NodeT* child(const NodeT* parent, const std::string& name) const;
+
+    // returns the existing child called "name", or creates an empty one;
+    // "created" tells the caller whether it needs to fill in the new node.
+    // "ino" is the inode number we'd like it to have, see makeIno()
+    NodeT* create(NodeT* parent, const std::string& name, bool* created = NULL, ino_t ino = 0);
+
+    // removes the node and everything below it from the tree; nodes the
+    // kernel still knows about stay reachable by inode until forgotten
+    void erase(NodeT* node);
+    // moves the node and everything below it to "name" in "parent", which
+    // mustn't have a child of that name
+    void move(NodeT* node, NodeT* parent, const std::string& name);
+    void clear();
+
+    // index in dir->_children of the first child past readdir offset
+    // "cookie", 0 being the start of the listing
+    static size_t seek(const NodeT* dir, uint64_t cookie);
+    // index of the node in its parent's _children
+    static size_t slot(const NodeT* node) { return seek(node->_parent, node->_cookie - 1); }
+
+    // drops "count" kernel references, freeing the node if it was erased
+    void forget(NodeT* node, unsigned long count);
+
+    // stable inode number for a message (or a mailbox, with uid "0"), so
+    // the same file gets the same inode across remounts
+    static ino_t makeIno(const std::string& mailbox, const std::string& uid);
+
+    size_t size() const { return _byIno.size(); }
+
+private:
+    void unlink(NodeT* node);
+    // re-registers the node and everything below it under its new path
+    void repath(NodeT* node);
+
+    NodeT* _root;
+    ino_t _nextIno;
+    uint64_t _nextCookie;
+    std::unordered_map<std::string, NodeT*> _byPath;
+    std::unordered_map<ino_t, std::shared_ptr<NodeT>> _byIno;
+};
+
+std::string childPath(const NodeT* parent, const std::string& name);
+std::string leafName(const std::string& path);
+std::string parentPath(const std::string& path);
@@ -0,0 +1,221 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fstream>
+#include <sstream>
+
+#include "log.h"
+#include "fs_log.h"
+#include "journal.h"
+
+using namespace std;
+
+static const string JOURNAL_MAGIC = "imapfs-journal 1";
+static const char* ENTRY_SUFFIX = ".j";
+// how much data we move between buffer and journal at once
+static const size_t COPY_PIECE = 1024 * 1024;
+
+static int writeAll(int fd, const char* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = ::write(fd, buf + done, size - done);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+bool JournalT::open(const string& dir)
+{
+    string::size_type pos = 0;
+    while ((pos = dir.find('/', pos + 1)) != string::npos) {
+        ::mkdir(dir.substr(0, pos).c_str(), 0700);
+    }
+    if (::mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        LOGFN(LOG, CRIT) << "can't create journal directory " << dir;
+        return false;
+    }
+    _dir = dir;
+    return true;
+}
+
+string JournalT::entryPath(const string& name) const
+{
+    return _dir + "/" + name + ENTRY_SUFFIX;
+}
+
+int JournalT::save(const string& name, const string& path, const string& uid, off_t size,
+                   off_t baseSize, const ExtentMapT& extents, const WriteBufferT& buffer)
+{
+    if (!isOpen()) {
+        return -ENOSYS;
+    }
+    vector<ExtentMapT::RangeT> ranges = extents.ranges();
+    stringstream ss;
+    ss << JOURNAL_MAGIC << "\n"
+       << "path " << path << "\n"
+       << "uid " << uid << "\n"
+       << "size " << size << "\n"
+       << "base " << baseSize << "\n"
+       << "extents " << ranges.size() << "\n";
+    for (vector<ExtentMapT::RangeT>::iterator iter = ranges.begin(); iter != ranges.end(); ++iter) {
+        ss << iter->first << " " << iter->second << "\n";
+    }
+    ss << "\n";
+    string head = ss.str();
+
+    // new entry next to the old one, then renamed over it, so a crash
+    // leaves one of them whole
+    string tmp = entryPath(name) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGFN(LOG, CRIT) << "can't write journal entry " << tmp << ": " << strerror(errno);
+        return -errno;
+    }
+    int err = writeAll(fd, head.data(), head.length());
+    vector<char> piece;
+    for (vector<ExtentMapT::RangeT>::iterator iter = ranges.begin(); iter != ranges.end() && !err; ++iter) {
+        for (off_t at = iter->first; at < iter->second && !err; at += piece.size()) {
+            piece.resize(min(iter->second - at, static_cast<off_t>(COPY_PIECE)));
+            ssize_t r = buffer.pread(piece.data(), piece.size(), at);
+            if (r < 0) {
+                err = r;
+            }
+            else {
+                // short means a hole at the end of the buffer
+                memset(piece.data() + r, 0, piece.size() - r);
+                err = writeAll(fd, piece.data(), piece.size());
+            }
+        }
+    }
+    if (!err && ::fsync(fd)) {
+        err = -errno;
+    }
+    ::close(fd);
+    if (!err && ::rename(tmp.c_str(), entryPath(name).c_str())) {
+        err = -errno;
+    }
+    if (err) {
+        ::unlink(tmp.c_str());
+        LOGFN(LOG, CRIT) << "journal entry for " << path << " not written: " << strerror(-err);
+        return err;
+    }
+    // the rename only sticks once the directory is synced too
+    int dfd = ::open(_dir.c_str(), O_RDONLY);
+    if (dfd >= 0) {
+        ::fsync(dfd);
+        ::close(dfd);
+    }
+    return 0;
+}
+
+void JournalT::remove(const string& name)
+{
+    if (isOpen()) {
+        ::unlink(entryPath(name).c_str());
+    }
+}
+
+vector<JournalEntryT> JournalT::entries()
+{
+    vector<JournalEntryT> ret;
+    if (!isOpen()) {
+        return ret;
+    }
+    DIR* d = opendir(_dir.c_str());
+    if (!d) {
+        return ret;
+    }
+    struct dirent* de;
+    while ((de = readdir(d))) {
+        string file(de->d_name);
+        size_t suffix = strlen(ENTRY_SUFFIX);
+        if (file.length() <= suffix || file.compare(file.length() - suffix, suffix, ENTRY_SUFFIX) != 0) {
+            continue;
+        }
+        JournalEntryT e;
+        e._name = file.substr(0, file.length() - suffix);
+        ifstream in(entryPath(e._name).c_str(), ios::binary);
+        string line;
+        if (!getline(in, line) || line != JOURNAL_MAGIC) {
+            LOGFN(LOG, CRIT) << "ignoring bad journal entry " << file;
+            continue;
+        }
+        size_t count = 0;
+        while (getline(in, line) && !line.empty()) {
+            string::size_type sp = line.find(' ');
+            string key = line.substr(0, sp);
+            string value = (sp == string::npos) ? "" : line.substr(sp + 1);
+            if (key == "path") {
+                e._path = value;
+            }
+            else if (key == "uid") {
+                e._uid = value;
+            }
+            else if (key == "size") {
+                e._size = atoll(value.c_str());
+            }
+            else if (key == "base") {
+                e._baseSize = atoll(value.c_str());
+            }
+            else if (key == "extents") {
+                count = atol(value.c_str());
+                for (size_t i = 0; i < count && getline(in, line); ++i) {
+                    stringstream ss(line);
+                    ExtentMapT::RangeT r;
+                    ss >> r.first >> r.second;
+                    e._ranges.push_back(r);
+                }
+            }
+        }
+        if (e._path.empty() || e._ranges.size() != count) {
+            LOGFN(LOG, CRIT) << "ignoring truncated journal entry " << file;
+            continue;
+        }
+        e._dataOffset = in.tellg();
+        ret.push_back(e);
+    }
+    closedir(d);
+    return ret;
+}
+
+int JournalT::load(const JournalEntryT& entry, WriteBufferT& buffer, ExtentMapT& extents)
+{
+    int fd = ::open(entryPath(entry._name).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    off_t from = entry._dataOffset;
+    vector<char> piece;
+    int err = 0;
+    for (vector<ExtentMapT::RangeT>::const_iterator iter = entry._ranges.begin(); iter != entry._ranges.end() && !err; ++iter) {
+        for (off_t at = iter->first; at < iter->second && !err; at += piece.size()) {
+            piece.resize(min(iter->second - at, static_cast<off_t>(COPY_PIECE)));
+            if (::pread(fd, piece.data(), piece.size(), from) != static_cast<ssize_t>(piece.size())) {
+                err = -EIO;
+                break;
+            }
+            ssize_t r = buffer.pwrite(piece.data(), piece.size(), at);
+            if (r < 0) {
+                err = r;
+            }
+            from += piece.size();
+        }
+        if (!err) {
+            extents.add(iter->first, iter->second);
+        }
+    }
+    ::close(fd);
+    return err;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "extent_map.h"
+#include "write_buffer.h"
+
+// one file's unsynced writes, as found in the journal
+struct JournalEntryT {
+    JournalEntryT(): _size(0), _baseSize(0), _dataOffset(0) { }
+
+    std::string _name;
+    std::string _path;
+    // the message the writes go on top of, "0" for a new file
+    std::string _uid;
+    off_t _size;
+    off_t _baseSize;
+    std::vector<ExtentMapT::RangeT> _ranges;
+    // where the written bytes start in the entry file
+    off_t _dataOffset;
+};
+
+// Writes that have been acknowledged to the application (the file was
+// closed) but not uploaded yet.  Each dirty file gets one entry holding
+// its written ranges, fsync()ed before close() returns, and dropped
+// again once the upload is done.  Entries found at mount time are
+// replayed.
+class JournalT {
+public:
+    bool open(const std::string& dir);
+    bool isOpen() const { return !_dir.empty(); }
+
+    // replaces whatever "name" had with the current dirty state
+    int save(const std::string& name, const std::string& path, const std::string& uid, off_t size,
+             off_t baseSize, const ExtentMapT& extents, const WriteBufferT& buffer);
+    void remove(const std::string& name);
+
+    // everything left behind by a previous mount
+    std::vector<JournalEntryT> entries();
+    // copies an entry's written ranges into "buffer" and "extents"
+    int load(const JournalEntryT& entry, WriteBufferT& buffer, ExtentMapT& extents);
+
+private:
+    std::string entryPath(const std::string& name) const;
+
+    std::string _dir;
+};
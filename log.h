@@ -16,8 +16,10 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
 
-// ARGH not thread-safe... LAM
+// messages are built up in a per-thread stream and written out under a
+// lock, so LOG() is safe to use from the FUSE worker threads
 
 typedef enum {
     EMERG = LOG_EMERG,
@@ -77,14 +79,16 @@ public:
     virtual ~LogCollector() { }
     
     virtual int output() {
-        std::cerr << _os.str() << std::endl;
-        _os.str(std::string());
+        std::string s = os().str();
+        os().str(std::string());
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::cerr << s << std::endl;
         return 0;
     }
     
     std::ostringstream& get(LogLevelE level = INFO) {
-        _os << tag() << timestamp() << " " << level_string(level);
-        return _os;
+        os() << tag() << timestamp() << " " << level_string(level);
+        return os();
     }
     
     static std::string level_string(LogLevelE level) {
@@ -99,7 +103,12 @@ public:
     const std::string& tag() const { return _tag; }
 
 protected:
-    std::ostringstream _os;
+    static std::ostringstream& os() {
+        static thread_local std::ostringstream _os;
+        return _os;
+    }
+
+    std::mutex _mutex;
     std::string _tag;
 };
 
@@ -110,7 +119,7 @@ public:
     {}
     virtual ~NullCollector() { }
 
-    virtual int output() { return 0;  }
+    virtual int output() { os().str(std::string()); return 0;  }
 };
 
 class fdoutbuf: public std::streambuf {
@@ -162,9 +171,11 @@ public:
     virtual ~LogFileCollector();
     
     virtual int output() {
-        _fos << _os.str() << std::endl;
+        std::string s = os().str();
+        os().str(std::string());
+        std::lock_guard<std::mutex> lock(_mutex);
+        _fos << s << std::endl;
         _fos.flush();
-        _os.str(std::string());
         return 0;
     }
 
@@ -298,7 +309,8 @@ inline std::string timestamp()
 {
     struct timeval tod;
     gettimeofday(&tod, NULL);
-    struct tm* t = localtime(&tod.tv_sec);
+    struct tm tm;
+    struct tm* t = localtime_r(&tod.tv_sec, &tm);
     char buffer[256];
     // YYYYMMDD-HH:MM:SS.mmm
     snprintf(buffer, sizeof(buffer), "%4d%02d%02d %02d:%02d:%02d%s%03d"
@@ -0,0 +1,58 @@
+#include <sstream>
+
+#include "log.h"
+#include "fs_log.h"
+#include "manifest.h"
+
+using namespace std;
+
+const string FS_CHUNKSIZE_HEADER = "X-FS-Chunk-Size";
+const string FS_CHUNKHASH_HEADER = "X-FS-Chunk-Hash";
+const string HOLE_UID = "0";
+const size_t CHUNK_SIZE = 4 * 1024 * 1024;
+
+// one line per chunk, "chunk <uid> [<hash>]", short enough that the body
+// never gets re-encoded
+static const string CHUNK_TAG = "chunk ";
+
+string formatManifest(const ManifestT& manifest)
+{
+    stringstream ss;
+    for (size_t i = 0; i < manifest._chunks.size(); ++i) {
+        ss << CHUNK_TAG << manifest._chunks[i];
+        if (i < manifest._hashes.size() && !manifest._hashes[i].empty()) {
+            ss << " " << manifest._hashes[i];
+        }
+        ss << "\r\n";
+    }
+    return ss.str();
+}
+
+bool parseManifest(const string& raw, ManifestT& manifest)
+{
+    manifest._chunks.clear();
+    manifest._hashes.clear();
+    stringstream ss(raw);
+    string line;
+    while (getline(ss, line)) {
+        if (!line.empty() && line[line.length() - 1] == '\r') {
+            line.erase(line.length() - 1);
+        }
+        if (line.compare(0, CHUNK_TAG.length(), CHUNK_TAG) != 0) {
+            continue;
+        }
+        stringstream fields(line.substr(CHUNK_TAG.length()));
+        string uid, hash;
+        fields >> uid >> hash;
+        if (uid.empty() || uid.find_first_not_of("0123456789") != string::npos) {
+            LOGFN(LOG, CRIT) << "bad manifest line: " << line;
+            return false;
+        }
+        manifest._chunks.push_back(uid);
+        manifest._hashes.push_back(hash);
+    }
+    manifest._layouts.assign(manifest._chunks.size(), BodyLayoutT());
+    manifest._dirty.clear();
+    manifest._loaded = true;
+    return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "body_range.h"
+
+// Files bigger than one chunk are stored as a manifest message in the
+// directory's mailbox, listing fixed-size chunk messages that live in a
+// shared chunk mailbox.  A rewrite only has to upload the chunks that
+// changed, and a read only has to fetch the chunks it covers.
+struct ManifestT {
+    ManifestT(): _loaded(false), _chunkSize(0) { }
+
+    // 0 for files stored the old way, as a single message
+    bool chunked() const { return _chunkSize != 0; }
+    size_t chunkCount(off_t size) const { return (size + _chunkSize - 1) / _chunkSize; }
+
+    // _chunks has been read from the manifest body
+    bool _loaded;
+    size_t _chunkSize;
+    // UID of each chunk in the chunk mailbox, HOLE_UID reads as zeroes
+    std::vector<std::string> _chunks;
+    // SHA-256 of each chunk, "" for chunks written before we hashed them
+    std::vector<std::string> _hashes;
+    std::vector<BodyLayoutT> _layouts;
+    // chunks written since the last sync
+    std::set<size_t> _dirty;
+};
+
+extern const std::string FS_CHUNKSIZE_HEADER;
+extern const std::string FS_CHUNKHASH_HEADER;
+extern const std::string HOLE_UID;
+// size used for files that get chunked from now on
+extern const size_t CHUNK_SIZE;
+
+// the chunk list as it goes into the manifest's text body
+std::string formatManifest(const ManifestT& manifest);
+// picks the chunk list back out of a manifest message, headers and all
+bool parseManifest(const std::string& raw, ManifestT& manifest);
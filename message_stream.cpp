@@ -0,0 +1,155 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "log.h"
+#include "fs_log.h"
+#include "message_stream.h"
+
+using namespace std;
+using namespace vmime;
+
+static const char* BASE64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+// 57 input bytes make one 76 character line
+static const size_t LINE_INPUT = 57;
+static const size_t LINE_OUTPUT = 76;
+// how much of the source we encode per refill
+static const size_t LINES_PER_READ = 1024;
+
+static void encodeLine(const unsigned char* in, size_t len, string& out)
+{
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        out += BASE64[in[i] >> 2];
+        out += BASE64[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+        out += BASE64[((in[i + 1] & 0x0f) << 2) | (in[i + 2] >> 6)];
+        out += BASE64[in[i + 2] & 0x3f];
+    }
+    if (len - i == 1) {
+        out += BASE64[in[i] >> 2];
+        out += BASE64[(in[i] & 0x03) << 4];
+        out += "==";
+    }
+    else if (len - i == 2) {
+        out += BASE64[in[i] >> 2];
+        out += BASE64[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+        out += BASE64[(in[i + 1] & 0x0f) << 2];
+        out += '=';
+    }
+    out += "\r\n";
+}
+
+MessageStreamT::MessageStreamT(const string& header, const string& text, SourceT source, uint64_t size):
+    _source(source), _size(size), _phase(0), _offset(0), _pendingPos(0), _failed(false)
+{
+    // nothing in base64 can start a line with "=_", so this never collides
+    string boundary = "=_imapfs_" + to_string(random());
+    _head = header +
+        "MIME-Version: 1.0\r\n"
+        "Content-Type: multipart/mixed; boundary=\"" + boundary + "\"\r\n"
+        "\r\n"
+        "--" + boundary + "\r\n"
+        "Content-Type: text/plain; charset=us-ascii\r\n"
+        "Content-Transfer-Encoding: 7bit\r\n"
+        "\r\n" +
+        text + "\r\n"
+        "--" + boundary + "\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Transfer-Encoding: base64\r\n"
+        "Content-Disposition: attachment\r\n"
+        "\r\n";
+    _tail = "--" + boundary + "--\r\n";
+}
+
+size_t MessageStreamT::encodedSize(uint64_t size)
+{
+    size_t lines = size / LINE_INPUT;
+    size_t rest = size % LINE_INPUT;
+    size_t total = lines * (LINE_OUTPUT + 2);
+    if (rest) {
+        total += (rest + 2) / 3 * 4 + 2;
+    }
+    return total;
+}
+
+bool MessageStreamT::next()
+{
+    _pending.clear();
+    _pendingPos = 0;
+    switch (_phase) {
+    case 0:
+        _pending = _head;
+        _phase = _size ? 1 : 2;
+        return true;
+    case 1: {
+        size_t want = min(static_cast<uint64_t>(LINE_INPUT * LINES_PER_READ), _size - _offset);
+        string raw(want, '\0');
+        ssize_t r = _source(&raw[0], want, _offset);
+        if (r != static_cast<ssize_t>(want)) {
+            // keep the promised length, the server rejects a short literal
+            // with a confusing error otherwise
+            LOGFN(LOG, CRIT) << "short read from source at " << _offset << ": " << r;
+            _failed = true;
+            fill(raw.begin(), raw.end(), '\0');
+        }
+        _pending.reserve(encodedSize(want));
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(raw.data());
+        for (size_t at = 0; at < want; at += LINE_INPUT) {
+            encodeLine(in + at, min(LINE_INPUT, want - at), _pending);
+        }
+        _offset += want;
+        if (_offset == _size) {
+            _phase = 2;
+        }
+        return true;
+    }
+    case 2:
+        _pending = _tail;
+        _phase = 3;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool MessageStreamT::eof() const
+{
+    return _phase == 3 && _pendingPos == _pending.length();
+}
+
+void MessageStreamT::reset()
+{
+    _phase = 0;
+    _offset = 0;
+    _pending.clear();
+    _pendingPos = 0;
+}
+
+size_t MessageStreamT::read(byte_t* data, const size_t count)
+{
+    size_t done = 0;
+    while (done < count) {
+        if (_pendingPos == _pending.length() && !next()) {
+            break;
+        }
+        size_t n = min(count - done, _pending.length() - _pendingPos);
+        memcpy(data + done, _pending.data() + _pendingPos, n);
+        _pendingPos += n;
+        done += n;
+    }
+    return done;
+}
+
+size_t MessageStreamT::skip(const size_t count)
+{
+    size_t done = 0;
+    while (done < count) {
+        if (_pendingPos == _pending.length() && !next()) {
+            break;
+        }
+        size_t n = min(count - done, _pending.length() - _pendingPos);
+        _pendingPos += n;
+        done += n;
+    }
+    return done;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include <vmime/vmime.hpp>
+
+// Where a MessageStreamT gets the file's bytes from, pread() style
+typedef std::function<ssize_t (char* buf, size_t size, off_t offset)> SourceT;
+
+// A file message (header, warning text, base64 attachment) produced a few
+// kilobytes at a time for folder::addMessage(inputStream&, size).  The
+// attachment is encoded straight from the source as the server asks for
+// it, so appending a big file never needs more than one small buffer, and
+// the exact size is known up front for the APPEND literal.
+class MessageStreamT: public vmime::utility::inputStream {
+public:
+    // "header" is the message's own header fields, CRLF terminated;
+    // the MIME structure around the attachment is added here
+    MessageStreamT(const std::string& header, const std::string& text, SourceT source, uint64_t size);
+
+    // total bytes this stream will produce
+    size_t size() const { return _head.length() + encodedSize(_size) + _tail.length(); }
+
+    bool eof() const;
+    void reset();
+    size_t read(vmime::byte_t* data, const size_t count);
+    size_t skip(const size_t count);
+
+    // the source came up short somewhere, what went out is garbage
+    bool failed() const { return _failed; }
+
+    // base64 with 76 character CRLF terminated lines, what learnLayout()
+    // expects to find
+    static size_t encodedSize(uint64_t size);
+
+private:
+    // refills _pending with the next piece, false at the end
+    bool next();
+
+    std::string _head;
+    std::string _tail;
+    SourceT _source;
+    uint64_t _size;
+    // 0 head, 1 body, 2 tail, 3 done
+    int _phase;
+    uint64_t _offset;
+    std::string _pending;
+    size_t _pendingPos;
+    // set if the source came up short, the APPEND is then doomed anyway
+    bool _failed;
+};
@@ -0,0 +1,117 @@
+#include "log.h"
+#include "fs_log.h"
+#include "prefetcher.h"
+
+using namespace std;
+
+// read-ahead window bounds, it starts small and doubles from there
+static const off_t MIN_WINDOW = 128 * 1024;
+static const off_t MAX_WINDOW = 8 * 1024 * 1024;
+
+PrefetcherT::PrefetcherT():
+    _budget(0), _rate(0), _used(0), _stopping(false)
+{ }
+
+PrefetcherT::~PrefetcherT()
+{
+    stop();
+}
+
+void PrefetcherT::start(size_t threads, uint64_t budget, uint64_t rate)
+{
+    _budget = budget;
+    _rate = rate;
+    _stopping = false;
+    _next = chrono::steady_clock::now();
+    for (size_t i = 0; i < threads; ++i) {
+        _threads.push_back(thread(&PrefetcherT::run, this));
+    }
+}
+
+void PrefetcherT::stop()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+        _queue.clear();
+    }
+    _work.notify_all();
+    for (vector<thread>::iterator iter = _threads.begin(); iter != _threads.end(); ++iter) {
+        iter->join();
+    }
+    _threads.clear();
+}
+
+bool PrefetcherT::enqueue(uint64_t bytes, JobT job)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (_stopping || _threads.empty() || _used + bytes > _budget) {
+            return false;
+        }
+        _used += bytes;
+        _queue.push_back(pair<uint64_t, JobT>(bytes, job));
+    }
+    _work.notify_one();
+    return true;
+}
+
+void PrefetcherT::run()
+{
+    unique_lock<mutex> lock(_mutex);
+    for (;;) {
+        while (_queue.empty() && !_stopping) {
+            _work.wait(lock);
+        }
+        if (_stopping) {
+            return;
+        }
+        pair<uint64_t, JobT> job = _queue.front();
+        _queue.pop_front();
+
+        if (_rate) {
+            // each job books its share of the link in turn
+            chrono::steady_clock::time_point start = max(_next, chrono::steady_clock::now());
+            _next = start + chrono::microseconds(job.first * 1000000 / _rate);
+            while (!_stopping && chrono::steady_clock::now() < start) {
+                _work.wait_until(lock, start);
+            }
+            if (_stopping) {
+                return;
+            }
+        }
+        lock.unlock();
+
+        try {
+            job.second();
+        }
+        catch (std::exception& e) {
+            // only ever an optimisation, the read will fetch it itself
+            LOGFN(LOG, INFO) << "prefetch failed: " << e.what();
+        }
+
+        lock.lock();
+        _used -= job.first;
+    }
+}
+
+bool ReadAheadT::advance(off_t offset, size_t size, off_t fileSize, off_t& start, off_t& end)
+{
+    off_t readEnd = offset + size;
+    if (offset != _next) {
+        _next = readEnd;
+        _window = 0;
+        _fetched = 0;
+        return false;
+    }
+    _next = readEnd;
+    _window = _window ? min(_window * 2, MAX_WINDOW) : MIN_WINDOW;
+    _fetched = max(_fetched, readEnd);
+    if (_fetched - readEnd >= _window / 2 || _fetched >= fileSize) {
+        return false;
+    }
+    start = _fetched;
+    end = min(fileSize, readEnd + _window);
+    _fetched = end;
+    return start < end;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fetches nobody is waiting for yet, run by a couple of background threads
+// so their round trips stay off the reader's path.  Every job says up
+// front how many bytes it will pull; jobs past the memory budget are
+// refused rather than queued, and the workers pace themselves to stay
+// under the bandwidth budget.
+class PrefetcherT {
+public:
+    typedef std::function<void ()> JobT;
+
+    PrefetcherT();
+    ~PrefetcherT();
+
+    // at most "budget" bytes queued or in flight, fetched at no more than
+    // "rate" bytes a second (0 for no limit)
+    void start(size_t threads, uint64_t budget, uint64_t rate);
+    // drops whatever is still queued and waits for the running jobs
+    void stop();
+    bool running() const { return !_threads.empty(); }
+
+    // false, and nothing queued, if "bytes" more would go over budget
+    bool enqueue(uint64_t bytes, JobT job);
+
+private:
+    PrefetcherT(const PrefetcherT&);
+    PrefetcherT& operator = (const PrefetcherT&);
+
+    void run();
+
+    std::mutex _mutex;
+    std::condition_variable _work;
+    std::deque<std::pair<uint64_t, JobT>> _queue;
+    uint64_t _budget;
+    uint64_t _rate;
+    // bytes queued or in flight
+    uint64_t _used;
+    // when the bandwidth budget lets the next job start
+    std::chrono::steady_clock::time_point _next;
+    bool _stopping;
+    std::vector<std::thread> _threads;
+};
+
+// Sequential read detection for one file, the way kernel readahead does
+// it: every read that starts where the last one ended doubles the window
+// (up to a limit), anything else starts over.  The next stretch is asked
+// for while half a window is still left, so it arrives before the reader.
+struct ReadAheadT {
+    ReadAheadT(): _next(0), _window(0), _fetched(0) { }
+
+    // called for every read of [offset, offset + size) of a file whose
+    // stored copy is "fileSize" long; true if [start, end) should be
+    // fetched ahead now
+    bool advance(off_t offset, size_t size, off_t fileSize, off_t& start, off_t& end);
+
+    // where the next sequential read would start
+    off_t _next;
+    off_t _window;
+    // everything before this has been asked for already
+    off_t _fetched;
+};
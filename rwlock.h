@@ -0,0 +1,45 @@
+#pragma once
+
+#include <pthread.h>
+
+// reader/writer lock, many readers or one writer.  Not recursive for
+// writers, so never take the write side while holding the read side.
+class RWLockT {
+public:
+    RWLockT() { pthread_rwlock_init(&_lock, NULL); }
+    ~RWLockT() { pthread_rwlock_destroy(&_lock); }
+
+    void readLock() { pthread_rwlock_rdlock(&_lock); }
+    void writeLock() { pthread_rwlock_wrlock(&_lock); }
+    void unlock() { pthread_rwlock_unlock(&_lock); }
+
+private:
+    RWLockT(const RWLockT&);
+    RWLockT& operator = (const RWLockT&);
+
+    pthread_rwlock_t _lock;
+};
+
+class ReadLockT {
+public:
+    explicit ReadLockT(RWLockT& lock): _lock(lock) { _lock.readLock(); }
+    ~ReadLockT() { _lock.unlock(); }
+
+private:
+    ReadLockT(const ReadLockT&);
+    ReadLockT& operator = (const ReadLockT&);
+
+    RWLockT& _lock;
+};
+
+class WriteLockT {
+public:
+    explicit WriteLockT(RWLockT& lock): _lock(lock) { _lock.writeLock(); }
+    ~WriteLockT() { _lock.unlock(); }
+
+private:
+    WriteLockT(const WriteLockT&);
+    WriteLockT& operator = (const WriteLockT&);
+
+    RWLockT& _lock;
+};
@@ -0,0 +1,171 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <fstream>
+#include <sstream>
+
+#include "log.h"
+#include "fs_log.h"
+#include "snapshot.h"
+
+using namespace std;
+
+// bumped whenever the layout below changes, older snapshots are ignored
+static const char SNAPSHOT_MAGIC[8] = { 'i', 'm', 'f', 's', 's', 'n', 'p', '1' };
+// after the last record, so a torn write can't pass for a short snapshot
+static const uint32_t SNAPSHOT_END = 0x454e4421;
+
+// little helpers for the fixed-width fields, native byte order since a
+// snapshot never leaves the machine that wrote it
+template <typename T> static void put(string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void putString(string& out, const string& s)
+{
+    put<uint32_t>(out, s.length());
+    out.append(s);
+}
+
+class ReaderT {
+public:
+    ReaderT(const string& data, size_t pos): _data(data), _pos(pos), _ok(true) { }
+
+    template <typename T> T get() {
+        T value = T();
+        if (_pos + sizeof(T) > _data.length()) {
+            _ok = false;
+            return value;
+        }
+        memcpy(&value, _data.data() + _pos, sizeof(T));
+        _pos += sizeof(T);
+        return value;
+    }
+    string getString() {
+        uint32_t length = get<uint32_t>();
+        if (!_ok || _pos + length > _data.length()) {
+            _ok = false;
+            return "";
+        }
+        string s = _data.substr(_pos, length);
+        _pos += length;
+        return s;
+    }
+    // a count of records that can't possibly fit in what's left is damage,
+    // not something to allocate for
+    size_t getCount() {
+        uint32_t count = get<uint32_t>();
+        if (count > _data.length() - _pos) {
+            _ok = false;
+            return 0;
+        }
+        return count;
+    }
+    bool ok() const { return _ok; }
+
+private:
+    const string& _data;
+    size_t _pos;
+    bool _ok;
+};
+
+int saveSnapshot(const string& file, const vector<SnapshotDirT>& dirs)
+{
+    string out(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put<uint32_t>(out, dirs.size());
+    for (vector<SnapshotDirT>::const_iterator d = dirs.begin(); d != dirs.end(); ++d) {
+        putString(out, d->_path);
+        putString(out, d->_mailbox);
+        put<uint32_t>(out, d->_uidValidity);
+        put<uint32_t>(out, d->_uidNext);
+        put<uint64_t>(out, d->_highestModSeq);
+        put<uint64_t>(out, d->_count);
+        put<uint8_t>(out, d->_listed);
+        put<uint32_t>(out, d->_files.size());
+        for (vector<SnapshotFileT>::const_iterator f = d->_files.begin(); f != d->_files.end(); ++f) {
+            putString(out, f->_name);
+            putString(out, f->_uid);
+            put<uint64_t>(out, f->_size);
+            put<int64_t>(out, f->_mtime);
+            put<uint64_t>(out, f->_chunkSize);
+        }
+    }
+    put<uint32_t>(out, SNAPSHOT_END);
+
+    // written next to the old one and renamed over it, like the journal
+    string tmp = file + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGFN(LOG, CRIT) << "can't write snapshot " << tmp << ": " << strerror(errno);
+        return -errno;
+    }
+    int err = 0;
+    for (size_t done = 0; done < out.length() && !err; ) {
+        ssize_t r = ::write(fd, out.data() + done, out.length() - done);
+        if (r < 0 && errno != EINTR) {
+            err = -errno;
+        }
+        else if (r > 0) {
+            done += r;
+        }
+    }
+    if (!err && ::fsync(fd)) {
+        err = -errno;
+    }
+    ::close(fd);
+    if (!err && ::rename(tmp.c_str(), file.c_str())) {
+        err = -errno;
+    }
+    if (err) {
+        ::unlink(tmp.c_str());
+        LOGFN(LOG, CRIT) << "snapshot " << file << " not written: " << strerror(-err);
+        return err;
+    }
+    LOGFN(LOG, INFO) << "saved snapshot of " << dirs.size() << " directories, " << out.length() << " bytes";
+    return 0;
+}
+
+int loadSnapshot(const string& file, vector<SnapshotDirT>& dirs)
+{
+    ifstream in(file.c_str(), ios::binary);
+    if (!in) {
+        return -ENOENT;
+    }
+    stringstream ss;
+    ss << in.rdbuf();
+    string data = ss.str();
+    if (data.length() < sizeof(SNAPSHOT_MAGIC) || data.compare(0, sizeof(SNAPSHOT_MAGIC),
+                                                               string(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)))) {
+        LOGFN(LOG, CRIT) << "snapshot " << file << " is from another version, ignoring it";
+        return -EINVAL;
+    }
+
+    ReaderT r(data, sizeof(SNAPSHOT_MAGIC));
+    vector<SnapshotDirT> loaded(r.getCount());
+    for (vector<SnapshotDirT>::iterator d = loaded.begin(); d != loaded.end() && r.ok(); ++d) {
+        d->_path = r.getString();
+        d->_mailbox = r.getString();
+        d->_uidValidity = r.get<uint32_t>();
+        d->_uidNext = r.get<uint32_t>();
+        d->_highestModSeq = r.get<uint64_t>();
+        d->_count = r.get<uint64_t>();
+        d->_listed = r.get<uint8_t>() != 0;
+        d->_files.resize(r.getCount());
+        for (vector<SnapshotFileT>::iterator f = d->_files.begin(); f != d->_files.end() && r.ok(); ++f) {
+            f->_name = r.getString();
+            f->_uid = r.getString();
+            f->_size = r.get<uint64_t>();
+            f->_mtime = r.get<int64_t>();
+            f->_chunkSize = r.get<uint64_t>();
+        }
+    }
+    if (!r.ok() || r.get<uint32_t>() != SNAPSHOT_END) {
+        LOGFN(LOG, CRIT) << "snapshot " << file << " is damaged, ignoring it";
+        return -EINVAL;
+    }
+    dirs.swap(loaded);
+    return 0;
+}
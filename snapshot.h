@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// One file of a listed directory, as much as a listing would have told us
+struct SnapshotFileT {
+    SnapshotFileT(): _size(0), _mtime(0), _chunkSize(0) { }
+
+    std::string _name;
+    std::string _uid;
+    uint64_t _size;
+    int64_t _mtime;
+    // 0 for a file stored as a single message
+    uint64_t _chunkSize;
+};
+
+// One filesystem mailbox, with its files if it had been listed
+struct SnapshotDirT {
+    SnapshotDirT(): _uidValidity(0), _uidNext(0), _highestModSeq(0), _count(0), _listed(false) { }
+
+    std::string _path;
+    std::string _mailbox;
+    uint32_t _uidValidity;
+    uint32_t _uidNext;
+    uint64_t _highestModSeq;
+    uint64_t _count;
+    bool _listed;
+    std::vector<SnapshotFileT> _files;
+};
+
+// The metadata a mount would otherwise rebuild from the server, kept in a
+// compact binary file so the next mount can start from it and revalidate
+// in the background.  Both return 0 or -errno; a snapshot that's
+// truncated or from another version doesn't load at all.
+int saveSnapshot(const std::string& file, const std::vector<SnapshotDirT>& dirs);
+int loadSnapshot(const std::string& file, std::vector<SnapshotDirT>& dirs);
@@ -0,0 +1,169 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
+#include "log.h"
+#include "fs_log.h"
+#include "write_buffer.h"
+
+using namespace std;
+
+static string _spillDirectory;
+
+void WriteBufferT::setSpillDirectory(const string& dir)
+{
+    _spillDirectory = dir;
+}
+
+static string spillDirectory()
+{
+    if (!_spillDirectory.empty()) {
+        return _spillDirectory;
+    }
+    const char* tmp = getenv("TMPDIR");
+    return (tmp && *tmp) ? tmp : "/tmp";
+}
+
+WriteBufferT::WriteBufferT():
+    _fd(-1), _size(0)
+{ }
+
+WriteBufferT::~WriteBufferT()
+{
+    clear();
+}
+
+int WriteBufferT::spill()
+{
+    string dir = spillDirectory();
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+#endif
+    if (fd < 0) {
+        // no O_TMPFILE here, unlink it ourselves right away
+        string name = dir + "/imapfs-XXXXXX";
+        vector<char> path(name.begin(), name.end());
+        path.push_back('\0');
+        fd = mkstemp(path.data());
+        if (fd < 0) {
+            LOGFN(LOG, CRIT) << "can't create spill file in " << dir << ": " << strerror(errno);
+            return -errno;
+        }
+        ::unlink(path.data());
+    }
+    if (_size && ::pwrite(fd, _memory.data(), _size, 0) != _size) {
+        int err = errno ? -errno : -EIO;
+        ::close(fd);
+        return err;
+    }
+    _fd = fd;
+    vector<char>().swap(_memory);
+    return 0;
+}
+
+ssize_t WriteBufferT::pread(char* buf, size_t size, off_t offset) const
+{
+    if (offset >= _size) {
+        return 0;
+    }
+    size = min(static_cast<off_t>(size), _size - offset);
+    if (_fd < 0) {
+        memcpy(buf, _memory.data() + offset, size);
+        return size;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = ::pread(_fd, buf + done, size - done, offset + done);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (r == 0) {
+            // past what was ever written to the spill file, a hole
+            memset(buf + done, 0, size - done);
+            break;
+        }
+        done += r;
+    }
+    return size;
+}
+
+ssize_t WriteBufferT::pwrite(const char* buf, size_t size, off_t offset)
+{
+    off_t end = offset + size;
+    if (_fd < 0 && end > static_cast<off_t>(SPILL_THRESHOLD)) {
+        int err = spill();
+        if (err) {
+            return err;
+        }
+    }
+    if (_fd < 0) {
+        if (end > static_cast<off_t>(_memory.size())) {
+            _memory.resize(end);
+        }
+        memcpy(_memory.data() + offset, buf, size);
+    }
+    else {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t r = ::pwrite(_fd, buf + done, size - done, offset + done);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            done += r;
+        }
+    }
+    _size = max(_size, end);
+    return size;
+}
+
+int WriteBufferT::truncate(off_t size)
+{
+    if (_fd < 0 && size > static_cast<off_t>(SPILL_THRESHOLD)) {
+        int err = spill();
+        if (err) {
+            return err;
+        }
+    }
+    if (_fd < 0) {
+        _memory.resize(size);
+    }
+    else if (ftruncate(_fd, size)) {
+        return -errno;
+    }
+    _size = size;
+    return 0;
+}
+
+void WriteBufferT::clear()
+{
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    vector<char>().swap(_memory);
+    _size = 0;
+}
+
+SourceT WriteBufferT::source(off_t base, off_t size) const
+{
+    if (size < 0) {
+        size = _size - base;
+    }
+    return [this, base, size](char* buf, size_t length, off_t offset) -> ssize_t {
+        if (offset >= size) {
+            return 0;
+        }
+        return pread(buf, min(static_cast<off_t>(length), size - offset), base + offset);
+    };
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "message_stream.h"
+
+// Contents of a file being written.  Small files stay in memory; once a
+// file grows past SPILL_THRESHOLD it moves to an unlinked temporary file
+// and only the kernel's page cache holds it, so writing a few huge files
+// at once doesn't grow the daemon.  Bytes never written read as zeroes.
+class WriteBufferT {
+public:
+    static const size_t SPILL_THRESHOLD = 1024 * 1024;
+
+    WriteBufferT();
+    ~WriteBufferT();
+
+    // where spill files go, the default is $TMPDIR or /tmp
+    static void setSpillDirectory(const std::string& dir);
+
+    off_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    bool spilled() const { return _fd >= 0; }
+
+    ssize_t pread(char* buf, size_t size, off_t offset) const;
+    // returns size, or -errno if the spill file couldn't take it
+    ssize_t pwrite(const char* buf, size_t size, off_t offset);
+    int truncate(off_t size);
+    // back to empty, in memory
+    void clear();
+
+    // reads from this buffer, for MessageStreamT; the buffer has to
+    // outlive the stream
+    SourceT source(off_t base = 0, off_t size = -1) const;
+
+private:
+    WriteBufferT(const WriteBufferT&);
+    WriteBufferT& operator = (const WriteBufferT&);
+
+    int spill();
+
+    std::vector<char> _memory;
+    int _fd;
+    off_t _size;
+};
@@ -0,0 +1,93 @@
+#include <chrono>
+
+#include "log.h"
+#include "fs_log.h"
+#include "inode_table.h"
+#include "writeback.h"
+
+using namespace std;
+
+// how long a worker backs off after a failed upload
+static const int RETRY_DELAY = 5;
+
+WritebackT::WritebackT():
+    _busy(0), _stopping(false)
+{ }
+
+WritebackT::~WritebackT()
+{
+    stop();
+}
+
+void WritebackT::start(size_t threads, FlushT flush)
+{
+    _flush = flush;
+    _stopping = false;
+    for (size_t i = 0; i < threads; ++i) {
+        _threads.push_back(thread(&WritebackT::run, this));
+    }
+}
+
+void WritebackT::stop()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _work.notify_all();
+    for (vector<thread>::iterator iter = _threads.begin(); iter != _threads.end(); ++iter) {
+        iter->join();
+    }
+    _threads.clear();
+}
+
+void WritebackT::enqueue(shared_ptr<NodeT> node)
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (!_queued.insert(node.get()).second) {
+            return;
+        }
+        _queue.push_back(node);
+    }
+    _work.notify_one();
+}
+
+void WritebackT::run()
+{
+    unique_lock<mutex> lock(_mutex);
+    for (;;) {
+        while (_queue.empty() && !_stopping) {
+            _work.wait(lock);
+        }
+        if (_queue.empty()) {
+            // stopping, and nothing left to do
+            return;
+        }
+        shared_ptr<NodeT> n = _queue.front();
+        _queue.pop_front();
+        // taken off the set first, so a close() while we upload queues
+        // the node again
+        _queued.erase(n.get());
+        ++_busy;
+        lock.unlock();
+
+        bool ok = false;
+        try {
+            ok = _flush(n);
+        }
+        catch (std::exception& e) {
+            LOGFN(LOG, CRIT) << "write-back of " << n->_path << " failed: " << e.what();
+        }
+
+        lock.lock();
+        --_busy;
+        if (!ok && !_stopping) {
+            // the journal still has it, try again in a bit
+            if (_queued.insert(n.get()).second) {
+                _queue.push_back(n);
+            }
+            _work.wait_for(lock, chrono::seconds(RETRY_DELAY));
+        }
+    }
+}
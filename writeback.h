@@ -0,0 +1,46 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+struct NodeT;
+
+// Dirty files waiting to be uploaded by a few background threads, so
+// close() doesn't wait for the server.  A node is queued at most once no
+// matter how often it's closed before a worker gets to it.
+class WritebackT {
+public:
+    // uploads one node, false to have it retried later
+    typedef std::function<bool (std::shared_ptr<NodeT>)> FlushT;
+
+    WritebackT();
+    ~WritebackT();
+
+    void start(size_t threads, FlushT flush);
+    // uploads whatever is still queued (once) and stops the workers
+    void stop();
+    bool running() const { return !_threads.empty(); }
+
+    void enqueue(std::shared_ptr<NodeT> node);
+
+private:
+    WritebackT(const WritebackT&);
+    WritebackT& operator = (const WritebackT&);
+
+    void run();
+
+    std::mutex _mutex;
+    std::condition_variable _work;
+    std::deque<std::shared_ptr<NodeT>> _queue;
+    std::set<NodeT*> _queued;
+    size_t _busy;
+    bool _stopping;
+    std::vector<std::thread> _threads;
+    FlushT _flush;
+};